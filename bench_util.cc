@@ -0,0 +1,325 @@
+/*
+ * Helpers for the benchmarks.
+ */
+#include <string>
+#include <vector>
+#include <thread>
+#include <sstream>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include "bench_util.h"
+
+#ifdef __GLIBC__
+/*
+ * Count allocations by interposing malloc() itself, which operator new
+ * and libldap both end up in. free() needs no wrapper.
+ */
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+static std::atomic<unsigned long long> k_Allocations(0);
+
+extern "C" void* malloc(size_t size) __THROW
+{
+	k_Allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t n, size_t size) __THROW
+{
+	k_Allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) __THROW
+{
+	k_Allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+static unsigned long long Allocations()
+{
+	return k_Allocations.load(std::memory_order_relaxed);
+}
+#else
+static unsigned long long Allocations()
+{
+	return 0;
+}
+#endif
+
+namespace ldap_bench
+{
+/**
+ * Build an entry with nattrs attributes of nvalues values each, every
+ * value being len bytes long.
+ */
+Entry MakeEntry(const std::string& dn, int nattrs, int nvalues, int len)
+{
+	Entry e;
+
+	e.dn = dn;
+	for (int i = 0; i < nattrs; i++)
+	{
+		std::ostringstream name;
+
+		name << "attribute" << i;
+		e.attrs.push_back(std::make_pair(name.str(),
+			std::vector<std::string>()));
+
+		for (int j = 0; j < nvalues; j++)
+			e.attrs.back().second.push_back(
+				std::string(len, 'a' + (i + j) % 26));
+	}
+
+	return e;
+}
+
+/**
+ * Encode a complete SearchResultEntry PDU.
+ */
+void EncodeSearchEntry(ldap_client::LDAPBerWriter& ber, int msgid,
+		const Entry& entry)
+{
+	ber.StartSequence();
+	ber.AddInteger(msgid);
+	ber.StartSequence(LDAP_RES_SEARCH_ENTRY);
+	ber.AddOctetString(entry.dn);
+	ber.StartSequence();
+
+	for (Attributes::const_iterator a = entry.attrs.begin();
+			a != entry.attrs.end(); a++)
+	{
+		ber.StartSequence();
+		ber.AddOctetString(a->first);
+		ber.StartSequence(0x31);
+		for (std::vector<std::string>::const_iterator v = a->second.begin();
+				v != a->second.end(); v++)
+			ber.AddOctetString(*v);
+		ber.EndSequence();
+		ber.EndSequence();
+	}
+
+	ber.EndSequence();
+	ber.EndSequence();
+	ber.EndSequence();
+}
+
+/**
+ * Encode a complete SearchResultDone PDU.
+ */
+void EncodeSearchDone(ldap_client::LDAPBerWriter& ber, int msgid, int result)
+{
+	ber.StartSequence();
+	ber.AddInteger(msgid);
+	ber.StartSequence(LDAP_RES_SEARCH_RESULT);
+	ber.AddInteger(result, 0x0a);
+	ber.AddOctetString("", 0);
+	ber.AddOctetString("", 0);
+	ber.EndSequence();
+	ber.EndSequence();
+}
+
+/**
+ * Start counting the allocations of a benchmark. Create the counter right
+ * before the benchmark loop.
+ */
+AllocationCounter::AllocationCounter(benchmark::State& state)
+: _state(state), _start(Allocations()), _paused(0), _excluded(0)
+{
+}
+
+AllocationCounter::~AllocationCounter()
+{
+#ifdef __GLIBC__
+	_state.counters["allocs/op"] = benchmark::Counter(
+		Allocations() - _start - _excluded,
+		benchmark::Counter::kAvgIterations);
+#endif
+}
+
+/**
+ * Stop the timer, and stop counting allocations along with it.
+ */
+void AllocationCounter::PauseTiming()
+{
+	_state.PauseTiming();
+	_paused = Allocations();
+}
+
+void AllocationCounter::ResumeTiming()
+{
+	_excluded += Allocations() - _paused;
+	_state.ResumeTiming();
+}
+
+MessageFactory::MessageFactory()
+{
+	int rc;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, _fds))
+		throw ldap_client::LDAPErrLocalError("socketpair failed");
+
+	rc = ldap_init_fd(_fds[0], LDAP_PROTO_TCP, NULL, &_ldap);
+	if (rc)
+		ldap_client::LDAPErrCode2Exception(NULL, rc);
+
+	_conn = new ldap_client::LDAPConnection(_ldap);
+}
+
+MessageFactory::~MessageFactory()
+{
+	// Closes _fds[0] as well, which ends the responder.
+	delete _conn;
+	if (_responder.joinable())
+		_responder.join();
+	close(_fds[1]);
+}
+
+/**
+ * Issue a search on the session and answer it with the given entries.
+ *
+ * @return The complete result chain; free it with ldap_msgfree().
+ */
+LDAPMessage* MessageFactory::Search(const std::vector<Entry>& entries)
+{
+	LDAPMessage* res = 0;
+	int msgid, rc;
+
+	rc = ldap_search_ext(_ldap, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+			NULL, 0, NULL, NULL, NULL, 0, &msgid);
+	if (rc)
+		ldap_client::LDAPErrCode2Exception(_ldap, rc);
+
+	Drain();
+
+	_ber.Reset();
+	for (std::vector<Entry>::const_iterator e = entries.begin();
+			e != entries.end(); e++)
+		EncodeSearchEntry(_ber, msgid, *e);
+	EncodeSearchDone(_ber, msgid, LDAP_SUCCESS);
+
+	// Write from another thread since the response may not fit into the
+	// socket buffer before libldap starts reading it.
+	std::thread writer([this]() {
+		const char* p = _ber.Data();
+		size_t left = _ber.Length();
+
+		while (left > 0)
+		{
+			ssize_t n = write(_fds[1], p, left);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+			p += n;
+			left -= n;
+		}
+	});
+
+	rc = ldap_result(_ldap, msgid, LDAP_MSG_ALL, NULL, &res);
+	writer.join();
+
+	if (rc != LDAP_RES_SEARCH_RESULT)
+		ldap_client::LDAPErrCode2Exception(_ldap, LDAP_DECODING_ERROR);
+
+	return res;
+}
+
+/**
+ * Answer every add and modify request libldap sends from now on with
+ * success, in the background, so writes can be benchmarked. Search()
+ * can't be used any more afterwards.
+ */
+void MessageFactory::StartResponder()
+{
+	_responder = std::thread(&MessageFactory::Respond, this);
+}
+
+/**
+ * Read one complete request.
+ */
+static bool ReadRequest(int fd, std::vector<char>& buf)
+{
+	size_t header = 2, len = 0, have = 0;
+
+	buf.resize(header);
+	while (have < buf.size())
+	{
+		ssize_t n = read(fd, &buf[have], buf.size() - have);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		have += n;
+
+		if (have == 2 && (buf[1] & 0x80))
+		{
+			header = 2 + (buf[1] & 0x7f);
+			buf.resize(header);
+		}
+		if (have == header)
+		{
+			if (buf[1] & 0x80)
+				for (size_t i = 2; i < header; i++)
+					len = (len << 8) | (unsigned char) buf[i];
+			else
+				len = buf[1];
+			buf.resize(header + len);
+		}
+	}
+
+	return true;
+}
+
+void MessageFactory::Respond()
+{
+	std::vector<char> req(65536);
+	char res[64];
+
+	while (ReadRequest(_fds[1], req))
+	{
+		ldap_client::LDAPBerReader outer(&req[0], req.size());
+		ldap_client::LDAPBerReader msg = outer.ReadSequence();
+		ldap_client::LDAPBerWriter ber(res, sizeof(res));
+		int msgid = msg.ReadInteger();
+		unsigned char op = msg.PeekTag();
+
+		if (op == LDAP_REQ_UNBIND)
+			break;
+
+		ber.StartSequence();
+		ber.AddInteger(msgid);
+		ber.StartSequence(op + 1);
+		ber.AddInteger(LDAP_SUCCESS, 0x0a);
+		ber.AddOctetString("", 0);
+		ber.AddOctetString("", 0);
+		ber.EndSequence();
+		ber.EndSequence();
+
+		if (write(_fds[1], ber.Data(), ber.Length()) !=
+				(ssize_t) ber.Length())
+			break;
+	}
+}
+
+/**
+ * Throw away the requests libldap has sent.
+ */
+void MessageFactory::Drain()
+{
+	char buf[4096];
+
+	while (recv(_fds[1], buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+}
+
+BENCHMARK_MAIN();
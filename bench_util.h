@@ -0,0 +1,84 @@
+/*
+ * Helpers for the benchmarks: synthesize real LDAPMessage chains without
+ * talking to a directory server.
+ */
+
+#ifndef BENCH_UTIL_H_
+#define BENCH_UTIL_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <thread>
+#include <benchmark/benchmark.h>
+#include "ldap++.h"
+
+namespace ldap_bench
+{
+typedef std::vector<std::pair<std::string, std::vector<std::string> > >
+	Attributes;
+
+struct Entry
+{
+	std::string dn;
+	Attributes attrs;
+};
+
+Entry MakeEntry(const std::string& dn, int nattrs, int nvalues, int len);
+void EncodeSearchEntry(ldap_client::LDAPBerWriter& ber, int msgid,
+		const Entry& entry);
+void EncodeSearchDone(ldap_client::LDAPBerWriter& ber, int msgid,
+		int result);
+
+/*
+ * Reports the heap allocations made while a benchmark is running as the
+ * "allocs/op" counter. Allocations are counted in malloc(), so those of
+ * libldap and of other threads are included. Only supported with glibc;
+ * elsewhere the counter is left out.
+ */
+class AllocationCounter
+{
+    public:
+	explicit AllocationCounter(benchmark::State& state);
+	~AllocationCounter();
+
+	void PauseTiming();
+	void ResumeTiming();
+
+    private:
+	benchmark::State& _state;
+	unsigned long long _start;
+	unsigned long long _paused;
+	unsigned long long _excluded;
+};
+
+/*
+ * Feeds encoded server responses into a libldap session over a socket
+ * pair. libldap parses them exactly as if they came from a server, so the
+ * resulting LDAPMessages are indistinguishable from real ones.
+ */
+class MessageFactory
+{
+    public:
+	MessageFactory();
+	~MessageFactory();
+
+	ldap_client::LDAPConnection* GetConnection() { return _conn; }
+	LDAP* GetLDAP() { return _ldap; }
+
+	LDAPMessage* Search(const std::vector<Entry>& entries);
+	void StartResponder();
+
+    private:
+	void Drain();
+	void Respond();
+
+	int _fds[2];
+	std::thread _responder;
+	LDAP* _ldap;
+	ldap_client::LDAPConnection* _conn;
+	ldap_client::LDAPBerWriter _ber;
+};
+}
+
+#endif /* BENCH_UTIL_H_ */
@@ -0,0 +1,168 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include "ldap++.h"
+#include <lber.h>
+
+namespace ldap_client
+{
+/**
+ * Return the tag of the next element without consuming it.
+ *
+ * @return The BER tag, or 0 if there are no more elements.
+ */
+unsigned char LDAPBerReader::PeekTag()
+{
+	if (AtEnd())
+		return 0;
+
+	return *_ptr;
+}
+
+/**
+ * Consume the next element and return its contents.
+ *
+ * @param contents Set to the contents of the element (without tag and
+ *                 length), pointing into the buffer.
+ * @return The BER tag of the element.
+ * @throws LDAPErrDecodingError The element is truncated or malformed.
+ */
+unsigned char LDAPBerReader::ReadElement(struct berval* contents)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(_ptr);
+	const unsigned char* end = reinterpret_cast<const unsigned char*>(_end);
+	unsigned char tag;
+	size_t len;
+
+	if (end - p < 2)
+		throw LDAPErrDecodingError("Truncated BER element");
+
+	tag = *p++;
+	// LDAP only uses single byte tags.
+	if ((tag & 0x1f) == 0x1f)
+		throw LDAPErrDecodingError("Unsupported BER tag");
+
+	len = *p++;
+	if (len & 0x80)
+	{
+		size_t n = len & 0x7f;
+
+		// Indefinite lengths are not allowed in LDAP.
+		if (n == 0 || n > sizeof(size_t) || (size_t) (end - p) < n)
+			throw LDAPErrDecodingError("Invalid BER length");
+
+		for (len = 0; n > 0; n--)
+			len = (len << 8) | *p++;
+	}
+
+	if ((size_t) (end - p) < len)
+		throw LDAPErrDecodingError("Truncated BER element");
+
+	contents->bv_val = const_cast<char*>(reinterpret_cast<const char*>(p));
+	contents->bv_len = len;
+	_ptr = reinterpret_cast<const char*>(p + len);
+
+	return tag;
+}
+
+/**
+ * Consume a constructed element and return a reader for its contents.
+ *
+ * @param tag Expected BER tag, e.g. 0x31 for a SET.
+ * @return Reader positioned at the first element of the sequence.
+ * @throws LDAPErrDecodingError The element has an unexpected tag.
+ */
+LDAPBerReader LDAPBerReader::ReadSequence(unsigned char tag)
+{
+	struct berval bv;
+
+	if (ReadElement(&bv) != tag)
+		throw LDAPErrDecodingError("Unexpected BER tag");
+
+	return LDAPBerReader(bv);
+}
+
+/**
+ * Consume an OCTET STRING without copying it.
+ *
+ * @param str Set to the contents of the string.
+ * @param tag Expected BER tag.
+ * @throws LDAPErrDecodingError The element has an unexpected tag.
+ */
+void LDAPBerReader::ReadOctetString(struct berval* str, unsigned char tag)
+{
+	if (ReadElement(str) != tag)
+		throw LDAPErrDecodingError("Unexpected BER tag");
+}
+
+/**
+ * Consume an OCTET STRING and copy it into a string.
+ *
+ * @param tag Expected BER tag.
+ * @return The contents of the string.
+ * @throws LDAPErrDecodingError The element has an unexpected tag.
+ */
+std::string LDAPBerReader::ReadString(unsigned char tag)
+{
+	struct berval bv;
+
+	ReadOctetString(&bv, tag);
+	return std::string(bv.bv_val, bv.bv_len);
+}
+
+/**
+ * Consume an INTEGER or ENUMERATED element.
+ *
+ * @param tag Expected BER tag.
+ * @return The decoded value.
+ * @throws LDAPErrDecodingError The element is malformed or too large.
+ */
+long LDAPBerReader::ReadInteger(unsigned char tag)
+{
+	struct berval bv;
+	const unsigned char* p;
+	unsigned long value;
+
+	if (ReadElement(&bv) != tag)
+		throw LDAPErrDecodingError("Unexpected BER tag");
+
+	if (bv.bv_len == 0 || bv.bv_len > sizeof(long))
+		throw LDAPErrDecodingError("Invalid BER integer");
+
+	p = reinterpret_cast<const unsigned char*>(bv.bv_val);
+	// Sign extend from the first byte.
+	value = (p[0] & 0x80) ? ~0UL : 0UL;
+	for (size_t i = 0; i < bv.bv_len; i++)
+		value = (value << 8) | p[i];
+
+	return (long) value;
+}
+
+/**
+ * Consume a BOOLEAN element.
+ *
+ * @param tag Expected BER tag.
+ * @return The decoded value.
+ * @throws LDAPErrDecodingError The element is malformed.
+ */
+bool LDAPBerReader::ReadBoolean(unsigned char tag)
+{
+	struct berval bv;
+
+	if (ReadElement(&bv) != tag || bv.bv_len != 1)
+		throw LDAPErrDecodingError("Invalid BER boolean");
+
+	return bv.bv_val[0] != 0;
+}
+
+/**
+ * Consume the next element, whatever it is.
+ */
+void LDAPBerReader::Skip()
+{
+	struct berval bv;
+
+	ReadElement(&bv);
+}
+}
@@ -0,0 +1,218 @@
+/*
+ * ber_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <string>
+#include "ldap++.h"
+
+using namespace std;
+
+namespace testing {
+class BerTest : public CppUnit::TestCase {
+	CPPUNIT_TEST_SUITE(BerTest);
+	CPPUNIT_TEST(testInteger);
+	CPPUNIT_TEST(testPageControl);
+	CPPUNIT_TEST(testLongSequence);
+	CPPUNIT_TEST(testFixedBuffer);
+	CPPUNIT_TEST(testReader);
+	CPPUNIT_TEST(testReaderTruncated);
+	CPPUNIT_TEST(testEntryDecoder);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void testInteger();
+	void testPageControl();
+	void testLongSequence();
+	void testFixedBuffer();
+	void testReader();
+	void testReaderTruncated();
+	void testEntryDecoder();
+
+private:
+	string encoded(ldap_client::LDAPBerWriter& w);
+};
+
+string
+BerTest::encoded(ldap_client::LDAPBerWriter& w)
+{
+	return string(w.Data(), w.Length());
+}
+
+void
+BerTest::testInteger()
+{
+	ldap_client::LDAPBerWriter w;
+
+	w.AddInteger(0);
+	CPPUNIT_ASSERT_EQUAL(string("\x02\x01\x00", 3), encoded(w));
+	w.Reset();
+	w.AddInteger(127);
+	CPPUNIT_ASSERT_EQUAL(string("\x02\x01\x7f", 3), encoded(w));
+	w.Reset();
+	w.AddInteger(128);
+	CPPUNIT_ASSERT_EQUAL(string("\x02\x02\x00\x80", 4), encoded(w));
+	w.Reset();
+	w.AddInteger(-1);
+	CPPUNIT_ASSERT_EQUAL(string("\x02\x01\xff", 3), encoded(w));
+	w.Reset();
+	w.AddInteger(-129);
+	CPPUNIT_ASSERT_EQUAL(string("\x02\x02\xff\x7f", 4), encoded(w));
+	w.Reset();
+	w.AddInteger(2147483647L);
+	CPPUNIT_ASSERT_EQUAL(string("\x02\x04\x7f\xff\xff\xff", 6), encoded(w));
+}
+
+void
+BerTest::testPageControl()
+{
+	ldap_client::LDAPBerWriter w;
+	struct berval bv;
+
+	w.StartSequence();
+	w.AddInteger(100);
+	w.AddOctetString("", 0);
+	w.EndSequence();
+	w.GetValue(&bv);
+
+	CPPUNIT_ASSERT_EQUAL(string("\x30\x05\x02\x01\x64\x04\x00", 7),
+		string(bv.bv_val, bv.bv_len));
+
+	w.Reset();
+	w.StartSequence();
+	w.AddInteger(500);
+	w.AddOctetString(string("ck"));
+	w.EndSequence();
+	CPPUNIT_ASSERT_EQUAL(string("\x30\x08\x02\x02\x01\xf4\x04\x02" "ck", 10),
+		encoded(w));
+}
+
+void
+BerTest::testLongSequence()
+{
+	ldap_client::LDAPBerWriter w;
+	string value(300, 'x');
+	string expected("\x30\x82\x01\x30\x04\x82\x01\x2c", 8);
+
+	w.StartSequence();
+	w.AddOctetString(value);
+	w.EndSequence();
+
+	CPPUNIT_ASSERT_EQUAL(expected + value, encoded(w));
+}
+
+void
+BerTest::testFixedBuffer()
+{
+	char buf[8];
+	ldap_client::LDAPBerWriter w(buf, sizeof(buf));
+
+	w.StartSequence();
+	w.AddBoolean(true);
+	w.EndSequence();
+	CPPUNIT_ASSERT_EQUAL(string("\x30\x03\x01\x01\xff", 5), encoded(w));
+	CPPUNIT_ASSERT(w.Data() == buf);
+
+	w.Reset();
+	CPPUNIT_ASSERT_THROW(w.AddOctetString(string(16, 'x')),
+		ldap_client::LDAPErrEncodingError);
+	CPPUNIT_ASSERT_THROW(w.EndSequence(), ldap_client::LDAPErrEncodingError);
+}
+
+void
+BerTest::testReader()
+{
+	ldap_client::LDAPBerWriter w;
+	string value(300, 'x');
+
+	w.StartSequence();
+	w.AddInteger(-129);
+	w.AddInteger(2147483647L);
+	w.AddBoolean(true);
+	w.AddOctetString(value);
+	w.AddInteger(3, 0x0a);
+	w.EndSequence();
+
+	ldap_client::LDAPBerReader r(w.Data(), w.Length());
+	ldap_client::LDAPBerReader seq = r.ReadSequence();
+
+	CPPUNIT_ASSERT(r.AtEnd());
+	CPPUNIT_ASSERT_EQUAL(-129L, seq.ReadInteger());
+	CPPUNIT_ASSERT_EQUAL(2147483647L, seq.ReadInteger());
+	CPPUNIT_ASSERT(seq.ReadBoolean());
+	CPPUNIT_ASSERT_EQUAL(value, seq.ReadString());
+	CPPUNIT_ASSERT_EQUAL((unsigned char) 0x0a, seq.PeekTag());
+	CPPUNIT_ASSERT_THROW(seq.ReadInteger(),
+		ldap_client::LDAPErrDecodingError);
+}
+
+void
+BerTest::testReaderTruncated()
+{
+	ldap_client::LDAPBerReader r1("\x04\x05" "abc", 5);
+	ldap_client::LDAPBerReader r2("\x04\x80", 2);
+	ldap_client::LDAPBerReader r3("\x04", 1);
+
+	CPPUNIT_ASSERT_THROW(r1.ReadString(), ldap_client::LDAPErrDecodingError);
+	CPPUNIT_ASSERT_THROW(r2.ReadString(), ldap_client::LDAPErrDecodingError);
+	CPPUNIT_ASSERT_THROW(r3.ReadString(), ldap_client::LDAPErrDecodingError);
+}
+
+void
+BerTest::testEntryDecoder()
+{
+	ldap_client::LDAPBerWriter w;
+	struct berval entry, name, value;
+
+	w.AddOctetString(string("cn=a,dc=example,dc=com"));
+	w.StartSequence();
+	w.StartSequence();
+	w.AddOctetString(string("cn"));
+	w.StartSequence(0x31);
+	w.AddOctetString(string("a"));
+	w.EndSequence();
+	w.EndSequence();
+	w.StartSequence();
+	w.AddOctetString(string("mail"));
+	w.StartSequence(0x31);
+	w.AddOctetString(string("a@example.com"));
+	w.AddOctetString(string("b@example.com"));
+	w.EndSequence();
+	w.EndSequence();
+	w.EndSequence();
+	w.GetValue(&entry);
+
+	ldap_client::LDAPEntryDecoder d(entry);
+
+	CPPUNIT_ASSERT_EQUAL(string("cn=a,dc=example,dc=com"),
+		string(d.GetDN().bv_val, d.GetDN().bv_len));
+
+	CPPUNIT_ASSERT(d.NextAttribute(&name));
+	CPPUNIT_ASSERT_EQUAL(string("cn"), string(name.bv_val, name.bv_len));
+	// Unread values are skipped.
+	CPPUNIT_ASSERT(d.NextAttribute(&name));
+	CPPUNIT_ASSERT_EQUAL(string("mail"), string(name.bv_val, name.bv_len));
+	CPPUNIT_ASSERT(d.NextValue(&value));
+	CPPUNIT_ASSERT_EQUAL(string("a@example.com"),
+		string(value.bv_val, value.bv_len));
+	CPPUNIT_ASSERT(d.NextValue(&value));
+	CPPUNIT_ASSERT_EQUAL(string("b@example.com"),
+		string(value.bv_val, value.bv_len));
+	CPPUNIT_ASSERT(!d.NextValue(&value));
+	CPPUNIT_ASSERT(!d.NextAttribute(&name));
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(BerTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
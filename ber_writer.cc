@@ -0,0 +1,224 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "ldap++.h"
+#include <lber.h>
+
+namespace ldap_client
+{
+/**
+ * Create a writer which owns its buffer. The buffer grows as needed and
+ * is kept across calls to Reset(), so a long-lived writer stops
+ * allocating once it has seen the largest value it has to encode.
+ */
+LDAPBerWriter::LDAPBerWriter()
+: _buf(0), _size(0), _len(0), _fixed(false), _depth(0)
+{
+	_storage.resize(64);
+	_buf = &_storage[0];
+	_size = _storage.size();
+}
+
+/**
+ * Create a writer encoding into the given buffer. The buffer is never
+ * reallocated; encoding more than size bytes throws an exception.
+ *
+ * @param buf  Buffer to encode into.
+ * @param size Size of the buffer in bytes.
+ */
+LDAPBerWriter::LDAPBerWriter(char* buf, size_t size)
+: _buf(buf), _size(size), _len(0), _fixed(true), _depth(0)
+{
+}
+
+/**
+ * Discard the encoded data, keeping the buffer for reuse.
+ */
+void LDAPBerWriter::Reset()
+{
+	_len = 0;
+	_depth = 0;
+}
+
+/**
+ * Open a constructed element (SEQUENCE by default). The length is filled
+ * in by the matching call to EndSequence().
+ *
+ * @param tag BER tag of the element, e.g. 0x31 for a SET.
+ * @throws LDAPErrEncodingError Sequences are nested too deeply.
+ */
+void LDAPBerWriter::StartSequence(unsigned char tag)
+{
+	if (_depth >= kMaxDepth)
+		throw LDAPErrEncodingError("BER sequences nested too deeply");
+
+	Reserve(2);
+	_buf[_len++] = tag;
+	_seq[_depth++] = _len;
+	// Placeholder for the length, which is usually a single byte.
+	_buf[_len++] = 0;
+}
+
+/**
+ * Close the most recently opened constructed element.
+ *
+ * @throws LDAPErrEncodingError No sequence is open.
+ */
+void LDAPBerWriter::EndSequence()
+{
+	size_t off, len, n = 0;
+
+	if (_depth == 0)
+		throw LDAPErrEncodingError("No open BER sequence");
+
+	off = _seq[--_depth];
+	len = _len - off - 1;
+
+	if (len < 0x80)
+	{
+		_buf[off] = len;
+		return;
+	}
+
+	for (size_t l = len; l > 0; l >>= 8)
+		n++;
+
+	// Make room for the long form length and move the contents up.
+	Reserve(n);
+	memmove(_buf + off + 1 + n, _buf + off + 1, len);
+	_len += n;
+
+	_buf[off] = 0x80 | n;
+	for (size_t i = n; i > 0; i--, len >>= 8)
+		_buf[off + i] = len & 0xff;
+}
+
+/**
+ * Append an INTEGER (or ENUMERATED, with tag 0x0a) in minimal two's
+ * complement encoding.
+ *
+ * @param value The value to encode.
+ * @param tag   BER tag of the element.
+ */
+void LDAPBerWriter::AddInteger(long value, unsigned char tag)
+{
+	unsigned char tmp[sizeof(long) + 1];
+	size_t n = 0;
+	long v = value;
+
+	do
+	{
+		tmp[n++] = v & 0xff;
+		v >>= 8;
+	}
+	while (!((v == 0 && !(tmp[n - 1] & 0x80)) ||
+			(v == -1 && (tmp[n - 1] & 0x80))));
+
+	Reserve(2 + n);
+	_buf[_len++] = tag;
+	_buf[_len++] = n;
+	while (n > 0)
+		_buf[_len++] = tmp[--n];
+}
+
+/**
+ * Append a BOOLEAN.
+ *
+ * @param value The value to encode.
+ * @param tag   BER tag of the element.
+ */
+void LDAPBerWriter::AddBoolean(bool value, unsigned char tag)
+{
+	Reserve(3);
+	_buf[_len++] = tag;
+	_buf[_len++] = 1;
+	_buf[_len++] = value ? 0xff : 0x00;
+}
+
+/**
+ * Append an OCTET STRING.
+ *
+ * @param data Contents of the string.
+ * @param len  Length of the string in bytes.
+ * @param tag  BER tag of the element.
+ */
+void LDAPBerWriter::AddOctetString(const char* data, size_t len,
+	unsigned char tag)
+{
+	Reserve(1 + 1 + sizeof(size_t) + len);
+	_buf[_len++] = tag;
+	PutLength(len);
+	if (len > 0)
+		memcpy(_buf + _len, data, len);
+	_len += len;
+}
+
+/**
+ * Append an OCTET STRING.
+ *
+ * @param str Contents of the string.
+ * @param tag BER tag of the element.
+ */
+void LDAPBerWriter::AddOctetString(const std::string& str, unsigned char tag)
+{
+	AddOctetString(str.data(), str.length(), tag);
+}
+
+/**
+ * Point the given berval at the encoded data. The data remains owned by
+ * the writer and is only valid until the next modification.
+ *
+ * @param bv berval to fill in, e.g. the ldctl_value of an LDAPControl.
+ * @throws LDAPErrEncodingError A sequence has not been closed.
+ */
+void LDAPBerWriter::GetValue(struct berval* bv)
+{
+	if (_depth != 0)
+		throw LDAPErrEncodingError("Unterminated BER sequence");
+
+	bv->bv_val = _buf;
+	bv->bv_len = _len;
+}
+
+/**
+ * Ensure there is room for n more bytes in the buffer.
+ */
+void LDAPBerWriter::Reserve(size_t n)
+{
+	if (_len + n <= _size)
+		return;
+
+	if (_fixed)
+		throw LDAPErrEncodingError("BER buffer too small");
+
+	_storage.resize(std::max(_storage.size() * 2, _len + n));
+	_buf = &_storage[0];
+	_size = _storage.size();
+}
+
+/**
+ * Append a definite length in the shortest form. The caller must have
+ * reserved enough space.
+ */
+void LDAPBerWriter::PutLength(size_t len)
+{
+	size_t n = 0;
+
+	if (len < 0x80)
+	{
+		_buf[_len++] = len;
+		return;
+	}
+
+	for (size_t l = len; l > 0; l >>= 8)
+		n++;
+
+	_buf[_len++] = 0x80 | n;
+	for (size_t i = n; i > 0; i--)
+		_buf[_len++] = (len >> ((i - 1) * 8)) & 0xff;
+}
+}
@@ -0,0 +1,760 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <poll.h>
+#include <openssl/sha.h>
+#include "ldap++.h"
+#include <ldap.h>
+
+namespace ldap_client
+{
+// LDAP_SERVER_FAST_BIND_OID: after this extended operation, binds on the
+// connection only check the credentials and may be sent concurrently.
+static const char k_FastBindOID[] = "1.2.840.113556.1.4.1781";
+
+/*
+ * A pooled connection and the binds outstanding on it, by message ID.
+ */
+struct LDAPBindVerifier::Slot
+{
+	Slot() : ld(0), fast(false) {}
+
+	LDAP* ld;
+	bool fast;
+	std::map<int, size_t> pending;
+};
+
+/**
+ * Create a verifier for the given server. Connections are opened on
+ * demand, so no connection is made until the first verification.
+ *
+ * @param uri         URI of the LDAP server.
+ * @param connections Maximum number of connections in the pool.
+ */
+LDAPBindVerifier::LDAPBindVerifier(const std::string uri, int connections)
+: _uri(uri), _stats(LDAPServerStats::Get(uri)),
+	_wire(_stats, kLdapOpBind), _connections(connections),
+	_max_outstanding(32),
+	_timeout(5000), _fast_bind(true), _fast_supported(-1), _open(0),
+	_cache_ttl(0), _cache_size(0)
+{
+	if (connections < 1)
+		throw LDAPErrParamError("At least one connection is required");
+}
+
+/**
+ * Close all pooled connections. Verifications still in progress are
+ * waited for, as their connections are only returned to the pool when
+ * they finish; no new ones may be started.
+ */
+LDAPBindVerifier::~LDAPBindVerifier()
+{
+	std::unique_lock<std::mutex> guard(_lock);
+
+	while ((int) _idle.size() < _open)
+		_released.wait(guard);
+
+	for (size_t i = 0; i < _idle.size(); i++)
+	{
+		ldap_unbind_ext_s(_idle[i]->ld, 0, 0);
+		_stats->AddConnections(-1);
+		delete _idle[i];
+	}
+}
+
+/**
+ * Control whether new connections request fast bind mode. The mode is
+ * only used if the server supports it (e.g. Active Directory); otherwise
+ * each connection carries a single bind at a time. Enabled by default.
+ *
+ * @param enabled Whether to request fast bind mode.
+ */
+void LDAPBindVerifier::SetFastBind(bool enabled)
+{
+	_fast_bind = enabled;
+}
+
+/**
+ * Set the number of binds pipelined on a connection in fast bind mode.
+ * The default is 32.
+ *
+ * @param outstanding Maximum number of outstanding binds per connection.
+ */
+void LDAPBindVerifier::SetMaxOutstanding(int outstanding)
+{
+	if (outstanding < 1)
+		throw LDAPErrParamError("At least one outstanding bind is required");
+
+	_max_outstanding = outstanding;
+}
+
+/**
+ * Set how long a call to Verify may take in total, including waiting for
+ * a pooled connection and setting up new ones. The default is 5000.
+ *
+ * @param timeout Number of milliseconds.
+ */
+void LDAPBindVerifier::SetTimeout(long timeout)
+{
+	_timeout = timeout;
+}
+
+/**
+ * Remember successful verifications for the given time, so repeated
+ * logins with the same password are answered without asking the server.
+ * Only a salted SHA-256 hash of each password is kept, in memory. A
+ * password changed on the server keeps working until its entry expires
+ * or is invalidated, so the TTL should be short. Failed verifications
+ * are never cached and drop the entry for the DN.
+ *
+ * @param ttl         Number of milliseconds an entry stays valid, or 0 to
+ *                    disable the cache.
+ * @param max_entries Maximum number of DNs to remember.
+ */
+void LDAPBindVerifier::EnableCache(long ttl, size_t max_entries)
+{
+	std::random_device rnd;
+	std::lock_guard<std::mutex> guard(_lock);
+
+	_cache_ttl = ttl;
+	_cache_size = max_entries;
+	_cache.clear();
+
+	if (_salt.empty())
+		for (int i = 0; i < 16; i++)
+			_salt.push_back((char) rnd());
+}
+
+/**
+ * Forget the cached verification for a DN, e.g. after its password has
+ * been changed or the account disabled.
+ *
+ * @param dn DN of the user, as passed to Verify().
+ */
+void LDAPBindVerifier::Invalidate(const std::string dn)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	_cache.erase(dn);
+}
+
+/**
+ * Forget all cached verifications.
+ */
+void LDAPBindVerifier::InvalidateAll()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	_cache.clear();
+}
+
+/**
+ * Check a single password.
+ *
+ * @param dn       DN of the user.
+ * @param password Password to check.
+ * @return true if the server accepted the password, false if it did not
+ *         or the password is empty.
+ * @throws LDAPErrTimeout The server did not answer in time.
+ * @throws LDAPException The password could not be checked.
+ */
+bool LDAPBindVerifier::Verify(const std::string dn, const std::string password)
+{
+	return Verify(std::vector<LDAPCredential>(1,
+		LDAPCredential(dn, password)))[0];
+}
+
+/**
+ * Check a batch of passwords. The binds are spread over as many idle
+ * connections as are needed and the responses are collected as they
+ * arrive, so the batch takes about as long as its slowest bind. Binds
+ * lost to a broken connection are retried once on a new one.
+ *
+ * Empty passwords are rejected without asking the server, since a simple
+ * bind without a password is an unauthenticated bind which succeeds.
+ *
+ * @param creds Credentials to check.
+ * @return For each credential, whether the server accepted it.
+ * @throws LDAPErrTimeout The server did not answer in time.
+ * @throws LDAPException A bind failed for reasons other than invalid
+ *                       credentials, or no connection could be made.
+ */
+std::vector<bool> LDAPBindVerifier::Verify(
+	const std::vector<LDAPCredential>& creds)
+{
+	LDAPDeadline deadline = std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(_timeout);
+	std::vector<bool> result(creds.size(), false);
+	// Number of times each bind has been sent.
+	std::vector<int> tries(creds.size(), 0);
+	std::vector<LDAPTimePoint> sent(creds.size());
+	std::deque<size_t> queue;
+	std::vector<Slot*> slots;
+	std::vector<struct pollfd> fds;
+	size_t capacity = 0;
+	int failure = LDAP_OTHER;
+	LDAPTracer* tracer = LDAPGetTracer();
+	std::vector<LDAPTraceEvent> events(tracer ? creds.size() : 0);
+
+	auto trace_end = [&](size_t index, int rc) {
+		if (!tracer)
+			return;
+		events[index].result = rc;
+		tracer->OnEnd(events[index]);
+	};
+
+	// Close a broken connection and queue its binds for another one.
+	auto drop = [&](size_t i) {
+		Slot* slot = slots[i];
+
+		for (std::map<int, size_t>::iterator it = slot->pending.begin();
+				it != slot->pending.end(); it++)
+		{
+			trace_end(it->second, LDAP_SERVER_DOWN);
+			queue.push_front(it->second);
+		}
+
+		slots.erase(slots.begin() + i);
+		Release(slot, true);
+	};
+
+	for (size_t i = 0; i < creds.size(); i++)
+		if (CacheLookup(creds[i]))
+			result[i] = true;
+		else if (!creds[i].password.empty())
+			queue.push_back(i);
+
+	if (queue.empty())
+		return result;
+
+	try
+	{
+		// Take more connections only while they are idle, so one large
+		// batch doesn't starve concurrent callers.
+		for (Slot* slot = Acquire(true, deadline); slot;
+				slot = Acquire(false, deadline))
+		{
+			slots.push_back(slot);
+			capacity += slot->fast ? _max_outstanding : 1;
+			if (capacity >= queue.size())
+				break;
+		}
+
+		for (;;)
+		{
+			bool busy = false;
+			long wait;
+
+			for (size_t i = slots.size(); i > 0; i--)
+			{
+				Slot* slot = slots[i - 1];
+				size_t limit = slot->fast ? _max_outstanding : 1;
+
+				while (!queue.empty() && slot->pending.size() < limit)
+				{
+					size_t index = queue.front();
+					int msgid;
+
+					if (++tries[index] > 2)
+						throw LDAPErrServerDown(
+							"Connection lost during bind verification");
+
+					if (tracer)
+					{
+						LDAPTraceEvent& event = events[index];
+
+						event.op = kLdapOpBind;
+						event.server = _stats->GetServer().c_str();
+						event.dn = creds[index].dn.c_str();
+						event.scope = -1;
+						event.filter_hash = 0;
+						event.msgid = -1;
+						event.entries = 0;
+						event.bytes = 0;
+						event.result = LDAP_SUCCESS;
+						event.context = 0;
+						tracer->OnStart(event);
+					}
+
+					sent[index] = std::chrono::steady_clock::now();
+					msgid = Send(slot, creds[index], index);
+					if (msgid < 0)
+					{
+						trace_end(index, LDAP_SERVER_DOWN);
+						break;
+					}
+					if (tracer)
+						events[index].msgid = msgid;
+					queue.pop_front();
+				}
+
+				if (!queue.empty() && slot->pending.size() < limit)
+					drop(i - 1);
+				else
+					busy = busy || !slot->pending.empty();
+			}
+
+			if (slots.empty())
+			{
+				slots.push_back(Acquire(true, deadline));
+				continue;
+			}
+
+			if (!busy && queue.empty())
+				break;
+
+			wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()).count();
+			if (wait <= 0)
+			{
+				failure = LDAP_TIMEOUT;
+				throw LDAPErrTimeout("Bind verification timed out");
+			}
+
+			fds.clear();
+			for (size_t i = 0; i < slots.size(); i++)
+			{
+				struct pollfd pfd;
+
+				pfd.fd = -1;
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+				if (!slots[i]->pending.empty())
+					ldap_get_option(slots[i]->ld, LDAP_OPT_DESC, &pfd.fd);
+				fds.push_back(pfd);
+			}
+
+			poll(&fds[0], fds.size(), wait);
+
+			for (size_t i = slots.size(); i > 0; i--)
+			{
+				Slot* slot = slots[i - 1];
+				struct timeval zero = { 0, 0 };
+				LDAPMessage* msg;
+				int rc, err;
+
+				if (slot->pending.empty() || !fds[i - 1].revents)
+					continue;
+
+				// Drain everything libldap has buffered, so poll() only
+				// has to report data still on the socket.
+				while ((rc = ldap_result(slot->ld, LDAP_RES_ANY, LDAP_MSG_ALL,
+						&zero, &msg)) > 0)
+				{
+					std::map<int, size_t>::iterator it =
+						slot->pending.find(ldap_msgid(msg));
+
+					if (it == slot->pending.end())
+					{
+						ldap_msgfree(msg);
+						continue;
+					}
+
+					size_t index = it->second;
+					slot->pending.erase(it);
+					_stats->AddInFlight(-1);
+					_stats->Record(kLdapOpBind, sent[index]);
+
+					rc = ldap_parse_result(slot->ld, msg, &err, 0, 0, 0, 0, 1);
+					if (rc != LDAP_SUCCESS)
+						err = rc;
+					if (err != LDAP_SUCCESS)
+						_stats->AddError(err);
+					trace_end(index, err);
+
+					if (err == LDAP_SUCCESS)
+						result[index] = true;
+					else if (err != LDAP_INVALID_CREDENTIALS &&
+							err != LDAP_INAPPROPRIATE_AUTH)
+						LDAPErrCode2Exception(slot->ld, err);
+
+					CacheStore(creds[index], result[index]);
+				}
+
+				if (rc < 0)
+					drop(i - 1);
+			}
+
+			if (slots.empty())
+				slots.push_back(Acquire(true, deadline));
+		}
+	}
+	catch (...)
+	{
+		// Late responses must not be mistaken for answers to another
+		// batch, so connections with binds outstanding are recycled.
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			for (std::map<int, size_t>::iterator it =
+					slots[i]->pending.begin(); it != slots[i]->pending.end();
+					it++)
+				trace_end(it->second, failure);
+			Release(slots[i], !slots[i]->pending.empty());
+		}
+		throw;
+	}
+
+	for (size_t i = 0; i < slots.size(); i++)
+		Release(slots[i], false);
+
+	return result;
+}
+
+/**
+ * Take a connection from the pool, opening a new one if the pool is not
+ * full yet.
+ *
+ * @param wait     Whether to wait for a connection to be released if all
+ *                 are in use.
+ * @param deadline When to give up waiting or setting up a connection.
+ * @return The connection, or NULL if wait is false and none is available.
+ * @throws LDAPErrTimeout No connection became available in time.
+ * @throws LDAPException A new connection could not be set up.
+ */
+LDAPBindVerifier::Slot* LDAPBindVerifier::Acquire(bool wait,
+	LDAPDeadline deadline)
+{
+	std::unique_lock<std::mutex> guard(_lock);
+	Slot* slot;
+
+	for (;;)
+	{
+		if (!_idle.empty())
+		{
+			slot = _idle.back();
+			_idle.pop_back();
+			return slot;
+		}
+
+		if (_open < _connections)
+			break;
+
+		if (!wait)
+			return 0;
+
+		if (std::chrono::steady_clock::now() >= deadline)
+		{
+			guard.unlock();
+			_stats->AddError(LDAP_TIMEOUT);
+			throw LDAPErrTimeout("No connection available for bind "
+				"verification");
+		}
+
+		_released.wait_until(guard, deadline);
+	}
+
+	_open++;
+	guard.unlock();
+
+	slot = new Slot;
+	try
+	{
+		Connect(slot, deadline);
+	}
+	catch (...)
+	{
+		Release(slot, true);
+		throw;
+	}
+
+	return slot;
+}
+
+/**
+ * Return a connection to the pool.
+ *
+ * @param slot   The connection.
+ * @param broken If true, the connection is closed instead so a new one
+ *               is opened next time.
+ */
+void LDAPBindVerifier::Release(Slot* slot, bool broken)
+{
+	_stats->AddInFlight(-(long) slot->pending.size());
+	slot->pending.clear();
+
+	if (broken)
+	{
+		if (slot->ld)
+		{
+			ldap_unbind_ext_s(slot->ld, 0, 0);
+			_stats->AddConnections(-1);
+		}
+		delete slot;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+
+		if (broken)
+			_open--;
+		else
+			_idle.push_back(slot);
+	}
+
+	// Wakes the destructor as well as callers waiting for a connection.
+	_released.notify_all();
+}
+
+/**
+ * Open a new connection and, if enabled, switch it to fast bind mode.
+ * Once a server has refused fast bind mode it is not asked again.
+ *
+ * @param slot     The pooled connection to set up.
+ * @param deadline When to give up connecting and waiting for the answer
+ *                 to the fast bind request.
+ * @throws LDAPErrTimeout The deadline passed.
+ * @throws LDAPException The connection could not be set up.
+ */
+void LDAPBindVerifier::Connect(Slot* slot, LDAPDeadline deadline)
+{
+	int version = LDAP_VERSION3;
+	LDAPMessage* res = 0;
+	struct timeval tv;
+	long long usec;
+	int msgid, rc, err;
+
+	rc = ldap_initialize(&slot->ld, _uri.c_str());
+	if (rc)
+		LDAPErrCode2Exception(slot->ld, rc);
+	_stats->AddConnections(1);
+	_wire.Install(slot->ld);
+
+	rc = ldap_set_option(slot->ld, LDAP_OPT_PROTOCOL_VERSION, &version);
+	if (rc)
+		LDAPErrCode2Exception(slot->ld, rc);
+
+	// Bounds connecting, which happens with the first request.
+	usec = std::max<long long>(1,
+		std::chrono::duration_cast<std::chrono::microseconds>(
+			deadline - std::chrono::steady_clock::now()).count());
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+	rc = ldap_set_option(slot->ld, LDAP_OPT_NETWORK_TIMEOUT, &tv);
+	if (rc)
+		LDAPErrCode2Exception(slot->ld, rc);
+
+	if (!_fast_bind || _fast_supported == 0)
+		return;
+
+	rc = ldap_extended_operation(slot->ld, k_FastBindOID, 0, 0, 0, &msgid);
+	if (rc == LDAP_SUCCESS)
+	{
+		usec = std::max<long long>(1,
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				deadline - std::chrono::steady_clock::now()).count());
+		tv.tv_sec = usec / 1000000;
+		tv.tv_usec = usec % 1000000;
+
+		rc = ldap_result(slot->ld, msgid, LDAP_MSG_ALL, &tv, &res);
+		if (rc == 0)
+		{
+			ldap_abandon_ext(slot->ld, msgid, 0, 0);
+			_stats->AddError(LDAP_TIMEOUT);
+			throw LDAPErrTimeout("Fast bind request timed out");
+		}
+		else if (rc < 0)
+		{
+			ldap_get_option(slot->ld, LDAP_OPT_RESULT_CODE, &rc);
+			rc = rc ? rc : LDAP_SERVER_DOWN;
+		}
+		else
+		{
+			rc = ldap_parse_result(slot->ld, res, &err, 0, 0, 0, 0, 1);
+			if (rc == LDAP_SUCCESS)
+				rc = err;
+		}
+	}
+
+	if (rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR ||
+			rc == LDAP_TIMEOUT)
+		LDAPErrCode2Exception(slot->ld, rc);
+
+	slot->fast = rc == LDAP_SUCCESS;
+	_fast_supported = slot->fast ? 1 : 0;
+}
+
+/**
+ * Send a simple bind on the given connection.
+ *
+ * @param slot  The connection to send the bind on.
+ * @param cred  The credentials to check.
+ * @param index Position of the credentials in the batch.
+ * @return The message ID of the bind, or -1 if it could not be sent
+ *         because the connection is broken.
+ */
+int LDAPBindVerifier::Send(Slot* slot, const LDAPCredential& cred,
+	size_t index)
+{
+	struct berval passwd;
+	int msgid, rc;
+
+	passwd.bv_val = const_cast<char*>(cred.password.data());
+	passwd.bv_len = cred.password.length();
+
+	rc = ldap_sasl_bind(slot->ld, cred.dn.c_str(), LDAP_SASL_SIMPLE,
+			&passwd, 0, 0, &msgid);
+	if (rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR)
+	{
+		// Let the result loop notice the broken connection.
+		return -1;
+	}
+	if (rc)
+		LDAPErrCode2Exception(slot->ld, rc);
+
+	slot->pending[msgid] = index;
+	_stats->AddInFlight(1);
+	return msgid;
+}
+
+/**
+ * Compute the SHA-256 digest of the given data. Used so the credential
+ * cache never holds passwords in the clear.
+ *
+ * @param data Data to hash.
+ * @return The 32 byte digest.
+ */
+std::string LDAPBindVerifier::Sha256(const std::string& data)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+
+	SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.length(),
+		digest);
+	return std::string(reinterpret_cast<char*>(digest), sizeof(digest));
+}
+
+/**
+ * Salted hash identifying a DN and password pair in the cache.
+ *
+ * @param salt The salt chosen by EnableCache.
+ * @param cred The credentials to hash.
+ */
+std::string LDAPBindVerifier::Hash(const std::string& salt,
+	const LDAPCredential& cred)
+{
+	std::string data(salt);
+
+	data.append(cred.dn);
+	data.push_back(0);
+	data.append(cred.password);
+	return Sha256(data);
+}
+
+/**
+ * Check whether the credentials have been verified recently.
+ *
+ * @param cred The credentials to look up.
+ * @return true if the cache holds an unexpired entry for the DN with the
+ *         same password.
+ */
+bool LDAPBindVerifier::CacheLookup(const LDAPCredential& cred)
+{
+	std::string hash, salt;
+	unsigned char diff = 0;
+	long ttl;
+
+	// EnableCache may change the settings at any time; take a copy under
+	// the lock but hash outside it.
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		ttl = _cache_ttl;
+		salt = _salt;
+	}
+
+	if (ttl <= 0 || cred.password.empty())
+		return false;
+
+	hash = Hash(salt, cred);
+
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		std::map<std::string, CacheEntry>::iterator it =
+			_cache.find(cred.dn);
+
+		if (it == _cache.end())
+			diff = 1;
+		else if (it->second.expires <= std::chrono::steady_clock::now())
+		{
+			_cache.erase(it);
+			diff = 1;
+		}
+		else
+			// Compare in constant time so lookups don't leak how much
+			// matched.
+			for (size_t i = 0; i < hash.length(); i++)
+				diff |= hash[i] ^ it->second.hash[i];
+	}
+
+	_stats->AddCacheLookup(diff == 0);
+	return diff == 0;
+}
+
+/**
+ * Record the outcome of a bind in the cache. When the cache is full,
+ * expired entries are dropped first, then the one expiring soonest.
+ *
+ * @param cred     The credentials which were checked.
+ * @param verified Whether the server accepted them.
+ */
+void LDAPBindVerifier::CacheStore(const LDAPCredential& cred, bool verified)
+{
+	LDAPTimePoint now = std::chrono::steady_clock::now();
+	std::string hash, salt;
+	long ttl;
+
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		ttl = _cache_ttl;
+		salt = _salt;
+	}
+
+	if (ttl <= 0)
+		return;
+
+	if (verified)
+		hash = Hash(salt, cred);
+
+	std::lock_guard<std::mutex> guard(_lock);
+
+	// The cache may have been reconfigured while hashing.
+	if (_cache_ttl != ttl || _salt != salt || _cache_size == 0)
+		return;
+
+	if (!verified)
+	{
+		_cache.erase(cred.dn);
+		return;
+	}
+
+	if (_cache.size() >= _cache_size && !_cache.count(cred.dn))
+	{
+		std::map<std::string, CacheEntry>::iterator it, oldest;
+
+		for (it = _cache.begin(); it != _cache.end(); )
+			if (it->second.expires <= now)
+				_cache.erase(it++);
+			else
+				it++;
+
+		if (_cache.size() >= _cache_size)
+		{
+			oldest = _cache.begin();
+			for (it = _cache.begin(); it != _cache.end(); it++)
+				if (it->second.expires < oldest->second.expires)
+					oldest = it;
+			_cache.erase(oldest);
+		}
+	}
+
+	CacheEntry& entry = _cache[cred.dn];
+	entry.hash = hash;
+	entry.expires = now + std::chrono::milliseconds(ttl);
+}
+}
@@ -0,0 +1,420 @@
+/*
+ * bind_verifier_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "ldap++.h"
+#include "mock_ldap_server.h"
+
+using namespace std;
+using ldap_client::LDAPBindVerifier;
+using ldap_client::LDAPCredential;
+
+namespace testing {
+/*
+ * Exposes the digest used by the credential cache.
+ */
+class TestBindVerifier : public LDAPBindVerifier
+{
+    public:
+	static string Sha256Hex(const string& data)
+	{
+		static const char hex[] = "0123456789abcdef";
+		string digest = Sha256(data), rv;
+
+		for (size_t i = 0; i < digest.length(); i++)
+		{
+			rv.push_back(hex[(unsigned char) digest[i] >> 4]);
+			rv.push_back(hex[digest[i] & 0xf]);
+		}
+		return rv;
+	}
+};
+
+class BindVerifierTest : public CppUnit::TestCase {
+	CPPUNIT_TEST_SUITE(BindVerifierTest);
+	CPPUNIT_TEST(testVerify);
+	CPPUNIT_TEST(testBatch);
+	CPPUNIT_TEST(testFastBindBatch);
+	CPPUNIT_TEST(testConcurrent);
+	CPPUNIT_TEST(testServerError);
+	CPPUNIT_TEST(testReconnect);
+	CPPUNIT_TEST(testPoolTimeout);
+	CPPUNIT_TEST(testFastBindTimeout);
+	CPPUNIT_TEST(testSha256);
+	CPPUNIT_TEST(testCacheHit);
+	CPPUNIT_TEST(testCacheWrongPassword);
+	CPPUNIT_TEST(testCacheExpiry);
+	CPPUNIT_TEST(testCacheInvalidate);
+	CPPUNIT_TEST(testCacheEviction);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+	void tearDown();
+
+	void testVerify();
+	void testBatch();
+	void testFastBindBatch();
+	void testConcurrent();
+	void testServerError();
+	void testReconnect();
+	void testPoolTimeout();
+	void testFastBindTimeout();
+	void testSha256();
+	void testCacheHit();
+	void testCacheWrongPassword();
+	void testCacheExpiry();
+	void testCacheInvalidate();
+	void testCacheEviction();
+
+private:
+	vector<LDAPCredential> batch(size_t n);
+
+	MockLDAPServer* _server;
+};
+
+static string
+user(int i)
+{
+	return "uid=user" + to_string(i) + ",dc=example,dc=com";
+}
+
+void
+BindVerifierTest::setUp()
+{
+	_server = new MockLDAPServer;
+	_server->Start();
+
+	for (int i = 0; i < 10; i++)
+		_server->AddUser(user(i), "secret" + to_string(i));
+}
+
+void
+BindVerifierTest::tearDown()
+{
+	delete _server;
+}
+
+/*
+ * Credentials of the 10 users, every other one with a wrong password.
+ */
+vector<LDAPCredential>
+BindVerifierTest::batch(size_t n)
+{
+	vector<LDAPCredential> creds;
+
+	for (size_t i = 0; i < n; i++)
+		creds.push_back(LDAPCredential(user(i % 10), i % 2 ?
+			"wrong" : "secret" + to_string(i % 10)));
+	return creds;
+}
+
+void
+BindVerifierTest::testVerify()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 1);
+
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT(!verifier.Verify(user(1), "secret2"));
+	CPPUNIT_ASSERT(!verifier.Verify("uid=nobody,dc=example,dc=com",
+		"secret1"));
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetRequestCount(LDAP_REQ_BIND));
+
+	// An empty password would be an unauthenticated bind, which succeeds.
+	CPPUNIT_ASSERT(!verifier.Verify(user(1), ""));
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetRequestCount(LDAP_REQ_BIND));
+	CPPUNIT_ASSERT_EQUAL(1, _server->GetConnectionCount());
+}
+
+void
+BindVerifierTest::testBatch()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 3);
+	vector<LDAPCredential> creds = batch(20);
+	vector<bool> result;
+
+	_server->SetLatency(LDAP_REQ_BIND, 5000);
+	result = verifier.Verify(creds);
+
+	CPPUNIT_ASSERT_EQUAL(creds.size(), result.size());
+	for (size_t i = 0; i < result.size(); i++)
+		CPPUNIT_ASSERT_EQUAL(i % 2 == 0, (bool) result[i]);
+	CPPUNIT_ASSERT_EQUAL(20, _server->GetRequestCount(LDAP_REQ_BIND));
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetConnectionCount());
+}
+
+void
+BindVerifierTest::testFastBindBatch()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 2);
+	vector<LDAPCredential> creds = batch(50);
+	vector<bool> result;
+
+	// With fast bind mode the binds are pipelined, so one connection
+	// carries the whole batch.
+	_server->SetControlSupported("1.2.840.113556.1.4.1781", true);
+	verifier.SetMaxOutstanding(64);
+	result = verifier.Verify(creds);
+
+	for (size_t i = 0; i < result.size(); i++)
+		CPPUNIT_ASSERT_EQUAL(i % 2 == 0, (bool) result[i]);
+	CPPUNIT_ASSERT_EQUAL(1, _server->GetRequestCount(LDAP_REQ_EXTENDED));
+	CPPUNIT_ASSERT_EQUAL(50, _server->GetRequestCount(LDAP_REQ_BIND));
+	CPPUNIT_ASSERT_EQUAL(1, _server->GetConnectionCount());
+}
+
+void
+BindVerifierTest::testConcurrent()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 2);
+	vector<thread> threads;
+	atomic<int> wrong(0);
+
+	for (int t = 0; t < 8; t++)
+		threads.push_back(thread([&verifier, &wrong, t]() {
+			for (int i = 0; i < 25; i++)
+			{
+				int u = (t + i) % 10;
+				bool good = i % 3 != 0;
+
+				if (verifier.Verify(user(u), good ? "secret" + to_string(u) :
+						"wrong") != good)
+					wrong++;
+			}
+		}));
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	CPPUNIT_ASSERT_EQUAL(0, wrong.load());
+	CPPUNIT_ASSERT_EQUAL(200, _server->GetRequestCount(LDAP_REQ_BIND));
+	CPPUNIT_ASSERT(_server->GetConnectionCount() <= 2);
+}
+
+void
+BindVerifierTest::testServerError()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 2);
+
+	// Errors other than invalid credentials are not a wrong password.
+	_server->SetError(LDAP_REQ_BIND, LDAP_BUSY);
+	CPPUNIT_ASSERT_THROW(verifier.Verify(user(1), "secret1"),
+		ldap_client::LDAPErrBusy);
+	CPPUNIT_ASSERT_THROW(verifier.Verify(batch(10)),
+		ldap_client::LDAPErrBusy);
+
+	_server->SetError(LDAP_REQ_BIND, LDAP_SUCCESS);
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT(!verifier.Verify(user(1), "wrong"));
+
+	// A server which does not answer in time.
+	_server->SetLatency(LDAP_REQ_BIND, 300000);
+	verifier.SetTimeout(100);
+	CPPUNIT_ASSERT_THROW(verifier.Verify(user(1), "secret1"),
+		ldap_client::LDAPErrTimeout);
+}
+
+void
+BindVerifierTest::testReconnect()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 1);
+
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT_EQUAL(1, _server->GetConnectionCount());
+
+	// The pooled connection is gone; the bind is retried on a new one.
+	_server->DropConnections();
+	CPPUNIT_ASSERT(verifier.Verify(user(2), "secret2"));
+	CPPUNIT_ASSERT(!verifier.Verify(user(2), "wrong"));
+	CPPUNIT_ASSERT_EQUAL(2, _server->GetConnectionCount());
+}
+
+void
+BindVerifierTest::testPoolTimeout()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 1);
+	chrono::steady_clock::time_point start;
+	thread first;
+	bool verified = false;
+
+	// The only connection is busy for longer than the second call may
+	// take in total.
+	_server->SetLatency(LDAP_REQ_BIND, 1000000);
+	verifier.SetTimeout(5000);
+	first = thread([&]() { verified = verifier.Verify(user(1), "secret1"); });
+	this_thread::sleep_for(chrono::milliseconds(100));
+
+	verifier.SetTimeout(200);
+	start = chrono::steady_clock::now();
+	CPPUNIT_ASSERT_THROW(verifier.Verify(user(2), "secret2"),
+		ldap_client::LDAPErrTimeout);
+	CPPUNIT_ASSERT(chrono::steady_clock::now() - start <
+		chrono::milliseconds(600));
+
+	first.join();
+	CPPUNIT_ASSERT(verified);
+}
+
+void
+BindVerifierTest::testFastBindTimeout()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 1);
+	chrono::steady_clock::time_point start;
+
+	// The fast bind request counts against the timeout as well.
+	_server->SetControlSupported("1.2.840.113556.1.4.1781", true);
+	_server->SetLatency(LDAP_REQ_EXTENDED, 1000000);
+	verifier.SetTimeout(200);
+	start = chrono::steady_clock::now();
+	CPPUNIT_ASSERT_THROW(verifier.Verify(user(1), "secret1"),
+		ldap_client::LDAPErrTimeout);
+	CPPUNIT_ASSERT(chrono::steady_clock::now() - start <
+		chrono::milliseconds(600));
+	CPPUNIT_ASSERT_EQUAL(0, _server->GetRequestCount(LDAP_REQ_BIND));
+
+	_server->SetLatency(LDAP_REQ_EXTENDED, 0);
+	verifier.SetTimeout(5000);
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+}
+
+void
+BindVerifierTest::testSha256()
+{
+	// FIPS 180-4 examples.
+	CPPUNIT_ASSERT_EQUAL(string("ba7816bf8f01cfea414140de5dae2223"
+		"b00361a396177a9cb410ff61f20015ad"),
+		TestBindVerifier::Sha256Hex("abc"));
+	CPPUNIT_ASSERT_EQUAL(string("e3b0c44298fc1c149afbf4c8996fb924"
+		"27ae41e4649b934ca495991b7852b855"),
+		TestBindVerifier::Sha256Hex(""));
+	CPPUNIT_ASSERT_EQUAL(string("248d6a61d20638b8e5c026930c3e6039"
+		"a33ce45964ff2167f6ecedd419db06c1"),
+		TestBindVerifier::Sha256Hex("abcdbcdecdefdefgefghfghighijhijkijkl"
+			"jklmklmnlmnomnopnopq"));
+	CPPUNIT_ASSERT_EQUAL(string("cdc76e5c9914fb9281a1c7e284d73e67"
+		"f1809a48a497200e046d39ccc7112cd0"),
+		TestBindVerifier::Sha256Hex(string(1000000, 'a')));
+}
+
+void
+BindVerifierTest::testCacheHit()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 1);
+
+	verifier.EnableCache(60000);
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT(verifier.Verify(batch(1))[0]);
+	CPPUNIT_ASSERT_EQUAL(2, _server->GetRequestCount(LDAP_REQ_BIND));
+
+	// Other users are not affected.
+	CPPUNIT_ASSERT(verifier.Verify(user(2), "secret2"));
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetRequestCount(LDAP_REQ_BIND));
+}
+
+void
+BindVerifierTest::testCacheWrongPassword()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 1);
+
+	verifier.EnableCache(60000);
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+
+	// A different password is always checked by the server, and the
+	// failure drops the cached entry. The empty one is never sent.
+	CPPUNIT_ASSERT(!verifier.Verify(user(1), "secret"));
+	CPPUNIT_ASSERT(!verifier.Verify(user(1), "secret10"));
+	CPPUNIT_ASSERT(!verifier.Verify(user(1), ""));
+	CPPUNIT_ASSERT(!verifier.Verify(user(2), "secret1"));
+	CPPUNIT_ASSERT_EQUAL(4, _server->GetRequestCount(LDAP_REQ_BIND));
+
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT_EQUAL(5, _server->GetRequestCount(LDAP_REQ_BIND));
+
+	// Failed verifications are not cached.
+	CPPUNIT_ASSERT(!verifier.Verify(user(3), "wrong"));
+	CPPUNIT_ASSERT(!verifier.Verify(user(3), "wrong"));
+	CPPUNIT_ASSERT_EQUAL(7, _server->GetRequestCount(LDAP_REQ_BIND));
+}
+
+void
+BindVerifierTest::testCacheExpiry()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 1);
+
+	verifier.EnableCache(100);
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT_EQUAL(1, _server->GetRequestCount(LDAP_REQ_BIND));
+
+	this_thread::sleep_for(chrono::milliseconds(150));
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT_EQUAL(2, _server->GetRequestCount(LDAP_REQ_BIND));
+
+	// A TTL of 0 disables the cache.
+	verifier.EnableCache(0);
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT_EQUAL(4, _server->GetRequestCount(LDAP_REQ_BIND));
+}
+
+void
+BindVerifierTest::testCacheInvalidate()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 1);
+
+	verifier.EnableCache(60000);
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT(verifier.Verify(user(2), "secret2"));
+
+	// The password changed on the server.
+	_server->AddUser(user(1), "changed");
+	verifier.Invalidate(user(1));
+	CPPUNIT_ASSERT(!verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT(verifier.Verify(user(2), "secret2"));
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetRequestCount(LDAP_REQ_BIND));
+
+	verifier.InvalidateAll();
+	CPPUNIT_ASSERT(verifier.Verify(user(2), "secret2"));
+	CPPUNIT_ASSERT_EQUAL(4, _server->GetRequestCount(LDAP_REQ_BIND));
+}
+
+void
+BindVerifierTest::testCacheEviction()
+{
+	LDAPBindVerifier verifier(_server->GetURI(), 1);
+
+	// The entry expiring soonest makes room for a new one.
+	verifier.EnableCache(60000, 2);
+	for (int i = 1; i <= 3; i++)
+	{
+		CPPUNIT_ASSERT(verifier.Verify(user(i), "secret" + to_string(i)));
+		this_thread::sleep_for(chrono::milliseconds(2));
+	}
+	CPPUNIT_ASSERT(verifier.Verify(user(3), "secret3"));
+	CPPUNIT_ASSERT(verifier.Verify(user(2), "secret2"));
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetRequestCount(LDAP_REQ_BIND));
+
+	CPPUNIT_ASSERT(verifier.Verify(user(1), "secret1"));
+	CPPUNIT_ASSERT_EQUAL(4, _server->GetRequestCount(LDAP_REQ_BIND));
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(BindVerifierTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
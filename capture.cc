@@ -0,0 +1,385 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ldap++.h"
+#include <ldap.h>
+#include <lber.h>
+
+namespace ldap_client
+{
+/*
+ * A capture starts with this magic. Every PDU follows as a record of the
+ * time in microseconds (8 bytes), the connection number (4 bytes), the
+ * direction (1 byte, 1 if sent by the client), the length of the PDU
+ * (4 bytes) and the PDU itself. All numbers are big-endian.
+ */
+static const char k_CaptureMagic[] = "LDAPCAP1";
+static const size_t k_CaptureHeader = 17;
+
+/*
+ * State of the capture layer on one connection. Data read or written
+ * is collected until it forms complete PDUs.
+ */
+struct CaptureStream
+{
+	LDAPCapture* capture;
+	unsigned int conn;
+	std::string in;
+	std::string out;
+};
+
+/**
+ * Find the size of the PDU at the given offset of a buffer.
+ *
+ * @return The size of the PDU including its header, 0 if the header is
+ *         not complete yet, or std::string::npos if it is invalid.
+ */
+static size_t PDUSize(const std::string& buf, size_t off)
+{
+	size_t len = 0, header;
+	unsigned char first;
+
+	if (buf.size() - off < 2)
+		return 0;
+
+	first = buf[off + 1];
+	if (first < 0x80)
+		return 2 + first;
+
+	header = 2 + (first & 0x7f);
+	if (header == 2 || header > 2 + 4)
+		return std::string::npos;
+	if (buf.size() - off < header)
+		return 0;
+
+	for (size_t i = off + 2; i < off + header; i++)
+		len = (len << 8) | (unsigned char) buf[i];
+
+	return header + len;
+}
+
+/**
+ * Record all complete PDUs collected in the buffer and remove them.
+ */
+static void Extract(CaptureStream* stream, std::string& buf, bool sent)
+{
+	size_t off = 0, size;
+
+	while ((size = PDUSize(buf, off)) > 0 && size != std::string::npos &&
+			size <= buf.size() - off)
+	{
+		stream->capture->Record(stream->conn, sent, buf.data() + off, size);
+		off += size;
+	}
+
+	// Whatever follows an invalid header can't be framed any more.
+	if (size == std::string::npos)
+		buf.clear();
+	else
+		buf.erase(0, off);
+}
+
+static int CaptureSetup(Sockbuf_IO_Desc* sbiod, void* arg)
+{
+	CaptureStream* stream = new CaptureStream;
+
+	stream->capture = (LDAPCapture*) arg;
+	stream->conn = stream->capture->NextConnection();
+	sbiod->sbiod_pvt = stream;
+	return 0;
+}
+
+static int CaptureRemove(Sockbuf_IO_Desc* sbiod)
+{
+	delete (CaptureStream*) sbiod->sbiod_pvt;
+	sbiod->sbiod_pvt = 0;
+	return 0;
+}
+
+static int CaptureCtrl(Sockbuf_IO_Desc* sbiod, int opt, void* arg)
+{
+	// ber_sockbuf_ctrl() asks every layer in turn.
+	return 0;
+}
+
+static ber_slen_t CaptureRead(Sockbuf_IO_Desc* sbiod, void* buf,
+	ber_len_t len)
+{
+	CaptureStream* stream = (CaptureStream*) sbiod->sbiod_pvt;
+	ber_slen_t n = LBER_SBIOD_READ_NEXT(sbiod, buf, len);
+
+	if (n > 0)
+	{
+		stream->in.append((const char*) buf, n);
+		Extract(stream, stream->in, false);
+	}
+
+	return n;
+}
+
+static ber_slen_t CaptureWrite(Sockbuf_IO_Desc* sbiod, void* buf,
+	ber_len_t len)
+{
+	CaptureStream* stream = (CaptureStream*) sbiod->sbiod_pvt;
+	ber_slen_t n = LBER_SBIOD_WRITE_NEXT(sbiod, buf, len);
+
+	if (n > 0)
+	{
+		stream->out.append((const char*) buf, n);
+		Extract(stream, stream->out, true);
+	}
+
+	return n;
+}
+
+static Sockbuf_IO k_CaptureIO = {
+	CaptureSetup, CaptureRemove, CaptureCtrl, CaptureRead, CaptureWrite, 0
+};
+
+static void PutNumber(char* buf, unsigned long long value, int bytes)
+{
+	for (int i = bytes - 1; i >= 0; i--, value >>= 8)
+		buf[i] = (char) (value & 0xff);
+}
+
+static unsigned long long GetNumber(const char* buf, int bytes)
+{
+	unsigned long long value = 0;
+
+	for (int i = 0; i < bytes; i++)
+		value = (value << 8) | (unsigned char) buf[i];
+
+	return value;
+}
+
+/**
+ * Create a new capture file, replacing any existing one. The file is
+ * only readable by the owner since it holds the passwords of binds.
+ * Symbolic links and anything but regular files are refused.
+ *
+ * @param path Path of the capture file.
+ * @throws LDAPErrLocalError The file could not be created.
+ */
+LDAPCapture::LDAPCapture(const std::string& path)
+: _file(0), _failed(false), _start(std::chrono::steady_clock::now()),
+	_next_conn(0)
+{
+	// Not truncated until it has been checked; non-blocking so a FIFO
+	// without a reader fails right away.
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK |
+		O_CLOEXEC, 0600);
+	struct stat st;
+
+	if (fd < 0)
+		throw LDAPErrLocalError("Cannot create capture file");
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		throw LDAPErrLocalError("Capture file is not a regular file");
+	}
+
+	// The mode only applies to new files; an existing one may be
+	// readable by others.
+	if ((st.st_mode & 0777) != 0600 && fchmod(fd, 0600))
+	{
+		close(fd);
+		throw LDAPErrLocalError("Cannot restrict access to capture file");
+	}
+
+	if (ftruncate(fd, 0))
+	{
+		close(fd);
+		throw LDAPErrLocalError("Cannot truncate capture file");
+	}
+
+	_file = fdopen(fd, "wb");
+	if (!_file)
+	{
+		close(fd);
+		throw LDAPErrLocalError("Cannot create capture file");
+	}
+
+	if (fwrite(k_CaptureMagic, 1, sizeof(k_CaptureMagic) - 1, _file) !=
+			sizeof(k_CaptureMagic) - 1)
+	{
+		fclose(_file);
+		throw LDAPErrLocalError("Cannot write capture file");
+	}
+
+	_callback.lc_add = Connected;
+	_callback.lc_del = Disconnected;
+	_callback.lc_arg = this;
+}
+
+/**
+ * Finish writing the capture. All connections it was installed on must
+ * have been closed.
+ */
+LDAPCapture::~LDAPCapture()
+{
+	fclose(_file);
+}
+
+/**
+ * Record the traffic of every connection the handle makes from now on,
+ * including the one it is already connected with. The capture must
+ * outlive the handle.
+ *
+ * @param ld The LDAP handle.
+ * @throws LDAPException The connection callback could not be set.
+ */
+void LDAPCapture::Install(LDAP* ld)
+{
+	Sockbuf* sb = 0;
+	int fd = -1;
+	int rc;
+
+	rc = ldap_set_option(ld, LDAP_OPT_CONNECT_CB, &_callback);
+	if (rc)
+		LDAPErrCode2Exception(ld, rc);
+
+	if (ldap_get_option(ld, LDAP_OPT_DESC, &fd) == LDAP_OPT_SUCCESS &&
+			fd >= 0 &&
+			ldap_get_option(ld, LDAP_OPT_SOCKBUF, &sb) == LDAP_OPT_SUCCESS &&
+			sb)
+		Connected(ld, sb, 0, 0, &_callback);
+}
+
+/**
+ * Append a PDU to the capture. Once a write has failed, e.g. because
+ * the disk is full, nothing more is recorded, so the file still ends
+ * with complete records up to the point of failure.
+ *
+ * @param conn Number of the connection.
+ * @param sent Whether the client sent the PDU.
+ * @param pdu  The encoded PDU.
+ * @param len  Length of the PDU.
+ */
+void LDAPCapture::Record(unsigned int conn, bool sent, const char* pdu,
+	size_t len)
+{
+	char header[k_CaptureHeader];
+	std::lock_guard<std::mutex> guard(_lock);
+	long long usec;
+
+	if (_failed)
+		return;
+
+	// Taken under the lock so the records are in order of time.
+	usec = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - _start).count();
+
+	PutNumber(header, usec, 8);
+	PutNumber(header + 8, conn, 4);
+	header[12] = sent ? 1 : 0;
+	PutNumber(header + 13, len, 4);
+
+	if (fwrite(header, 1, sizeof(header), _file) != sizeof(header) ||
+			fwrite(pdu, 1, len, _file) != len || ferror(_file))
+		_failed = true;
+}
+
+/**
+ * @return Whether writing to the capture file failed, so that the
+ *         capture is incomplete. Records still buffered are only
+ *         written when the capture is destroyed.
+ */
+bool LDAPCapture::Failed() const
+{
+	return _failed;
+}
+
+/**
+ * @return A new connection number.
+ */
+unsigned int LDAPCapture::NextConnection()
+{
+	return _next_conn.fetch_add(1);
+}
+
+/**
+ * Called by libldap once a connection has been established. The layer
+ * goes above all others, TLS and SASL included, so it sees the plain
+ * PDUs.
+ */
+int LDAPCapture::Connected(LDAP* ld, Sockbuf* sb, LDAPURLDesc* srv,
+	struct sockaddr* addr, struct ldap_conncb* ctx)
+{
+	if (!ber_sockbuf_ctrl(sb, LBER_SB_OPT_HAS_IO, &k_CaptureIO))
+		ber_sockbuf_add_io(sb, &k_CaptureIO,
+			LBER_SBIOD_LEVEL_APPLICATION + 1, ctx->lc_arg);
+
+	// Failing to capture must not fail the connection.
+	return 0;
+}
+
+/**
+ * Called by libldap before a connection is closed. The layer is removed
+ * along with the Sockbuf.
+ */
+void LDAPCapture::Disconnected(LDAP* ld, Sockbuf* sb,
+	struct ldap_conncb* ctx)
+{
+}
+
+/**
+ * Open a capture for reading.
+ *
+ * @param path Path of the capture file.
+ * @throws LDAPErrLocalError The file could not be opened.
+ * @throws LDAPErrDecodingError The file is not a capture.
+ */
+LDAPCaptureReader::LDAPCaptureReader(const std::string& path)
+: _file(fopen(path.c_str(), "rb"))
+{
+	char magic[sizeof(k_CaptureMagic) - 1];
+
+	if (!_file)
+		throw LDAPErrLocalError("Cannot open capture file");
+
+	if (fread(magic, 1, sizeof(magic), _file) != sizeof(magic) ||
+			std::string(magic, sizeof(magic)) != k_CaptureMagic)
+	{
+		fclose(_file);
+		throw LDAPErrDecodingError("Not a capture file");
+	}
+}
+
+LDAPCaptureReader::~LDAPCaptureReader()
+{
+	fclose(_file);
+}
+
+/**
+ * Read the next PDU. A record cut short, e.g. because the capturing
+ * process was killed, counts as the end of the capture.
+ *
+ * @param pdu The PDU to fill in.
+ * @return false at the end of the capture.
+ */
+bool LDAPCaptureReader::Next(LDAPCapturedPDU* pdu)
+{
+	char header[k_CaptureHeader];
+	size_t len;
+
+	if (fread(header, 1, sizeof(header), _file) != sizeof(header))
+		return false;
+
+	pdu->usec = GetNumber(header, 8);
+	pdu->conn = GetNumber(header + 8, 4);
+	pdu->sent = header[12] != 0;
+	len = GetNumber(header + 13, 4);
+
+	pdu->pdu.resize(len);
+	return len == 0 || fread(&pdu->pdu[0], 1, len, _file) == len;
+}
+}
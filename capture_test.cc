@@ -0,0 +1,298 @@
+/*
+ * capture_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "ldap++.h"
+#include "mock_ldap_server.h"
+
+using namespace std;
+using ldap_client::LDAPCapture;
+using ldap_client::LDAPCaptureReader;
+using ldap_client::LDAPCapturedPDU;
+using ldap_client::LDAPConnection;
+using ldap_client::LDAPResult;
+
+namespace testing {
+class CaptureTest : public CppUnit::TestCase {
+	CPPUNIT_TEST_SUITE(CaptureTest);
+	CPPUNIT_TEST(testRoundTrip);
+	CPPUNIT_TEST(testTruncated);
+	CPPUNIT_TEST(testWriteError);
+	CPPUNIT_TEST(testNotRegular);
+	CPPUNIT_TEST(testReplay);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+	void tearDown();
+
+	void testRoundTrip();
+	void testTruncated();
+	void testWriteError();
+	void testNotRegular();
+	void testReplay();
+
+private:
+	void capture();
+	static vector<string> names(LDAPResult* res);
+
+	MockLDAPServer* _server;
+	string _path;
+};
+
+void
+CaptureTest::setUp()
+{
+	char path[] = "/tmp/capture_test.XXXXXX";
+	int fd = mkstemp(path);
+
+	close(fd);
+	_path = path;
+
+	_server = new MockLDAPServer;
+	_server->Start();
+	_server->AddEntry("cn=a,dc=example,dc=com", {{"cn", {"a"}}});
+	_server->AddEntry("cn=b,dc=example,dc=com", {{"cn", {"b"}}});
+}
+
+void
+CaptureTest::tearDown()
+{
+	delete _server;
+	unlink(_path.c_str());
+}
+
+vector<string>
+CaptureTest::names(LDAPResult* res)
+{
+	vector<string> cns;
+
+	for (ldap_client::LDAPEntry& entry : *res->GetEntries())
+		cns.push_back(entry.GetValue("cn").front());
+	return cns;
+}
+
+/*
+ * Capture a search for both entries over a fresh connection.
+ */
+void
+CaptureTest::capture()
+{
+	LDAPCapture capture(_path);
+
+	{
+		LDAPConnection conn(_server->GetURI());
+
+		conn.SetCapture(&capture);
+		delete conn.Search("dc=example,dc=com", LDAP_SCOPE_SUBTREE,
+			"(cn=*)", {"cn"});
+	}
+	CPPUNIT_ASSERT(!capture.Failed());
+}
+
+void
+CaptureTest::testRoundTrip()
+{
+	vector<LDAPCapturedPDU> pdus;
+	LDAPCapturedPDU pdu;
+	struct stat st;
+	int searches = 0;
+
+	// The capture holds passwords; it must not be readable by others,
+	// even when it replaces a file that was.
+	chmod(_path.c_str(), 0644);
+	capture();
+	CPPUNIT_ASSERT_EQUAL(0, stat(_path.c_str(), &st));
+	CPPUNIT_ASSERT_EQUAL(0600, (int) (st.st_mode & 0777));
+
+	LDAPCaptureReader reader(_path);
+	while (reader.Next(&pdu))
+		pdus.push_back(pdu);
+
+	// The search request, two entries and the result, in order of time
+	// and each a complete BER sequence.
+	CPPUNIT_ASSERT(pdus.size() >= 4);
+	for (size_t i = 0; i < pdus.size(); i++)
+	{
+		ldap_client::LDAPBerReader outer(pdus[i].pdu.data(),
+			pdus[i].pdu.size());
+		ldap_client::LDAPBerReader msg = outer.ReadSequence();
+		unsigned char op;
+
+		CPPUNIT_ASSERT(outer.AtEnd());
+		CPPUNIT_ASSERT_EQUAL(0U, pdus[i].conn);
+		if (i > 0)
+			CPPUNIT_ASSERT(pdus[i].usec >= pdus[i - 1].usec);
+
+		msg.ReadInteger();
+		op = msg.PeekTag();
+		if (op == LDAP_REQ_SEARCH)
+		{
+			CPPUNIT_ASSERT(pdus[i].sent);
+			CPPUNIT_ASSERT(i + 3 < pdus.size());
+			CPPUNIT_ASSERT(!pdus[i + 3].sent);
+			searches++;
+		}
+		else if (op == LDAP_RES_SEARCH_ENTRY ||
+				op == LDAP_RES_SEARCH_RESULT)
+			CPPUNIT_ASSERT(!pdus[i].sent);
+	}
+	CPPUNIT_ASSERT_EQUAL(1, searches);
+}
+
+void
+CaptureTest::testTruncated()
+{
+	LDAPCapturedPDU pdu;
+	struct stat st;
+	int count = 0;
+	FILE* file;
+
+	capture();
+
+	// A record cut short ends the capture.
+	CPPUNIT_ASSERT_EQUAL(0, stat(_path.c_str(), &st));
+	CPPUNIT_ASSERT_EQUAL(0, truncate(_path.c_str(), st.st_size - 1));
+	{
+		LDAPCaptureReader reader(_path);
+
+		while (reader.Next(&pdu))
+			count++;
+		CPPUNIT_ASSERT(count >= 3);
+	}
+
+	file = fopen(_path.c_str(), "wb");
+	fputs("LDAPCAP0", file);
+	fclose(file);
+	CPPUNIT_ASSERT_THROW(LDAPCaptureReader reader(_path),
+		ldap_client::LDAPErrDecodingError);
+	CPPUNIT_ASSERT_THROW(LDAPCapture capture("/nonexistent/capture"),
+		ldap_client::LDAPErrLocalError);
+}
+
+void
+CaptureTest::testWriteError()
+{
+	string pdu(1000, 'x');
+	struct rlimit limit, small;
+	void (*handler)(int);
+
+	// Writes fail once the buffer is flushed past the file size limit.
+	getrlimit(RLIMIT_FSIZE, &limit);
+	small = limit;
+	small.rlim_cur = 16384;
+	handler = signal(SIGXFSZ, SIG_IGN);
+	setrlimit(RLIMIT_FSIZE, &small);
+	{
+		LDAPCapture capture(_path);
+
+		for (int i = 0; i < 100 && !capture.Failed(); i++)
+			capture.Record(0, true, pdu.data(), pdu.size());
+		setrlimit(RLIMIT_FSIZE, &limit);
+		signal(SIGXFSZ, handler);
+		CPPUNIT_ASSERT(capture.Failed());
+	}
+}
+
+void
+CaptureTest::testNotRegular()
+{
+	string link = _path + ".link";
+	struct stat st;
+
+	// Neither devices nor symbolic links are opened, and the target of
+	// the link is left alone.
+	CPPUNIT_ASSERT_THROW(LDAPCapture capture("/dev/null"),
+		ldap_client::LDAPErrLocalError);
+
+	capture();
+	CPPUNIT_ASSERT_EQUAL(0, symlink(_path.c_str(), link.c_str()));
+	CPPUNIT_ASSERT_THROW(LDAPCapture capture(link),
+		ldap_client::LDAPErrLocalError);
+	unlink(link.c_str());
+	CPPUNIT_ASSERT_EQUAL(0, stat(_path.c_str(), &st));
+	CPPUNIT_ASSERT(st.st_size > 8);
+}
+
+void
+CaptureTest::testReplay()
+{
+	vector<string> replayed;
+	LDAPResult* res;
+	char uri[128];
+	int fds[2];
+	FILE* out;
+	pid_t pid;
+
+	capture();
+
+	// Serve the capture with the ldap_replay built next to this test,
+	// which prints its URI first.
+	CPPUNIT_ASSERT_EQUAL(0, pipe(fds));
+	pid = fork();
+	if (pid == 0)
+	{
+		dup2(fds[1], 1);
+		close(fds[0]);
+		execl("./ldap_replay", "ldap_replay", "serve", "-f", _path.c_str(),
+			(char*) 0);
+		_exit(127);
+	}
+	close(fds[1]);
+	out = fdopen(fds[0], "r");
+	CPPUNIT_ASSERT(fgets(uri, sizeof(uri), out) != 0);
+	uri[strcspn(uri, "\n")] = 0;
+
+	// The mock is gone, so the entries can only come from the capture.
+	delete _server;
+	_server = 0;
+	try
+	{
+		LDAPConnection conn(uri);
+
+		res = conn.Search("dc=example,dc=com", LDAP_SCOPE_SUBTREE, "(cn=*)",
+			{"cn"});
+		replayed = names(res);
+		delete res;
+	}
+	catch (...)
+	{
+		kill(pid, SIGTERM);
+		waitpid(pid, 0, 0);
+		fclose(out);
+		throw;
+	}
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+	fclose(out);
+
+	CPPUNIT_ASSERT_EQUAL((size_t) 2, replayed.size());
+	CPPUNIT_ASSERT_EQUAL(string("a"), replayed[0]);
+	CPPUNIT_ASSERT_EQUAL(string("b"), replayed[1]);
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(CaptureTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
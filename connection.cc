@@ -3,7 +3,10 @@
 #endif
 #include <string>
 #include <vector>
+#include <chrono>
+#include <algorithm>
 #include "ldap++.h"
+#include "tracer.h"
 #include "ldap_compat.h"
 #include <ldap.h>
 
@@ -53,7 +56,43 @@ LDAPConnection::LDAPConnection(std::string uri, int version)
 		LDAPErrCode2Exception(_ldap, rc);
 
 	SetVersion(version);
-	_size_limit = -1;
+	_size_limit = 0;
+	_page_size = 500;
+	_range_retrieval = true;
+	_range_parallel = 1;
+	_timeout = 30000;
+	_token = 0;
+	_stats = LDAPServerStats::Get(uri);
+	_stats->AddConnections(1);
+	_wire.Install(_ldap);
+}
+
+/**
+ * Wrap an already initialized LDAP session, e.g. one created with
+ * ldap_init_fd(). The connection takes ownership of the handle.
+ *
+ * @param ldap The LDAP session handle.
+ */
+LDAPConnection::LDAPConnection(LDAP* ldap)
+: _ldap(ldap)
+{
+	char* uri = 0;
+
+	SetVersion(LDAP_VERSION3);
+	_size_limit = 0;
+	_page_size = 500;
+	_range_retrieval = true;
+	_range_parallel = 1;
+	_timeout = 30000;
+	_token = 0;
+
+	ldap_get_option(_ldap, LDAP_OPT_URI, &uri);
+	_stats = LDAPServerStats::Get(uri ? uri : "");
+	_stats->AddConnections(1);
+	if (uri)
+		ldap_memfree(uri);
+
+	_wire.Install(_ldap);
 }
 
 /**
@@ -62,6 +101,7 @@ LDAPConnection::LDAPConnection(std::string uri, int version)
 LDAPConnection::~LDAPConnection()
 {
 	ldap_unbind_ext_s(_ldap, 0, 0);
+	_stats->AddConnections(-1);
 }
 
 /**
@@ -110,17 +150,11 @@ void LDAPConnection::SetVersion(int newversion)
 void LDAPConnection::SimpleBind(std::string user, std::string password)
 {
 	struct berval passwd;
-	int rc;
-
-	passwd.bv_val = strdup(user.c_str());
-	passwd.bv_len = user.length();
 
-	rc = ldap_sasl_bind_s(_ldap, user.c_str(), LDAP_SASL_SIMPLE, &passwd,
-			0, 0, 0);
+	passwd.bv_val = const_cast<char*>(password.data());
+	passwd.bv_len = password.length();
 
-	free(passwd.bv_val);
-	if (rc)
-		LDAPErrCode2Exception(_ldap, rc);
+	Bind(user, &passwd);
 }
 
 /**
@@ -132,25 +166,61 @@ void LDAPConnection::SimpleBind(std::string user, std::string password)
  */
 void LDAPConnection::SASLBind(std::string user, std::string password)
 {
-	LDAPControl **sctrlsp = NULL, **cctrlsp = NULL;
 	struct berval passwd;
-	int rc;
 
-	passwd.bv_val = ber_strdup(password.c_str());
-	passwd.bv_len = strlen(passwd.bv_val);
+	passwd.bv_val = const_cast<char*>(password.data());
+	passwd.bv_len = password.length();
+
+	Bind(user, &passwd);
+}
 
-	rc = ldap_sasl_bind_s(_ldap, user.c_str(), LDAP_SASL_SIMPLE,
-		&passwd, sctrlsp, cctrlsp, NULL);
-	if (passwd.bv_val)
-		ber_memfree(passwd.bv_val);
+/**
+ * Send a simple bind and wait for its result, which can be cancelled with
+ * the connection's cancellation token. The bind is abandoned if it takes
+ * longer than the timeout of the connection.
+ *
+ * @param user LDAP user name (typically a DN).
+ * @param cred The password.
+ * @throws LDAPErrTimeout The bind took too long.
+ * @throws LDAPException Unable to perform bind.
+ */
+void LDAPConnection::Bind(const std::string& user, struct berval* cred)
+{
+	LDAPTraceScope trace(_ldap, _stats, kLdapOpBind, user);
+	LDAPTimePoint start = std::chrono::steady_clock::now();
+	LDAPIOCounters io = _wire.Get();
+	LDAPMessage* res;
+	int rc, msgid, err;
+
+	rc = ldap_sasl_bind(_ldap, user.c_str(), LDAP_SASL_SIMPLE, cred, 0, 0,
+			&msgid);
+	if (rc == LDAP_SUCCESS)
+	{
+		trace.SetMessageID(msgid);
+		res = WaitForResult(msgid, start +
+			std::chrono::milliseconds(_timeout), _token);
+		rc = ldap_parse_result(_ldap, res, &err, 0, 0, 0, 0, 1);
+		if (rc == LDAP_SUCCESS)
+			rc = err;
+	}
+
+	_stats->Record(kLdapOpBind, start);
+	_stats->AddIO(kLdapOpBind, _wire.Get() - io);
+	trace.End(rc);
 	if (rc)
+	{
+		_stats->AddError(rc);
 		LDAPErrCode2Exception(_ldap, rc);
+	}
 }
 
 /**
- * Set the number of records to be returned in an LDAP query.
+ * Set the maximum number of records to be returned in an LDAP query.
+ * Searches stop once this many records have been received, regardless of
+ * how many pages that takes.
  *
- * @param newlimit Number of records to return in subsequent calls to Search.
+ * @param limit Number of records to return in subsequent calls to Search,
+ *              or 0 for no limit.
  */
 void LDAPConnection::SetResultSizeLimit(int limit)
 {
@@ -158,108 +228,286 @@ void LDAPConnection::SetResultSizeLimit(int limit)
 }
 
 /**
- * Search for LDAP records matching a given filter.
+ * Set the number of records requested per page by searches which don't
+ * set their own page size. The default is 500.
  *
- * @param base    Search base to start looking from.
- * @param scope   LDAP search scope (e.g. ONE, SUB, etc.)
- * @param filter  Filter string (e.g. attribute=value).
- * @param attrs   Vector of attributes to fetch in the record.
- * @param timeout Number of milliseconds to wait for an answer.
- * @return LDAPResult object containing all LDAP results returned by
- *         the query.
- * @throws LDAPException An error occurred processing the search query.
+ * @param size Number of records per page.
  */
-LDAPResult *LDAPConnection::Search(const std::string base, int scope,
-	const std::string filter, const std::vector<std::string> attrs,
-	long timeout)
+void LDAPConnection::SetPageSize(int size)
 {
-	std::vector<char*> attrlist;
-    std::vector<LDAPMessage*> msgs;
-	std::vector<LDAPControl*> ctrls;
-	LDAPControl* pageCtrl, *ctrl;
-	LDAPControl** returnedCtrl;
-    berval cookie;
-	timeval tv;
-	LDAPMessage *msg;
-	int rc, i = 0, errCode = 0, numResults = 0, count = 0;
-
-    cookie.bv_len = 0;
-    cookie.bv_val = 0;
-	tv.tv_sec = timeout / 1000;
-	tv.tv_usec = (timeout % 1000) * 1000;
-
-    for (u_int i = 0; i < attrs.size(); i++)
-		attrlist.push_back(const_cast<char*>(attrs[i].c_str()));
-
-	attrlist.push_back(0);
-
-	ctrl = new LDAPControl;
-	ctrl->ldctl_oid = (char*) LDAP_CONTROL_PAGEDRESULTS;
-	ctrl->ldctl_iscritical = 0;
-
-	ctrls.push_back(ctrl);
-	ctrls.push_back(0);
-
-	do {
-		rc = ldap_create_page_control_value(_ldap, _size_limit,
-                                &cookie, &ctrl->ldctl_value);
-		if (rc)
-			LDAPErrCode2Exception(_ldap, rc);
+	_page_size = size;
+}
 
-        if (cookie.bv_val != NULL)
-		{
-            ber_memfree(cookie.bv_val);
-            cookie.bv_val = 0;
-            cookie.bv_len = 0;
-		}
+/**
+ * Control how attributes which the server returns in ranges (e.g.
+ * "member;range=0-1499" from servers enforcing MaxValRange) are handled.
+ * When enabled, which is the default, LDAPEntry fetches the remaining
+ * ranges and merges all values under the plain attribute name.
+ *
+ * @param enabled  Whether to fetch the remaining ranges.
+ * @param parallel Number of range requests to keep outstanding at once.
+ */
+void LDAPConnection::SetRangeRetrieval(bool enabled, int parallel)
+{
+	if (parallel < 1)
+		throw LDAPErrParamError("At least one range request is required");
 
-		rc = ldap_search_ext_s(_ldap, base.c_str(), scope,
-				filter.c_str(), &attrlist[0], 0, &ctrls[0], 0, &tv, 0, &msg);
+	_range_retrieval = enabled;
+	_range_parallel = parallel;
+}
 
-        delete ctrl;
+/**
+ * Use the given token to cancel searches on this connection which don't
+ * have a token of their own. Pass NULL to stop using a token.
+ *
+ * @param token Token checked while waiting for results. Must outlive all
+ *              operations using it.
+ */
+void LDAPConnection::SetCancellationToken(LDAPCancellationToken* token)
+{
+	_token = token;
+}
 
-		if (rc && rc != LDAP_PARTIAL_RESULTS &&
-			rc != LDAP_ADMINLIMIT_EXCEEDED &&
-			rc != LDAP_SIZELIMIT_EXCEEDED)
-			LDAPErrCode2Exception(_ldap, rc);
+/**
+ * Set how long binds, writes and the range retrieval of entries may take
+ * before they are abandoned. Searches have their own timeout. The
+ * default is 30000.
+ *
+ * @param timeout Number of milliseconds.
+ * @throws LDAPErrParamError The timeout is not positive.
+ */
+void LDAPConnection::SetTimeout(long timeout)
+{
+	if (timeout < 1)
+		throw LDAPErrParamError("Timeout must be positive");
 
-		msgs.push_back(msg);
+	_timeout = timeout;
+}
 
-		rc = ldap_parse_result(_ldap, msg, &errCode, 0, 0, 0,
-				&returnedCtrl, 0);
-		if (rc)
-			LDAPErrCode2Exception(_ldap, rc);
+/**
+ * Get the traffic of the connection on the wire, counted below TLS. This
+ * includes operations of other objects using the connection, such as
+ * range retrieval and referrals.
+ *
+ * @return Bytes and read and write calls so far.
+ */
+LDAPIOCounters LDAPConnection::GetIOCounters() const
+{
+	return _wire.Get();
+}
 
-		pageCtrl = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS,
-				returnedCtrl, 0);
-		if (!pageCtrl)
+/**
+ * Record all PDUs exchanged on the connection from now on.
+ *
+ * @param capture The capture to write to. Must outlive the connection.
+ * @throws LDAPException The capture could not be set up.
+ */
+void LDAPConnection::SetCapture(LDAPCapture* capture)
+{
+	capture->Install(_ldap);
+}
+
+/**
+ * Wait for the complete result of an asynchronous operation. If the
+ * deadline passes or the token is cancelled first, the operation is
+ * abandoned so the server stops working on it. Cancellation is checked
+ * every 50 milliseconds.
+ *
+ * @param msgid    Message ID of the operation.
+ * @param deadline Point in time after which to give up.
+ * @param token    Token to check for cancellation, or NULL.
+ * @return The result chain, to be freed by the caller.
+ * @throws LDAPErrTimeout The deadline passed.
+ * @throws LDAPErrUserCancelled The token was cancelled.
+ * @throws LDAPException The result could not be received.
+ */
+LDAPMessage* LDAPConnection::WaitForResult(int msgid, LDAPDeadline deadline,
+	const LDAPCancellationToken* token)
+{
+	const std::chrono::microseconds poll(50000), hour(3600000000LL);
+	LDAPMessage* res = 0;
+	struct timeval tv;
+	int rc;
+
+	// Counts the operation as in flight until this function returns.
+	struct InFlight
+	{
+		InFlight(LDAPServerStats* s) : stats(s) { stats->AddInFlight(1); }
+		~InFlight() { stats->AddInFlight(-1); }
+		LDAPServerStats* stats;
+	} in_flight(_stats);
+
+	for (;;)
+	{
+		LDAPTimePoint now = std::chrono::steady_clock::now();
+		std::chrono::microseconds wait;
+
+		if (token && token->IsCancelled())
+		{
+			ldap_abandon_ext(_ldap, msgid, 0, 0);
+			rc = LDAP_USER_CANCELLED;
+			ldap_set_option(_ldap, LDAP_OPT_RESULT_CODE, &rc);
+			_stats->AddError(rc);
+			throw LDAPErrUserCancelled("Operation cancelled");
+		}
+
+		if (now >= deadline)
 		{
-			ldap_controls_free(returnedCtrl);
-			break;
+			ldap_abandon_ext(_ldap, msgid, 0, 0);
+			rc = LDAP_TIMEOUT;
+			ldap_set_option(_ldap, LDAP_OPT_RESULT_CODE, &rc);
+			_stats->AddError(rc);
+			throw LDAPErrTimeout("Deadline exceeded");
 		}
 
-        if (cookie.bv_val)
-            ber_memfree(cookie.bv_val);
-        cookie.bv_val = 0;
-        cookie.bv_len = 0;
+		wait = std::chrono::duration_cast<std::chrono::microseconds>(
+				deadline - now);
+		wait = std::min(wait, token ? poll : hour);
+
+		tv.tv_sec = wait.count() / 1000000;
+		tv.tv_usec = wait.count() % 1000000;
 
-		rc = ldap_parse_pageresponse_control(_ldap, pageCtrl,
-                &i, &cookie);
-		if (rc)
+		rc = ldap_result(_ldap, msgid, LDAP_MSG_ALL, &tv, &res);
+		if (rc > 0)
+			return res;
+
+		if (rc < 0)
+		{
+			ldap_get_option(_ldap, LDAP_OPT_RESULT_CODE, &rc);
+			rc = rc ? rc : LDAP_OTHER;
+			_stats->AddError(rc);
 			LDAPErrCode2Exception(_ldap, rc);
+		}
+	}
+}
+
+/**
+ * Search for LDAP records matching a given filter.
+ *
+ * @param base    Search base to start looking from.
+ * @param scope   LDAP search scope (e.g. ONE, SUB, etc.)
+ * @param filter  Filter string (e.g. attribute=value).
+ * @param attrs   Vector of attributes to fetch in the record.
+ * @param timeout Number of milliseconds the whole search may take.
+ * @return LDAPResult object containing all LDAP results returned by
+ *         the query.
+ * @throws LDAPException An error occurred processing the search query.
+ */
+LDAPResult *LDAPConnection::Search(const std::string base, int scope,
+	const std::string filter, const std::vector<std::string> attrs,
+	long timeout)
+{
+	LDAPSearchRequest req(base, scope, filter, attrs);
+
+	req.SetTimeout(timeout);
+	req.SetDeadline(std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(timeout));
+	return req.Execute(this);
+}
 
-		ldap_controls_free(returnedCtrl);
-		count = ldap_count_entries(_ldap, msg);
-		numResults += count;
-    } while (cookie.bv_len > 0 && strlen(cookie.bv_val) > 0);
+/**
+ * Search for LDAP records matching a given filter and pass each entry to
+ * the handler as it arrives, without keeping the whole result in memory.
+ * Every page is freed once all of its entries have been handled.
+ *
+ * @param base    Search base to start looking from.
+ * @param scope   LDAP search scope (e.g. ONE, SUB, etc.)
+ * @param filter  Filter string (e.g. attribute=value).
+ * @param attrs   Vector of attributes to fetch in the record.
+ * @param handler Called for every entry; return false to stop the search.
+ * @param timeout Number of milliseconds the whole search may take.
+ * @throws LDAPException An error occurred processing the search query.
+ */
+void LDAPConnection::SearchStream(const std::string base, int scope,
+	const std::string filter, const std::vector<std::string> attrs,
+	LDAPEntryHandler handler, long timeout)
+{
+	LDAPSearchRequest req(base, scope, filter, attrs);
 
-   if (cookie.bv_val)
-       ber_memfree(cookie.bv_val);
+	req.SetTimeout(timeout);
+	req.SetDeadline(std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(timeout));
+	req.Execute(this, handler);
+}
 
-    cookie.bv_val = 0;
-    cookie.bv_len = 0;
+/**
+ * Count the LDAP records matching a given filter. No attributes are
+ * requested and entries are counted page by page without building
+ * LDAPEntry objects.
+ *
+ * @param base    Search base to start looking from.
+ * @param scope   LDAP search scope (e.g. ONE, SUB, etc.)
+ * @param filter  Filter string (e.g. attribute=value).
+ * @param timeout Number of milliseconds the whole search may take.
+ * @return Number of matching records, up to the result size limit.
+ *         0 if the search base does not exist.
+ * @throws LDAPException An error occurred processing the search query.
+ */
+long LDAPConnection::Count(const std::string base, int scope,
+	const std::string filter, long timeout)
+{
+	LDAPSearchRequest req(base, scope, filter,
+		std::vector<std::string>(1, LDAP_NO_ATTRS));
+	long count = 0;
+
+	req.SetTypesOnly(true);
+	req.SetTimeout(timeout);
+	req.SetDeadline(std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(timeout));
+	try
+	{
+		req.Execute(this, [&count](LDAPMessage*) {
+			count++;
+			return true;
+		});
+	}
+	catch (LDAPErrNoSuchObject&)
+	{
+		return 0;
+	}
+
+	return count;
+}
 
-    return new LDAPResult(this, msgs);
+/**
+ * Check whether any LDAP record matches a given filter. The search asks
+ * for a single record without attributes and stops as soon as one has
+ * been received.
+ *
+ * @param base    Search base to start looking from.
+ * @param scope   LDAP search scope (e.g. ONE, SUB, etc.)
+ * @param filter  Filter string (e.g. attribute=value).
+ * @param timeout Number of milliseconds the whole search may take.
+ * @return true if at least one record matches, false if none does or
+ *         the search base does not exist.
+ * @throws LDAPException An error occurred processing the search query.
+ */
+bool LDAPConnection::Exists(const std::string base, int scope,
+	const std::string filter, long timeout)
+{
+	LDAPSearchRequest req(base, scope, filter,
+		std::vector<std::string>(1, LDAP_NO_ATTRS));
+	bool found = false;
+
+	req.SetTypesOnly(true);
+	req.SetTimeout(timeout);
+	req.SetDeadline(std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(timeout));
+	req.SetPageSize(1);
+	req.SetSizeLimit(1);
+	try
+	{
+		req.Execute(this, [&found](LDAPMessage*) {
+			found = true;
+			return false;
+		});
+	}
+	catch (LDAPErrNoSuchObject&)
+	{
+		return false;
+	}
+
+	return found;
 }
 
 /**
@@ -287,7 +535,7 @@ LDAPResult *LDAPConnection::Search(const std::string base, int scope,
  * @param base    Search base to start looking from.
  * @param scope   LDAP search scope (e.g. ONE, SUB, etc.)
  * @param filter  Filter string (e.g. attribute=value).
- * @param timeout Number of milliseconds to wait for a result.
+ * @param timeout Number of milliseconds the whole search may take.
  * @return LDAPResult object containing all LDAP results returned by
  *         the query.
  * @throws LDAPException An error occurred processing the search query.
@@ -321,7 +569,7 @@ LDAPResult *LDAPConnection::Search(const std::string base, int scope,
  *
  * @param base    Search base to start looking from.
  * @param filter  Filter string (e.g. attribute=value).
- * @param timeout Number of milliseconds to wait for a result.
+ * @param timeout Number of milliseconds the whole search may take.
  * @return LDAPResult object containing all LDAP results returned by
  *         the query.
  * @throws LDAPException An error occurred processing the search query.
@@ -0,0 +1,139 @@
+/*
+ * connection_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <string>
+#include <chrono>
+#include <thread>
+#include "ldap++.h"
+#include "mock_ldap_server.h"
+
+using namespace std;
+using ldap_client::LDAPConnection;
+
+namespace testing {
+class ConnectionTest : public CppUnit::TestCase {
+	CPPUNIT_TEST_SUITE(ConnectionTest);
+	CPPUNIT_TEST(testBind);
+	CPPUNIT_TEST(testBindTimeout);
+	CPPUNIT_TEST(testWireCounters);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+	void tearDown();
+
+	void testBind();
+	void testBindTimeout();
+	void testWireCounters();
+
+private:
+	MockLDAPServer* _server;
+};
+
+void
+ConnectionTest::setUp()
+{
+	_server = new MockLDAPServer;
+	_server->Start();
+	_server->AddUser("uid=jdoe,dc=example,dc=com", "secret");
+	_server->AddEntry("cn=a,dc=example,dc=com", {{"cn", {"a"}}});
+}
+
+void
+ConnectionTest::tearDown()
+{
+	delete _server;
+}
+
+void
+ConnectionTest::testBind()
+{
+	LDAPConnection conn(_server->GetURI());
+
+	conn.SimpleBind("uid=jdoe,dc=example,dc=com", "secret");
+	CPPUNIT_ASSERT_THROW(conn.SimpleBind("uid=jdoe,dc=example,dc=com",
+		"wrong"), ldap_client::LDAPErrInvalidCredentials);
+	CPPUNIT_ASSERT_THROW(conn.SetTimeout(0), ldap_client::LDAPErrParamError);
+}
+
+void
+ConnectionTest::testBindTimeout()
+{
+	LDAPConnection conn(_server->GetURI());
+	chrono::steady_clock::time_point start, until;
+
+	// A bind the server doesn't answer in time is abandoned.
+	_server->SetLatency(LDAP_REQ_BIND, 1000000);
+	conn.SetTimeout(200);
+	start = chrono::steady_clock::now();
+	CPPUNIT_ASSERT_THROW(conn.SimpleBind("uid=jdoe,dc=example,dc=com",
+		"secret"), ldap_client::LDAPErrTimeout);
+	CPPUNIT_ASSERT(chrono::steady_clock::now() - start <
+		chrono::milliseconds(600));
+
+	until = chrono::steady_clock::now() + chrono::seconds(2);
+	while (_server->GetRequestCount(LDAP_REQ_ABANDON) < 1 &&
+			chrono::steady_clock::now() < until)
+		this_thread::sleep_for(chrono::milliseconds(5));
+	CPPUNIT_ASSERT_EQUAL(1, _server->GetRequestCount(LDAP_REQ_ABANDON));
+}
+
+void
+ConnectionTest::testWireCounters()
+{
+	ldap_client::LDAPServerStats* stats =
+		ldap_client::LDAPServerStats::Get(_server->GetURI());
+	LDAPConnection conn(_server->GetURI());
+	ldap_client::LDAPStatsSnapshot snap;
+	ldap_client::LDAPIOCounters search, bind, total;
+
+	ldap_client::LDAPResetStats();
+
+	// The layer is installed when the connection is made, so the first
+	// request is counted; nothing is attributed to binds yet.
+	delete conn.Search("dc=example,dc=com", LDAP_SCOPE_SUBTREE, "(cn=a)",
+		{"cn"});
+	stats->Snapshot(&snap);
+	search = snap.io[ldap_client::kLdapOpSearch];
+	CPPUNIT_ASSERT(search.bytes_out > 0);
+	CPPUNIT_ASSERT(search.bytes_in > search.bytes_out);
+	CPPUNIT_ASSERT(search.writes > 0);
+	CPPUNIT_ASSERT(search.reads > 0);
+	bind = snap.io[ldap_client::kLdapOpBind];
+	CPPUNIT_ASSERT_EQUAL(0ULL, bind.bytes_in + bind.bytes_out +
+		bind.reads + bind.writes);
+
+	// A bind goes to the bind counters only.
+	conn.SimpleBind("uid=jdoe,dc=example,dc=com", "secret");
+	stats->Snapshot(&snap);
+	bind = snap.io[ldap_client::kLdapOpBind];
+	CPPUNIT_ASSERT(bind.bytes_out > 0);
+	CPPUNIT_ASSERT(bind.bytes_in > 0);
+	CPPUNIT_ASSERT_EQUAL(search.bytes_out,
+		snap.io[ldap_client::kLdapOpSearch].bytes_out);
+	CPPUNIT_ASSERT_EQUAL(search.bytes_in,
+		snap.io[ldap_client::kLdapOpSearch].bytes_in);
+
+	// The connection saw all of it.
+	total = conn.GetIOCounters();
+	CPPUNIT_ASSERT_EQUAL(search.bytes_out + bind.bytes_out,
+		total.bytes_out);
+	CPPUNIT_ASSERT_EQUAL(search.bytes_in + bind.bytes_in, total.bytes_in);
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ConnectionTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
@@ -6,7 +6,14 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <deque>
+#include <algorithm>
+#include <cstdlib>
+#include <strings.h>
 #include "ldap++.h"
+#include "slow_query_log.h"
+#include "tracer.h"
+#include "ldap_compat.h"
 #include <ldap.h>
 #ifdef HAVE_LDIF_H
 #include <ldif.h>
@@ -16,6 +23,55 @@ namespace ldap_client
 {
 static const std::string k_NewItemsString =
 	"All items in this file are new.";
+static const char k_RangeOption[] = ";range=";
+static const std::string k_RangeFilter = "(objectClass=*)";
+
+/**
+ * A range request which has been sent but whose result hasn't been read.
+ */
+struct PendingRange
+{
+	int msgid;
+	long first;
+	LDAPTimePoint start;
+	std::unique_ptr<LDAPTraceScope> trace;
+};
+
+/**
+ * Split an attribute description like "member;range=0-1499" into the
+ * attribute name and the bounds of the range. The upper bound is -1 for
+ * the final range ("member;range=1500-*").
+ *
+ * @return false if the description has no range option.
+ */
+static bool ParseRange(const std::string& key, std::string* name, long* low,
+	long* high)
+{
+	size_t pos = key.find(k_RangeOption);
+	const char* p;
+	char* end;
+
+	if (pos == std::string::npos)
+		return false;
+
+	p = key.c_str() + pos + sizeof(k_RangeOption) - 1;
+	*low = strtol(p, &end, 10);
+	if (end == p || *end != '-')
+		return false;
+
+	p = end + 1;
+	if (*p == '*')
+		*high = -1;
+	else
+	{
+		*high = strtol(p, &end, 10);
+		if (end == p || *high < *low)
+			return false;
+	}
+
+	*name = key.substr(0, pos);
+	return true;
+}
 
 /**
  * Create an entirely new LDAP entry.
@@ -31,40 +87,338 @@ LDAPEntry::LDAPEntry(LDAPConnection* conn, std::string dn)
 
 /**
  * Used by LDAPConnection to create a new object corresponding to an
- * LDAP record.
+ * LDAP record. The remaining ranges of ranged attributes are fetched
+ * within the timeout and with the cancellation token of the connection.
  *
  * @param conn  The LDAP connection this record originated from.
  * @param entry The LDAPMessage struct containing the entry's data.
+ * @throws LDAPErrTimeout The timeout passed while fetching a range.
+ * @throws LDAPErrUserCancelled The token was cancelled.
+ * @throws LDAPException An error occurred fetching a range.
  */
 LDAPEntry::LDAPEntry(LDAPConnection* conn, LDAPMessage* entry)
+: LDAPEntry(conn, entry, std::chrono::steady_clock::now() +
+	std::chrono::milliseconds(conn->_timeout), conn->_token)
+{
+}
+
+/**
+ * Create an object corresponding to an LDAP record returned by a search,
+ * fetching the remaining ranges of ranged attributes under the limits of
+ * that search.
+ *
+ * @param conn     The LDAP connection this record originated from.
+ * @param entry    The LDAPMessage struct containing the entry's data.
+ * @param deadline Point in time after which fetching ranges is given up.
+ * @param token    Token to check for cancellation, or NULL.
+ * @throws LDAPErrTimeout The deadline passed while fetching a range.
+ * @throws LDAPErrUserCancelled The token was cancelled.
+ * @throws LDAPException An error occurred fetching a range.
+ */
+LDAPEntry::LDAPEntry(LDAPConnection* conn, LDAPMessage* entry,
+	LDAPDeadline deadline, const LDAPCancellationToken* token)
 : _conn(conn)
 {
-	char *attr = ldap_get_dn(_conn->_ldap, entry);
-	BerElement *ptr;
+	LDAPEntryDecoder decoder(conn, entry);
+	struct berval name, value;
 
 	_isnew = false;
 
-	_dn = std::string(attr);
-	ldap_memfree(attr);
+	_dn = std::string(decoder.GetDN().bv_val, decoder.GetDN().bv_len);
+
+	while (decoder.NextAttribute(&name))
+	{
+		SearchableVector<std::string>& values =
+			_data[std::string(name.bv_val, name.bv_len)];
+
+		while (decoder.NextValue(&value))
+			values.push_back(std::string(value.bv_val, value.bv_len));
+	}
 
-	for (attr = ldap_first_attribute(_conn->_ldap, entry, &ptr);
-		attr != 0; attr = ldap_next_attribute(_conn->_ldap, entry, ptr))
+	LDAPControl** ctrls = 0;
+	if (ldap_get_entry_controls(conn->_ldap, entry, &ctrls) == LDAP_SUCCESS &&
+			ctrls)
 	{
-        SearchableVector<std::string> values;
-		struct berval **bv =
-				ldap_get_values_len(_conn->_ldap, entry, attr);
+		LDAPControl* deref = ldap_control_find(LDAP_CONTROL_X_DEREF, ctrls, 0);
+
+		try
+		{
+			if (deref)
+				ParseDerefControl(deref->ldctl_value);
+		}
+		catch (...)
+		{
+			ldap_controls_free(ctrls);
+			throw;
+		}
+
+		ldap_controls_free(ctrls);
+	}
+
+	if (conn->_range_retrieval)
+		FetchRanges(deadline, token);
+}
+
+/**
+ * Merge attributes returned in ranges under their plain name and fetch
+ * the values of the remaining ranges from the server.
+ *
+ * @param deadline Point in time after which to give up.
+ * @param token    Token to check for cancellation, or NULL.
+ * @throws LDAPException An error occurred fetching a range.
+ */
+void LDAPEntry::FetchRanges(LDAPDeadline deadline,
+	const LDAPCancellationToken* token)
+{
+	std::vector<std::string> ranged;
+	std::string name;
+	long low, high;
+
+	for (auto iter = _data.begin(); iter != _data.end(); iter++)
+		if (iter->first.find(k_RangeOption) != std::string::npos)
+			ranged.push_back(iter->first);
+
+	for (size_t i = 0; i < ranged.size(); i++)
+	{
+		SearchableVector<std::string> first;
+
+		if (!ParseRange(ranged[i], &name, &low, &high))
+			continue;
+
+		first.swap(_data[ranged[i]]);
+		_data.erase(ranged[i]);
+
+		SearchableVector<std::string>& values = _data[name];
+		values.insert(values.end(), first.begin(), first.end());
+
+		if (high >= 0)
+			FetchRange(name, high + 1, high - low + 1, values, deadline,
+				token);
+	}
+}
+
+/**
+ * Fetch the values of a ranged attribute from the given offset on,
+ * using ranges of step values each as chosen by the server. With parallel
+ * retrieval enabled on the connection, several ranges are requested
+ * ahead; if the server returns a shorter range than requested, the
+ * outstanding requests are abandoned and retrieval continues from where
+ * the server stopped.
+ *
+ * The retrieval is recorded as a search of its own and every range as
+ * one of its pages, in the statistics, the tracer and the slow query log.
+ *
+ * @param name     Attribute name without options.
+ * @param start    Index of the first value to fetch.
+ * @param step     Number of values per range.
+ * @param values   Vector to append the values to.
+ * @param deadline Point in time after which to give up.
+ * @param token    Token to check for cancellation, or NULL.
+ * @throws LDAPErrTimeout The deadline passed.
+ * @throws LDAPErrUserCancelled The token was cancelled.
+ * @throws LDAPException An error occurred fetching a range.
+ */
+void LDAPEntry::FetchRange(const std::string& name, long start, long step,
+	SearchableVector<std::string>& values, LDAPDeadline deadline,
+	const LDAPCancellationToken* token)
+{
+	LDAP* ld = _conn->_ldap;
+	LDAPServerStats* stats = _conn->_stats;
+	std::vector<std::string> attrs(1, name);
+	LDAPSlowQueryScope slow(ld, stats, kLdapOpSearch, _dn, LDAP_SCOPE_BASE,
+		&k_RangeFilter, &attrs);
+	LDAPTimePoint begin = std::chrono::steady_clock::now();
+	LDAPIOCounters io = _conn->_wire.Get();
+	std::deque<PendingRange> pending;
+	struct timeval tv;
+	long next = start;
+	bool done = false;
+
+	// Requests sent ahead which are no longer needed.
+	auto abandon = [ld, &pending]() {
+		for (size_t i = 0; i < pending.size(); i++)
+		{
+			ldap_abandon_ext(ld, pending[i].msgid, 0, 0);
+			pending[i].trace->End(LDAP_USER_CANCELLED);
+		}
+		pending.clear();
+	};
+
+	try
+	{
+		while (!done)
+		{
+			LDAPMessage* res = 0;
+			PendingRange range;
+			int rc, errcode;
+			long low = 0, high = -1;
+			bool found = false;
+
+			while ((int) pending.size() < _conn->_range_parallel)
+			{
+				PendingRange ahead;
+
+				ahead.first = next;
+				ahead.start = std::chrono::steady_clock::now();
+				ahead.trace.reset(new LDAPTraceScope(ld, stats,
+					kLdapOpSearchPage, _dn, LDAP_SCOPE_BASE, &k_RangeFilter));
+
+				// Also sent to the server as the time limit, in whole
+				// seconds.
+				tv.tv_sec = std::max<long long>(1,
+					std::chrono::duration_cast<std::chrono::seconds>(
+						deadline - ahead.start).count() + 1);
+				tv.tv_usec = 0;
+
+				std::string attr = name + k_RangeOption +
+					std::to_string(next) + "-" +
+					std::to_string(next + step - 1);
+				char* attrs[] = { const_cast<char*>(attr.c_str()), 0 };
+
+				rc = ldap_search_ext(ld, _dn.c_str(), LDAP_SCOPE_BASE,
+						k_RangeFilter.c_str(), attrs, 0, 0, 0, &tv, 0,
+						&ahead.msgid);
+				if (rc)
+				{
+					stats->AddError(rc);
+					ahead.trace->End(rc);
+					abandon();
+					LDAPErrCode2Exception(ld, rc);
+				}
+
+				ahead.trace->SetMessageID(ahead.msgid);
+				pending.push_back(std::move(ahead));
+				next += step;
+			}
+
+			range = std::move(pending.front());
+			pending.pop_front();
+
+			try
+			{
+				res = _conn->WaitForResult(range.msgid, deadline, token);
+			}
+			catch (...)
+			{
+				abandon();
+				throw;
+			}
+			stats->Record(kLdapOpSearchPage, range.start);
+			stats->AddPage();
 
-		for (int i = 0; i < ldap_count_values_len(bv); i++)
-            values.push_back(std::string(bv[i]->bv_val, bv[i]->bv_len));
+			try
+			{
+				LDAPMessage* e = ldap_first_entry(ld, res);
+
+				range.trace->AddEntries(res);
+				slow.AddPage(ldap_count_entries(ld, res),
+					slow.CountsBytes() ?
+					LDAPEntryDecoder::PageBytes(ld, res) : 0);
+
+				if (e)
+				{
+					LDAPEntryDecoder decoder(_conn, e);
+					struct berval key, value;
+					std::string attr;
+					long l, h;
+
+					while (decoder.NextAttribute(&key))
+					{
+						if (!ParseRange(std::string(key.bv_val,
+									key.bv_len), &attr, &l, &h) ||
+								strcasecmp(attr.c_str(), name.c_str()))
+							continue;
+
+						found = true;
+						low = l;
+						high = h;
+						while (decoder.NextValue(&value))
+							values.push_back(std::string(value.bv_val,
+									value.bv_len));
+					}
+				}
+			}
+			catch (...)
+			{
+				ldap_msgfree(res);
+				abandon();
+				throw;
+			}
 
-		ldap_value_free_len(bv);
+			rc = ldap_parse_result(ld, res, &errcode, 0, 0, 0, 0, 1);
+			if (rc == LDAP_SUCCESS)
+				rc = errcode;
+			range.trace->End(rc);
+			if (rc)
+			{
+				stats->AddError(rc);
+				abandon();
+				LDAPErrCode2Exception(ld, rc);
+			}
 
-		_data[std::string(attr)] = values;
-		ldap_memfree(attr);
+			if (!found || high < 0)
+				done = true;
+			else if (high != range.first + step - 1)
+			{
+				// The server used a different range size; realign.
+				abandon();
+				next = high + 1;
+				step = high - low + 1;
+			}
+		}
+	}
+	catch (...)
+	{
+		stats->AddIO(kLdapOpSearch, _conn->_wire.Get() - io);
+		throw;
 	}
 
-	if (ptr != 0)
-		ber_free(ptr, 0);
+	abandon();
+	stats->Record(kLdapOpSearch, begin);
+	stats->AddIO(kLdapOpSearch, _conn->_wire.Get() - io);
+	slow.End(LDAP_SUCCESS);
+}
+
+/**
+ * Build the referenced entries from a dereference response control
+ * attached to the entry.
+ *
+ * @param value Value of the dereference control.
+ * @throws LDAPErrDecodingError The control value is malformed.
+ */
+void LDAPEntry::ParseDerefControl(const struct berval& value)
+{
+	LDAPBerReader reader(value);
+	LDAPBerReader results = reader.ReadSequence();
+
+	while (!results.AtEnd())
+	{
+		LDAPBerReader result = results.ReadSequence();
+		std::string attribute = result.ReadString();
+		std::shared_ptr<LDAPEntry> target(
+			new LDAPEntry(_conn, result.ReadString()));
+
+		target->_isnew = false;
+
+		// The attribute values are omitted if none could be read.
+		if (!result.AtEnd())
+		{
+			LDAPBerReader attrs = result.ReadSequence(0xa0);
+
+			while (!attrs.AtEnd())
+			{
+				LDAPBerReader attr = attrs.ReadSequence();
+				SearchableVector<std::string>& values =
+					target->_data[attr.ReadString()];
+				LDAPBerReader vals = attr.ReadSequence(0x31);
+
+				while (!vals.AtEnd())
+					values.push_back(vals.ReadString());
+			}
+		}
+
+		_deref[attribute].push_back(target);
+	}
 }
 
 /**
@@ -104,6 +458,26 @@ SearchableVector<std::string> LDAPEntry::GetValue(std::string attribute)
 	return _data[attribute];
 }
 
+/**
+ * Returns the entries referenced by the given DN-valued attribute, as
+ * returned by a search with LDAPSearchRequest::SetDereference. Only the
+ * requested attributes of each referenced entry are filled in.
+ *
+ * @param attribute Name of the DN-valued attribute, e.g. "member".
+ * @return The referenced entries, in the order returned by the server.
+ */
+std::vector<LDAPEntry> LDAPEntry::GetDereferenced(std::string attribute)
+{
+	std::vector<LDAPEntry> rv;
+	auto iter = _deref.find(attribute);
+
+	if (iter != _deref.end())
+		for (size_t i = 0; i < iter->second.size(); i++)
+			rv.push_back(*iter->second[i]);
+
+	return rv;
+}
+
 /**
  * Returns the first value of the given LDAP attribute.
  *
@@ -188,12 +562,45 @@ void LDAPEntry::RemoveAllValues(std::string attribute)
 
 /**
  * Write changes to LDAP. If the entry wasn't in LDAP yet, it will be
- * created. Changes are executed in the order: removals, additions.
+ * created. Changes are executed in the order: removals, additions. The
+ * write is abandoned if it takes longer than the timeout of the
+ * connection.
  *
+ * @exception LDAPErrTimeout The write took too long.
  * @exception LDAPException Error occurred writing data to LDAP.
  */
 void LDAPEntry::Sync()
 {
+	Sync(std::string());
+}
+
+/**
+ * Write changes to LDAP on behalf of another user with the proxied
+ * authorization control (RFC 4370), so access controls for that user
+ * apply while the connection stays bound as a service account.
+ *
+ * @param authzid Authorization identity, e.g. "dn:uid=jdoe,dc=example".
+ *                If empty, the changes are made as the bound identity.
+ * @exception LDAPErrProxiedAuthorizationDenied The bound identity may
+ *            not act on behalf of authzid.
+ * @exception LDAPErrTimeout The write took longer than the timeout of
+ *            the connection.
+ * @exception LDAPException Error occurred writing data to LDAP.
+ */
+void LDAPEntry::Sync(const std::string authzid)
+{
+	LDAPControl proxy;
+	LDAPControl* ctrls[] = { &proxy, 0 };
+	LDAPOperation op = _isnew ? kLdapOpAdd : kLdapOpModify;
+	LDAPTraceScope trace(_conn->_ldap, _conn->_stats, op, _dn);
+	std::vector<std::string> attrs;
+	LDAPSlowQueryScope slow(_conn->_ldap, _conn->_stats, op, _dn, -1, 0,
+		&attrs);
+	LDAPIOCounters io = _conn->_wire.Get();
+	LDAPTimePoint start;
+	LDAPMessage* res;
+	int msgid, err;
+
 	// TODO(tonnerre): the bookkeeping in this method is terrible.
 	std::map<std::string, SearchableVector<std::string>*>::iterator iter;
 	SearchableVector<std::string>::iterator v_iter;
@@ -266,10 +673,27 @@ void LDAPEntry::Sync()
 	// This needs to be NULL terminated.
 	mods.push_back(0);
 
+	if (slow.Active())
+	{
+		for (iter = _removed.begin(); iter != _removed.end(); iter++)
+			attrs.push_back(iter->first);
+		for (iter = _added.begin(); iter != _added.end(); iter++)
+			if (!_removed.count(iter->first))
+				attrs.push_back(iter->first);
+	}
+
+	proxy.ldctl_oid = (char*) LDAP_CONTROL_PROXY_AUTHZ;
+	proxy.ldctl_iscritical = 1;
+	proxy.ldctl_value.bv_val = const_cast<char*>(authzid.data());
+	proxy.ldctl_value.bv_len = authzid.length();
+
+	start = std::chrono::steady_clock::now();
 	if (_isnew)
-		rc = ldap_add_ext_s(_conn->_ldap, _dn.c_str(), &mods[0], 0, 0);
+		rc = ldap_add_ext(_conn->_ldap, _dn.c_str(), &mods[0],
+				authzid.empty() ? 0 : ctrls, 0, &msgid);
 	else
-		rc = ldap_modify_ext_s(_conn->_ldap, _dn.c_str(), &mods[0], 0, 0);
+		rc = ldap_modify_ext(_conn->_ldap, _dn.c_str(), &mods[0],
+				authzid.empty() ? 0 : ctrls, 0, &msgid);
 
 	for (m_iter = mods.begin(); m_iter != mods.end(); m_iter++)
 		if (*m_iter)
@@ -281,8 +705,28 @@ void LDAPEntry::Sync()
 	for (c_iter = cleanup.begin(); c_iter != cleanup.end(); c_iter++)
 		free(*c_iter);
 
+	// The request has been encoded, so the mods are no longer needed.
+	if (rc == LDAP_SUCCESS)
+	{
+		trace.SetMessageID(msgid);
+		res = _conn->WaitForResult(msgid, start +
+			std::chrono::milliseconds(_conn->_timeout), _conn->_token);
+		rc = ldap_parse_result(_conn->_ldap, res, &err, 0, 0, 0, 0, 1);
+		if (rc == LDAP_SUCCESS)
+			rc = err;
+	}
+
+	_conn->_stats->Record(op, start);
+	_conn->_stats->AddIO(op, _conn->_wire.Get() - io);
+	trace.End(rc);
+
+	slow.End(rc);
+
 	if (rc != LDAP_SUCCESS)
+	{
+		_conn->_stats->AddError(rc);
 		LDAPErrCode2Exception(_conn->_ldap, rc);
+	}
 }
 
 /**
@@ -332,14 +776,14 @@ void LDAPEntry::Output(std::ostream& out)
 	}
 	else
 	{
-		std::map<std::string, SearchableVector<std::string>*>::iterator iter;
+		std::map<std::string, SearchableVector<std::string> >::iterator iter;
 
 		for (iter = _data.begin(); iter != _data.end(); iter++)
 		{
 			std::vector<std::string>::iterator v_iter;
 
-			for (v_iter = iter->second->begin();
-					v_iter != iter->second->end(); v_iter++)
+			for (v_iter = iter->second.begin();
+					v_iter != iter->second.end(); v_iter++)
 			{
 				if ((ldif = ldif_put_wrap(LDIF_PUT_VALUE, iter->first.c_str(),
 						v_iter->c_str(), v_iter->length(), LDIF_LINE_WIDTH)))
@@ -0,0 +1,106 @@
+/*
+ * Decoding of search result entries: the libldap accessor chain against
+ * LDAPEntryDecoder, for entries of increasing width.
+ */
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "bench_util.h"
+
+using namespace ldap_bench;
+
+static const int k_Values = 4;
+static const int k_ValueLength = 24;
+
+static void BM_AccessorChain(benchmark::State& state)
+{
+	MessageFactory factory;
+	LDAP* ld = factory.GetLDAP();
+	LDAPMessage* res = factory.Search(std::vector<Entry>(1,
+		MakeEntry("cn=bench,dc=example,dc=com", state.range(0),
+			k_Values, k_ValueLength)));
+	LDAPMessage* e = ldap_first_entry(ld, res);
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+	{
+		BerElement* ber = 0;
+
+		for (char* attr = ldap_first_attribute(ld, e, &ber); attr != 0;
+				attr = ldap_next_attribute(ld, e, ber))
+		{
+			struct berval** bv = ldap_get_values_len(ld, e, attr);
+			std::string name(attr);
+
+			benchmark::DoNotOptimize(name);
+			for (int i = 0; i < ldap_count_values_len(bv); i++)
+			{
+				std::string value(bv[i]->bv_val, bv[i]->bv_len);
+				benchmark::DoNotOptimize(value);
+			}
+
+			ldap_value_free_len(bv);
+			ldap_memfree(attr);
+		}
+
+		if (ber != 0)
+			ber_free(ber, 0);
+	}
+
+	ldap_msgfree(res);
+}
+BENCHMARK(BM_AccessorChain)->Arg(8)->Arg(64)->Arg(256);
+
+static void BM_EntryDecoder(benchmark::State& state)
+{
+	MessageFactory factory;
+	LDAPMessage* res = factory.Search(std::vector<Entry>(1,
+		MakeEntry("cn=bench,dc=example,dc=com", state.range(0),
+			k_Values, k_ValueLength)));
+	LDAPMessage* e = ldap_first_entry(factory.GetLDAP(), res);
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+	{
+		ldap_client::LDAPEntryDecoder decoder(factory.GetConnection(), e);
+		struct berval name, value;
+
+		while (decoder.NextAttribute(&name))
+		{
+			std::string n(name.bv_val, name.bv_len);
+
+			benchmark::DoNotOptimize(n);
+			while (decoder.NextValue(&value))
+			{
+				std::string v(value.bv_val, value.bv_len);
+				benchmark::DoNotOptimize(v);
+			}
+		}
+	}
+
+	ldap_msgfree(res);
+}
+BENCHMARK(BM_EntryDecoder)->Arg(8)->Arg(64)->Arg(256);
+
+static void BM_EntryDecoderViews(benchmark::State& state)
+{
+	MessageFactory factory;
+	LDAPMessage* res = factory.Search(std::vector<Entry>(1,
+		MakeEntry("cn=bench,dc=example,dc=com", state.range(0),
+			k_Values, k_ValueLength)));
+	LDAPMessage* e = ldap_first_entry(factory.GetLDAP(), res);
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+	{
+		ldap_client::LDAPEntryDecoder decoder(factory.GetConnection(), e);
+		struct berval name, value;
+
+		while (decoder.NextAttribute(&name))
+			while (decoder.NextValue(&value))
+				benchmark::DoNotOptimize(value.bv_val);
+	}
+
+	ldap_msgfree(res);
+}
+BENCHMARK(BM_EntryDecoderViews)->Arg(8)->Arg(64)->Arg(256);
@@ -0,0 +1,141 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "ldap++.h"
+#include <ldap.h>
+#include <lber.h>
+
+namespace ldap_client
+{
+/**
+ * Prepare to decode an entry received over the given connection. Only the
+ * DN is decoded here; attributes are decoded on demand by NextAttribute.
+ *
+ * @param conn  The LDAP connection this entry originated from.
+ * @param entry The LDAPMessage containing the entry.
+ * @throws LDAPException The entry could not be decoded.
+ */
+LDAPEntryDecoder::LDAPEntryDecoder(LDAPConnection* conn, LDAPMessage* entry)
+: _ber(0)
+{
+	int rc = ldap_get_dn_ber(conn->_ldap, entry, &_ber, &_dn);
+
+	if (rc)
+	{
+		if (_ber)
+			ber_free(_ber, 0);
+		LDAPErrCode2Exception(conn->_ldap, rc);
+	}
+}
+
+/**
+ * Prepare to decode the contents of a raw SearchResultEntry, i.e. the
+ * objectName followed by the attribute list.
+ *
+ * @param entry The BER encoded entry. Must outlive the decoder.
+ * @throws LDAPErrDecodingError The entry could not be decoded.
+ */
+LDAPEntryDecoder::LDAPEntryDecoder(const struct berval& entry)
+: _ber(0)
+{
+	LDAPBerReader reader(entry);
+
+	reader.ReadOctetString(&_dn);
+	_attrs = reader.ReadSequence();
+}
+
+LDAPEntryDecoder::~LDAPEntryDecoder()
+{
+	// The buffer belongs to the LDAPMessage.
+	if (_ber)
+		ber_free(_ber, 0);
+}
+
+/**
+ * Advance to the next attribute of the entry. Any values of the previous
+ * attribute which have not been read are skipped.
+ *
+ * @param name Set to the name of the attribute.
+ * @return false if there are no more attributes.
+ * @throws LDAPErrDecodingError The entry is malformed.
+ */
+bool LDAPEntryDecoder::NextAttribute(struct berval* name)
+{
+	struct berval attr;
+
+	if (_ber)
+	{
+		ber_len_t remaining = 0;
+
+		ber_get_option(_ber, LBER_OPT_BER_REMAINING_BYTES, &remaining);
+		if (remaining == 0)
+			return false;
+
+		if (ber_skip_element(_ber, &attr) != 0x30)
+			throw LDAPErrDecodingError("Invalid attribute in entry");
+	}
+	else
+	{
+		if (_attrs.AtEnd())
+			return false;
+
+		if (_attrs.ReadElement(&attr) != 0x30)
+			throw LDAPErrDecodingError("Invalid attribute in entry");
+	}
+
+	LDAPBerReader partial(attr);
+
+	partial.ReadOctetString(name);
+	_values = partial.ReadSequence(0x31);
+
+	return true;
+}
+
+/**
+ * Fetch the next value of the current attribute.
+ *
+ * @param value Set to the value, pointing into the message buffer.
+ * @return false if the attribute has no more values.
+ * @throws LDAPErrDecodingError The entry is malformed.
+ */
+bool LDAPEntryDecoder::NextValue(struct berval* value)
+{
+	if (_values.AtEnd())
+		return false;
+
+	_values.ReadOctetString(value);
+	return true;
+}
+
+/**
+ * Add up the encoded size of the entries in a page of results, i.e. the
+ * DN and attribute list of each. Used wherever result sizes are reported
+ * so that traces, profiles and the slow query log agree.
+ *
+ * @param ld  LDAP handle the page was received on.
+ * @param msg The page of results.
+ * @return Number of bytes.
+ */
+size_t LDAPEntryDecoder::PageBytes(LDAP* ld, LDAPMessage* msg)
+{
+	size_t bytes = 0;
+
+	for (LDAPMessage* e = ldap_first_entry(ld, msg); e != NULL;
+			e = ldap_next_entry(ld, e))
+	{
+		BerElement* ber = 0;
+		struct berval dn;
+		ber_len_t len = 0;
+
+		if (ldap_get_dn_ber(ld, e, &ber, &dn) == LDAP_SUCCESS)
+		{
+			ber_get_option(ber, LBER_OPT_BER_REMAINING_BYTES, &len);
+			bytes += dn.bv_len + len;
+		}
+		if (ber)
+			ber_free(ber, 0);
+	}
+
+	return bytes;
+}
+}
@@ -0,0 +1,358 @@
+/*
+ * entry_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include "ldap++.h"
+#include "mock_server_fixture.h"
+
+using namespace std;
+using ldap_client::LDAPConnection;
+using ldap_client::LDAPEntry;
+using ldap_client::LDAPResult;
+using ldap_client::LDAPSearchRequest;
+using ldap_client::LDAPDerefSpec;
+
+namespace testing {
+class EntryTest : public MockServerFixture {
+	CPPUNIT_TEST_SUITE(EntryTest);
+	CPPUNIT_TEST(testRanges);
+	CPPUNIT_TEST(testParallelRanges);
+	CPPUNIT_TEST(testRangeRealign);
+	CPPUNIT_TEST(testRangeError);
+	CPPUNIT_TEST(testRangeDeadline);
+	CPPUNIT_TEST(testRangeStats);
+	CPPUNIT_TEST(testSyncTimeout);
+	CPPUNIT_TEST(testDereference);
+	CPPUNIT_TEST(testSyncProxiedAuthorization);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+	void tearDown();
+
+	void testRanges();
+	void testParallelRanges();
+	void testRangeRealign();
+	void testRangeError();
+	void testRangeDeadline();
+	void testRangeStats();
+	void testSyncTimeout();
+	void testDereference();
+	void testSyncProxiedAuthorization();
+
+private:
+	void checkMembers(LDAPEntry& entry);
+
+	vector<string> _members;
+};
+
+void
+EntryTest::setUp()
+{
+	MockServerFixture::setUp();
+
+	_members.clear();
+	for (int i = 0; i < 35; i++)
+		_members.push_back("cn=user" + to_string(i) + ",dc=example,dc=com");
+	_server->AddEntry("cn=big,dc=example,dc=com",
+		{{"cn", {"big"}}, {"member", _members}});
+	_server->SetMaxValRange(10);
+}
+
+void
+EntryTest::tearDown()
+{
+	ldap_client::LDAPSetSlowQueryLog(0);
+	MockServerFixture::tearDown();
+}
+
+void
+EntryTest::checkMembers(LDAPEntry& entry)
+{
+	ldap_client::SearchableVector<string> keys = entry.GetKeys();
+	ldap_client::SearchableVector<string> values = entry.GetValue("member");
+
+	// The ranged names are merged under the plain attribute name.
+	CPPUNIT_ASSERT_EQUAL((size_t) 1, keys.size());
+	CPPUNIT_ASSERT_EQUAL(string("member"), keys[0]);
+	CPPUNIT_ASSERT_EQUAL(_members.size(), values.size());
+	for (size_t i = 0; i < values.size() && i < _members.size(); i++)
+		CPPUNIT_ASSERT_EQUAL(_members[i], values[i]);
+}
+
+void
+EntryTest::testRanges()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPResult* res;
+
+	// 0-9 with the entry, then 10-19, 20-29 and 30-*.
+	res = conn.Search("cn=big,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"member"});
+	checkMembers(res->GetEntries()->front());
+	delete res;
+	CPPUNIT_ASSERT_EQUAL(4, _server->GetRequestCount(LDAP_REQ_SEARCH));
+
+	// Without range retrieval only the first range is returned.
+	conn.SetRangeRetrieval(false);
+	res = conn.Search("cn=big,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"member"});
+	CPPUNIT_ASSERT_EQUAL((size_t) 10, res->GetEntries()->front().GetValue(
+		"member;range=0-9").size());
+	delete res;
+}
+
+void
+EntryTest::testParallelRanges()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPResult* res;
+
+	conn.SetRangeRetrieval(true, 3);
+	res = conn.Search("cn=big,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"member"});
+	checkMembers(res->GetEntries()->front());
+	delete res;
+
+	// The entry, the three ranges and the three requests sent ahead of
+	// the last range.
+	CPPUNIT_ASSERT(_server->GetRequestCount(LDAP_REQ_SEARCH) >= 4);
+	CPPUNIT_ASSERT_THROW(conn.SetRangeRetrieval(true, 0),
+		ldap_client::LDAPErrParamError);
+}
+
+void
+EntryTest::testRangeRealign()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("cn=big,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"member"});
+	int entries = 0;
+
+	conn.SetRangeRetrieval(true, 3);
+
+	// The first range has 10 values, the server then switches to 4; the
+	// requests sent ahead for 10 values each must not leave gaps or
+	// duplicates.
+	req.Execute(&conn, [&](LDAPMessage* msg) {
+		_server->SetMaxValRange(4);
+
+		LDAPEntry entry(&conn, msg);
+		checkMembers(entry);
+		entries++;
+		return true;
+	});
+	CPPUNIT_ASSERT_EQUAL(1, entries);
+}
+
+void
+EntryTest::testRangeError()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("cn=big,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"member"});
+	chrono::steady_clock::time_point until;
+	bool failed = false;
+
+	conn.SetRangeRetrieval(true, 3);
+
+	// Fail every range after the first, slowly enough that the requests
+	// sent ahead are still outstanding when the first error arrives.
+	req.Execute(&conn, [&](LDAPMessage* msg) {
+		_server->SetError(LDAP_REQ_SEARCH, LDAP_BUSY);
+		_server->SetLatency(LDAP_REQ_SEARCH, 20000);
+		try
+		{
+			LDAPEntry entry(&conn, msg);
+		}
+		catch (ldap_client::LDAPErrBusy&)
+		{
+			failed = true;
+		}
+		return true;
+	});
+	CPPUNIT_ASSERT(failed);
+
+	until = chrono::steady_clock::now() + chrono::seconds(2);
+	while (_server->GetRequestCount(LDAP_REQ_ABANDON) < 2 &&
+			chrono::steady_clock::now() < until)
+		this_thread::sleep_for(chrono::milliseconds(5));
+	CPPUNIT_ASSERT_EQUAL(2, _server->GetRequestCount(LDAP_REQ_ABANDON));
+}
+
+void
+EntryTest::testRangeDeadline()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("cn=big,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"member"});
+	ldap_client::LDAPCancellationToken token;
+	chrono::steady_clock::time_point start;
+
+	// The entry and the first two ranges fit into the deadline of the
+	// search, the third does not.
+	_server->SetLatency(LDAP_REQ_SEARCH, 200000);
+	start = chrono::steady_clock::now();
+	req.SetDeadline(start + chrono::milliseconds(500));
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn), ldap_client::LDAPErrTimeout);
+	CPPUNIT_ASSERT(chrono::steady_clock::now() - start <
+		chrono::milliseconds(700));
+
+	// Entries built by a handler can be given the token of the search.
+	_server->SetLatency(LDAP_REQ_SEARCH, 0);
+	req.SetDeadline(chrono::steady_clock::now() + chrono::seconds(10));
+	req.SetCancellationToken(&token);
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn, [&](LDAPMessage* msg) {
+		token.Cancel();
+		LDAPEntry entry(&conn, msg, chrono::steady_clock::now() +
+			chrono::seconds(10), &token);
+		return true;
+	}), ldap_client::LDAPErrUserCancelled);
+}
+
+void
+EntryTest::testRangeStats()
+{
+	ldap_client::LDAPServerStats* stats =
+		ldap_client::LDAPServerStats::Get(_server->GetURI());
+	LDAPConnection conn(_server->GetURI());
+	ldap_client::LDAPSlowQueryLog log;
+	vector<ldap_client::LDAPSlowQuery> queries;
+	ldap_client::LDAPStatsSnapshot snap;
+	LDAPResult* res;
+
+	ldap_client::LDAPResetStats();
+	ldap_client::LDAPSetSlowQueryLog(&log);
+
+	// Fetching the three remaining ranges counts as a search of its own
+	// with a page for every range.
+	res = conn.Search("cn=big,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"member"});
+	delete res;
+	stats->Snapshot(&snap);
+	CPPUNIT_ASSERT_EQUAL(2ULL,
+		snap.latency[ldap_client::kLdapOpSearch].count);
+	CPPUNIT_ASSERT_EQUAL(4ULL,
+		snap.latency[ldap_client::kLdapOpSearchPage].count);
+	CPPUNIT_ASSERT_EQUAL(4ULL, snap.pages);
+	CPPUNIT_ASSERT(snap.io[ldap_client::kLdapOpSearch].writes >= 4);
+
+	queries = log.Get();
+	CPPUNIT_ASSERT_EQUAL((size_t) 2, queries.size());
+	CPPUNIT_ASSERT(queries[0].pages == 3 || queries[1].pages == 3);
+}
+
+void
+EntryTest::testSyncTimeout()
+{
+	LDAPConnection conn(_server->GetURI());
+	chrono::steady_clock::time_point start, until;
+	LDAPResult* res;
+
+	res = conn.Search("cn=big,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"cn"});
+
+	// A write the server doesn't answer in time is abandoned.
+	_server->SetLatency(LDAP_REQ_MODIFY, 1000000);
+	conn.SetTimeout(200);
+	res->GetEntries()->front().AddValue("description", "x");
+	start = chrono::steady_clock::now();
+	CPPUNIT_ASSERT_THROW(res->GetEntries()->front().Sync(),
+		ldap_client::LDAPErrTimeout);
+	CPPUNIT_ASSERT(chrono::steady_clock::now() - start <
+		chrono::milliseconds(600));
+	delete res;
+
+	until = chrono::steady_clock::now() + chrono::seconds(2);
+	while (_server->GetRequestCount(LDAP_REQ_ABANDON) < 1 &&
+			chrono::steady_clock::now() < until)
+		this_thread::sleep_for(chrono::milliseconds(5));
+	CPPUNIT_ASSERT_EQUAL(1, _server->GetRequestCount(LDAP_REQ_ABANDON));
+}
+
+void
+EntryTest::testDereference()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("cn=staff,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"member"});
+	LDAPResult* res;
+	vector<LDAPEntry> members;
+
+	_server->AddEntry("cn=user1,dc=example,dc=com", {{"cn", {"user1"}}});
+	_server->AddEntry("cn=user2,dc=example,dc=com", {{"cn", {"user2"}}});
+	_server->AddEntry("cn=staff,dc=example,dc=com",
+		{{"cn", {"staff"}}, {"member", {"cn=user1,dc=example,dc=com",
+			"cn=user2,dc=example,dc=com", "cn=gone,dc=example,dc=com"}}});
+
+	req.SetDereference({LDAPDerefSpec("member", {"cn"})});
+	res = req.Execute(&conn);
+	members = res->GetEntries()->front().GetDereferenced("member");
+	CPPUNIT_ASSERT(res->GetEntries()->front().GetDereferenced("cn").empty());
+	delete res;
+
+	CPPUNIT_ASSERT(sent(LDAP_CONTROL_X_DEREF));
+	CPPUNIT_ASSERT_EQUAL((size_t) 3, members.size());
+	CPPUNIT_ASSERT_EQUAL(string("cn=user1,dc=example,dc=com"),
+		members[0].GetDN());
+	CPPUNIT_ASSERT_EQUAL(string("user1"), members[0].GetFirstValue("cn"));
+	CPPUNIT_ASSERT_EQUAL(string("user2"), members[1].GetFirstValue("cn"));
+
+	// A reference to a missing entry comes back without attributes.
+	CPPUNIT_ASSERT_EQUAL(string("cn=gone,dc=example,dc=com"),
+		members[2].GetDN());
+	CPPUNIT_ASSERT(members[2].GetKeys().empty());
+
+	req.SetDereference({});
+	res = req.Execute(&conn);
+	CPPUNIT_ASSERT(!sent(LDAP_CONTROL_X_DEREF));
+	CPPUNIT_ASSERT(res->GetEntries()->front().GetDereferenced("member").empty());
+	delete res;
+}
+
+void
+EntryTest::testSyncProxiedAuthorization()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPResult* res;
+
+	res = conn.Search("cn=big,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"cn"});
+	LDAPEntry& entry = res->GetEntries()->front();
+
+	// The control is critical, so a server without it refuses the write.
+	entry.AddValue("mail", "big@example.com");
+	CPPUNIT_ASSERT_THROW(entry.Sync("dn:cn=big,dc=example,dc=com"),
+		ldap_client::LDAPErrUnavailableCriticalExtension);
+	CPPUNIT_ASSERT(sent(LDAP_CONTROL_PROXY_AUTHZ));
+	CPPUNIT_ASSERT(_server->GetEntry("cn=big,dc=example,dc=com")["mail"]
+		.empty());
+
+	_server->SetControlSupported(LDAP_CONTROL_PROXY_AUTHZ, true);
+	entry.AddValue("mail", "big@example.com");
+	entry.Sync("dn:cn=big,dc=example,dc=com");
+	CPPUNIT_ASSERT(sent(LDAP_CONTROL_PROXY_AUTHZ));
+	CPPUNIT_ASSERT_EQUAL(string("big@example.com"),
+		_server->GetEntry("cn=big,dc=example,dc=com")["mail"][0]);
+	delete res;
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(EntryTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
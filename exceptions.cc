@@ -79,6 +79,9 @@ void LDAPErrCode2Exception(LDAP* ldap, int errcode)
 				diag_text);
 	case LDAP_PARTIAL_RESULTS:
 		throw LDAPErrPartialResults(ldap_err2string(errcode), diag_text);
+	case LDAP_UNAVAILABLE_CRITICAL_EXTENSION:
+		throw LDAPErrUnavailableCriticalExtension(ldap_err2string(errcode),
+				diag_text);
 	case LDAP_NO_SUCH_ATTRIBUTE:
 		throw LDAPErrNoSuchAttribute(ldap_err2string(errcode), diag_text);
 	case LDAP_UNDEFINED_TYPE:
@@ -136,6 +139,11 @@ void LDAPErrCode2Exception(LDAP* ldap, int errcode)
 		throw LDAPErrNoObjectClassMods(ldap_err2string(errcode), diag_text);
 	case LDAP_OTHER:
 		throw LDAPErrOther(ldap_err2string(errcode), diag_text);
+#ifdef LDAP_PROXIED_AUTHORIZATION_DENIED
+	case LDAP_PROXIED_AUTHORIZATION_DENIED:
+		throw LDAPErrProxiedAuthorizationDenied(ldap_err2string(errcode),
+				diag_text);
+#endif /* LDAP_PROXIED_AUTHORIZATION_DENIED */
 
 	/* API error codes. */
 	case LDAP_SERVER_DOWN:
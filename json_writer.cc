@@ -0,0 +1,341 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <ostream>
+#include "ldap++.h"
+#include <ldap.h>
+
+namespace ldap_client
+{
+static const char k_Base64Alphabet[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char k_HexDigits[] = "0123456789abcdef";
+
+/**
+ * Checks whether the given buffer holds well-formed UTF-8 which can be
+ * emitted as a JSON string. Overlong forms, surrogates and code points
+ * beyond U+10FFFF are rejected.
+ *
+ * @param str Buffer to check.
+ * @param len Length of the buffer in bytes.
+ * @return true if the buffer is valid UTF-8.
+ */
+static bool IsValidUTF8(const unsigned char* str, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len)
+	{
+		unsigned char c = str[i];
+		size_t n;
+		unsigned int cp;
+
+		if (c < 0x80)
+		{
+			i++;
+			continue;
+		}
+		else if ((c & 0xe0) == 0xc0)
+		{
+			n = 1;
+			cp = c & 0x1f;
+		}
+		else if ((c & 0xf0) == 0xe0)
+		{
+			n = 2;
+			cp = c & 0x0f;
+		}
+		else if ((c & 0xf8) == 0xf0)
+		{
+			n = 3;
+			cp = c & 0x07;
+		}
+		else
+			return false;
+
+		// Truncated sequence.
+		if (i + n >= len)
+			return false;
+
+		for (size_t j = 1; j <= n; j++)
+		{
+			if ((str[i + j] & 0xc0) != 0x80)
+				return false;
+			cp = (cp << 6) | (str[i + j] & 0x3f);
+		}
+
+		if ((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) ||
+				(n == 3 && cp < 0x10000) || cp > 0x10ffff ||
+				(cp >= 0xd800 && cp <= 0xdfff))
+			return false;
+
+		i += n + 1;
+	}
+
+	return true;
+}
+
+/**
+ * Create a new JSON writer. Entries are collected in an internal buffer
+ * which is written to the stream whenever it exceeds bufsize bytes, so
+ * memory usage stays constant regardless of the number of entries.
+ *
+ * @param out     Stream to write the JSON document to.
+ * @param ndjson  If true, write one JSON object per line (NDJSON);
+ *                otherwise write a single JSON array.
+ * @param bufsize Number of bytes to buffer before writing to the stream.
+ */
+LDAPJSONWriter::LDAPJSONWriter(std::ostream& out, bool ndjson,
+	size_t bufsize)
+: _out(out), _bufsize(bufsize), _ndjson(ndjson), _started(false),
+	_finished(false), _first_attr(true), _first_value(true)
+{
+	_buf.reserve(_bufsize + 4096);
+}
+
+/**
+ * Finish the document and flush any pending output.
+ */
+LDAPJSONWriter::~LDAPJSONWriter()
+{
+	Finish();
+}
+
+/**
+ * Serialize an LDAPEntry object.
+ *
+ * @param entry The entry to write.
+ */
+void LDAPJSONWriter::Write(LDAPEntry& entry)
+{
+	BeginEntry(entry._dn.data(), entry._dn.length());
+
+	for (auto iter = entry._data.begin(); iter != entry._data.end(); iter++)
+	{
+		BeginAttribute(iter->first.data(), iter->first.length());
+
+		for (auto v_iter = iter->second.begin();
+				v_iter != iter->second.end(); v_iter++)
+			AddValue(v_iter->data(), v_iter->length());
+
+		EndAttribute();
+	}
+
+	EndEntry();
+}
+
+/**
+ * Serialize a search result entry directly from the LDAP message, without
+ * building an intermediate LDAPEntry. Intended to be used from the
+ * handler passed to LDAPConnection::SearchStream.
+ *
+ * @param conn  The LDAP connection the entry originated from.
+ * @param entry The LDAPMessage containing the entry.
+ * @throws LDAPException The entry could not be decoded.
+ */
+void LDAPJSONWriter::Write(LDAPConnection* conn, LDAPMessage* entry)
+{
+	LDAPEntryDecoder decoder(conn, entry);
+	struct berval name, value;
+
+	BeginEntry(decoder.GetDN().bv_val, decoder.GetDN().bv_len);
+
+	while (decoder.NextAttribute(&name))
+	{
+		BeginAttribute(name.bv_val, name.bv_len);
+		while (decoder.NextValue(&value))
+			AddValue(value.bv_val, value.bv_len);
+		EndAttribute();
+	}
+
+	EndEntry();
+}
+
+/**
+ * Terminate the JSON document and flush it to the stream. No more
+ * entries may be written afterwards.
+ */
+void LDAPJSONWriter::Finish()
+{
+	if (_finished)
+		return;
+
+	if (!_ndjson)
+		_buf.append(_started ? "\n]\n" : "[]\n");
+
+	_finished = true;
+	Flush();
+}
+
+/**
+ * Write all buffered data to the output stream.
+ */
+void LDAPJSONWriter::Flush()
+{
+	if (!_buf.empty())
+		_out.write(_buf.data(), _buf.length());
+
+	_buf.clear();
+}
+
+void LDAPJSONWriter::BeginEntry(const char* dn, size_t len)
+{
+	if (_finished)
+		throw LDAPErrParamError("JSON document already finished");
+
+	if (!_ndjson)
+		_buf.append(_started ? ",\n" : "[\n");
+
+	_started = true;
+	_first_attr = true;
+
+	_buf.append("{\"dn\":");
+	PutString(dn, len);
+	_buf.append(",\"attributes\":{");
+}
+
+void LDAPJSONWriter::BeginAttribute(const char* name, size_t len)
+{
+	if (!_first_attr)
+		_buf.push_back(',');
+
+	_first_attr = false;
+	_first_value = true;
+
+	PutString(name, len);
+	_buf.append(":[");
+}
+
+/**
+ * Values which are not valid UTF-8 (e.g. jpegPhoto, objectGUID) cannot be
+ * represented as JSON strings and are written as {"base64":"..."}.
+ */
+void LDAPJSONWriter::AddValue(const char* value, size_t len)
+{
+	if (!_first_value)
+		_buf.push_back(',');
+
+	_first_value = false;
+
+	if (IsValidUTF8(reinterpret_cast<const unsigned char*>(value), len))
+		PutString(value, len);
+	else
+	{
+		_buf.append("{\"base64\":\"");
+		PutBase64(value, len);
+		_buf.append("\"}");
+	}
+
+	if (_buf.length() >= _bufsize)
+		Flush();
+}
+
+void LDAPJSONWriter::EndAttribute()
+{
+	_buf.push_back(']');
+}
+
+void LDAPJSONWriter::EndEntry()
+{
+	_buf.append("}}");
+
+	if (_ndjson)
+		_buf.push_back('\n');
+
+	if (_buf.length() >= _bufsize)
+		Flush();
+}
+
+/**
+ * Append the given UTF-8 string to the buffer as a quoted JSON string.
+ */
+void LDAPJSONWriter::PutString(const char* str, size_t len)
+{
+	const char* start = str;
+	const char* end = str + len;
+
+	_buf.push_back('"');
+
+	for (const char* p = str; p < end; p++)
+	{
+		unsigned char c = *p;
+
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		_buf.append(start, p - start);
+		start = p + 1;
+
+		switch (c)
+		{
+		case '"':
+			_buf.append("\\\"");
+			break;
+		case '\\':
+			_buf.append("\\\\");
+			break;
+		case '\n':
+			_buf.append("\\n");
+			break;
+		case '\r':
+			_buf.append("\\r");
+			break;
+		case '\t':
+			_buf.append("\\t");
+			break;
+		case '\b':
+			_buf.append("\\b");
+			break;
+		case '\f':
+			_buf.append("\\f");
+			break;
+		default:
+			_buf.append("\\u00");
+			_buf.push_back(k_HexDigits[c >> 4]);
+			_buf.push_back(k_HexDigits[c & 0x0f]);
+		}
+	}
+
+	_buf.append(start, end - start);
+	_buf.push_back('"');
+}
+
+/**
+ * Append the base64 representation of the given data to the buffer.
+ */
+void LDAPJSONWriter::PutBase64(const char* data, size_t len)
+{
+	const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+	size_t i;
+
+	for (i = 0; i + 2 < len; i += 3)
+	{
+		_buf.push_back(k_Base64Alphabet[in[i] >> 2]);
+		_buf.push_back(k_Base64Alphabet[((in[i] & 0x03) << 4) |
+				(in[i + 1] >> 4)]);
+		_buf.push_back(k_Base64Alphabet[((in[i + 1] & 0x0f) << 2) |
+				(in[i + 2] >> 6)]);
+		_buf.push_back(k_Base64Alphabet[in[i + 2] & 0x3f]);
+	}
+
+	if (i < len)
+	{
+		_buf.push_back(k_Base64Alphabet[in[i] >> 2]);
+
+		if (i + 1 < len)
+		{
+			_buf.push_back(k_Base64Alphabet[((in[i] & 0x03) << 4) |
+					(in[i + 1] >> 4)]);
+			_buf.push_back(k_Base64Alphabet[(in[i + 1] & 0x0f) << 2]);
+		}
+		else
+		{
+			_buf.push_back(k_Base64Alphabet[(in[i] & 0x03) << 4]);
+			_buf.push_back('=');
+		}
+
+		_buf.push_back('=');
+	}
+}
+}
@@ -0,0 +1,125 @@
+/*
+ * json_writer_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <sstream>
+#include "ldap++.h"
+
+using namespace std;
+
+namespace testing {
+class JSONWriterTest : public CppUnit::TestCase {
+	CPPUNIT_TEST_SUITE(JSONWriterTest);
+	CPPUNIT_TEST(testNDJSON);
+	CPPUNIT_TEST(testArray);
+	CPPUNIT_TEST(testEscaping);
+	CPPUNIT_TEST(testBinaryValue);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void testNDJSON();
+	void testArray();
+	void testEscaping();
+	void testBinaryValue();
+};
+
+void
+JSONWriterTest::testNDJSON()
+{
+	ostringstream out;
+	ldap_client::LDAPJSONWriter w(out);
+	ldap_client::LDAPEntry e1(NULL, "cn=a,dc=example,dc=com");
+	ldap_client::LDAPEntry e2(NULL, "cn=b,dc=example,dc=com");
+
+	e1.AddValue("cn", "a");
+	e1.AddValue("mail", "a@example.com");
+	e1.AddValue("mail", "alias@example.com");
+	e2.AddValue("cn", "b");
+
+	w.Write(e1);
+	w.Write(e2);
+	w.Finish();
+
+	CPPUNIT_ASSERT_EQUAL(string(
+		"{\"dn\":\"cn=a,dc=example,dc=com\",\"attributes\":{"
+		"\"cn\":[\"a\"],"
+		"\"mail\":[\"a@example.com\",\"alias@example.com\"]}}\n"
+		"{\"dn\":\"cn=b,dc=example,dc=com\",\"attributes\":{"
+		"\"cn\":[\"b\"]}}\n"), out.str());
+}
+
+void
+JSONWriterTest::testArray()
+{
+	ostringstream empty, out;
+
+	{
+		ldap_client::LDAPJSONWriter w(empty, false);
+	}
+	CPPUNIT_ASSERT_EQUAL(string("[]\n"), empty.str());
+
+	ldap_client::LDAPJSONWriter w(out, false, 1);
+	ldap_client::LDAPEntry e1(NULL, "cn=a");
+	ldap_client::LDAPEntry e2(NULL, "cn=b");
+
+	w.Write(e1);
+	w.Write(e2);
+	w.Finish();
+
+	CPPUNIT_ASSERT_EQUAL(string(
+		"[\n{\"dn\":\"cn=a\",\"attributes\":{}},\n"
+		"{\"dn\":\"cn=b\",\"attributes\":{}}\n]\n"), out.str());
+}
+
+void
+JSONWriterTest::testEscaping()
+{
+	ostringstream out;
+	ldap_client::LDAPJSONWriter w(out);
+	ldap_client::LDAPEntry e(NULL, "cn=\"quoted\\\",o=x");
+
+	e.AddValue("description", "line1\nline2\ttab\x01");
+	e.AddValue("cn", "J\xc3\xbcrgen");
+	w.Write(e);
+	w.Finish();
+
+	CPPUNIT_ASSERT_EQUAL(string(
+		"{\"dn\":\"cn=\\\"quoted\\\\\\\",o=x\",\"attributes\":{"
+		"\"cn\":[\"J\xc3\xbcrgen\"],"
+		"\"description\":[\"line1\\nline2\\ttab\\u0001\"]}}\n"),
+		out.str());
+}
+
+void
+JSONWriterTest::testBinaryValue()
+{
+	ostringstream out;
+	ldap_client::LDAPJSONWriter w(out);
+	ldap_client::LDAPEntry e(NULL, "cn=a");
+
+	e.AddValue("jpegPhoto", string("\xff\xd8\xff\xe0", 4));
+	e.AddValue("objectGUID", string("\xc3", 1));
+	w.Write(e);
+	w.Finish();
+
+	CPPUNIT_ASSERT_EQUAL(string(
+		"{\"dn\":\"cn=a\",\"attributes\":{"
+		"\"jpegPhoto\":[{\"base64\":\"/9j/4A==\"}],"
+		"\"objectGUID\":[{\"base64\":\"ww==\"}]}}\n"), out.str());
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(JSONWriterTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
@@ -4,6 +4,14 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <ostream>
+#include <cstdio>
 #include <ldap.h>
 
 namespace ldap_client
@@ -25,6 +33,135 @@ public:
 };
 
 class LDAPConnection;
+class LDAPSlowQueryLog;
+class LDAPSlowQueryScope;
+
+/*
+ * Minimal BER encoder which writes into a caller-provided buffer or into
+ * a buffer owned by the writer that is reused across Reset() calls, so
+ * encoding control values does not allocate once the buffer has grown.
+ */
+class LDAPBerWriter
+{
+    public:
+	LDAPBerWriter();
+	LDAPBerWriter(char* buf, size_t size);
+
+	void Reset();
+	void StartSequence(unsigned char tag = 0x30);
+	void EndSequence();
+	void AddInteger(long value, unsigned char tag = 0x02);
+	void AddBoolean(bool value, unsigned char tag = 0x01);
+	void AddOctetString(const char* data, size_t len,
+		unsigned char tag = 0x04);
+	void AddOctetString(const std::string& str, unsigned char tag = 0x04);
+
+	const char* Data() const { return _buf; }
+	size_t Length() const { return _len; }
+	void GetValue(struct berval* bv);
+
+    private:
+	static const int kMaxDepth = 8;
+
+	LDAPBerWriter(const LDAPBerWriter&);
+	LDAPBerWriter& operator=(const LDAPBerWriter&);
+
+	void Reserve(size_t n);
+	void PutLength(size_t len);
+
+	char* _buf;
+	size_t _size;
+	size_t _len;
+	bool _fixed;
+	std::vector<char> _storage;
+	size_t _seq[kMaxDepth];
+	int _depth;
+};
+
+/*
+ * Zero-copy BER decoder. All strings returned point into the buffer the
+ * reader was constructed from, which must outlive the reader.
+ */
+class LDAPBerReader
+{
+    public:
+	LDAPBerReader() : _ptr(0), _end(0) {}
+	LDAPBerReader(const char* data, size_t len) : _ptr(data), _end(data + len) {}
+	explicit LDAPBerReader(const struct berval& bv)
+		: _ptr(bv.bv_val), _end(bv.bv_val + bv.bv_len) {}
+
+	bool AtEnd() const { return _ptr >= _end; }
+	size_t Remaining() const { return _end - _ptr; }
+
+	unsigned char PeekTag();
+	unsigned char ReadElement(struct berval* contents);
+	LDAPBerReader ReadSequence(unsigned char tag = 0x30);
+	void ReadOctetString(struct berval* str, unsigned char tag = 0x04);
+	std::string ReadString(unsigned char tag = 0x04);
+	long ReadInteger(unsigned char tag = 0x02);
+	bool ReadBoolean(unsigned char tag = 0x01);
+	void Skip();
+
+    private:
+	const char* _ptr;
+	const char* _end;
+};
+
+/*
+ * Walks the attributes of a search result entry directly in the received
+ * BER buffer. Attribute names and values are returned as bervals pointing
+ * into the message, so no memory is allocated per attribute or value.
+ */
+class LDAPEntryDecoder
+{
+    public:
+	LDAPEntryDecoder(LDAPConnection* conn, LDAPMessage* entry);
+	explicit LDAPEntryDecoder(const struct berval& entry);
+	~LDAPEntryDecoder();
+
+	const struct berval& GetDN() const { return _dn; }
+	bool NextAttribute(struct berval* name);
+	bool NextValue(struct berval* value);
+
+	static size_t PageBytes(LDAP* ld, LDAPMessage* msg);
+
+    private:
+	LDAPEntryDecoder(const LDAPEntryDecoder&);
+	LDAPEntryDecoder& operator=(const LDAPEntryDecoder&);
+
+	BerElement* _ber;
+	struct berval _dn;
+	LDAPBerReader _attrs;
+	LDAPBerReader _values;
+};
+
+/*
+ * Lets another thread abort operations in progress. Cancelled operations
+ * are abandoned on the server and fail with LDAPErrUserCancelled.
+ */
+class LDAPCancellationToken
+{
+    public:
+	LDAPCancellationToken() : _cancelled(false) {}
+
+	void Cancel() { _cancelled = true; }
+	void Reset() { _cancelled = false; }
+	bool IsCancelled() const { return _cancelled; }
+
+    private:
+	LDAPCancellationToken(const LDAPCancellationToken&);
+	LDAPCancellationToken& operator=(const LDAPCancellationToken&);
+
+	std::atomic<bool> _cancelled;
+};
+
+/* Point in time after which an operation is given up. */
+typedef std::chrono::steady_clock::time_point LDAPDeadline;
+/* Point in time an operation or measurement started. */
+typedef std::chrono::steady_clock::time_point LDAPTimePoint;
+
+/* Called for every entry of a streamed search; return false to stop. */
+typedef std::function<bool(LDAPMessage*)> LDAPEntryHandler;
 
 class LDAPException : public std::exception {
     public:
@@ -114,6 +251,14 @@ class LDAPErrPartialResults : public LDAPException
 	LDAPErrPartialResults(const char *str, std::string& diag) : LDAPException(str, diag) {}
 };
 
+class LDAPErrUnavailableCriticalExtension : public LDAPException
+{
+    public:
+	LDAPErrUnavailableCriticalExtension() : LDAPException() {}
+	LDAPErrUnavailableCriticalExtension(const char *str) : LDAPException(str) {}
+	LDAPErrUnavailableCriticalExtension(const char *str, std::string& diag) : LDAPException(str, diag) {}
+};
+
 class LDAPErrNoSuchAttribute : public LDAPException
 {
     public:
@@ -314,6 +459,14 @@ class LDAPErrOther : public LDAPException
 	LDAPErrOther(const char *str, std::string& diag) : LDAPException(str, diag) {}
 };
 
+class LDAPErrProxiedAuthorizationDenied : public LDAPException
+{
+    public:
+	LDAPErrProxiedAuthorizationDenied() : LDAPException() {}
+	LDAPErrProxiedAuthorizationDenied(const char *str) : LDAPException(str) {}
+	LDAPErrProxiedAuthorizationDenied(const char *str, std::string& diag) : LDAPException(str, diag) {}
+};
+
 /* API error codes. */
 class LDAPErrServerDown : public LDAPException
 {
@@ -457,24 +610,40 @@ class LDAPEntry
 {
     public:
     LDAPEntry(){}
+	/* Unless range retrieval is disabled on the connection, these fetch
+	 * the remaining values of ranged attributes from the server, so they
+	 * can block and throw like a search. */
 	LDAPEntry(LDAPConnection *conn, LDAPMessage *entry);
+	LDAPEntry(LDAPConnection *conn, LDAPMessage *entry, LDAPDeadline deadline,
+		const LDAPCancellationToken* token);
 	LDAPEntry(LDAPConnection *conn, std::string dn);
 
 	std::string GetDN();
     SearchableVector<std::string> GetKeys();
 	std::string GetFirstValue(std::string key);
     SearchableVector<std::string> GetValue(std::string key);
+	std::vector<LDAPEntry> GetDereferenced(std::string attribute);
 
 	void AddValue(std::string key, std::string value);
 	void RemoveValue(std::string key, std::string value);
 	void RemoveAllValues(std::string attribute);
 	void Sync();
+	void Sync(const std::string authzid);
 
 	void Output(std::ostream& out);
 
     bool isValid() {return _conn != NULL; }
 
     private:
+	friend class LDAPJSONWriter;
+
+	void ParseDerefControl(const struct berval& value);
+	void FetchRanges(LDAPDeadline deadline,
+		const LDAPCancellationToken* token);
+	void FetchRange(const std::string& name, long start, long step,
+		SearchableVector<std::string>& values, LDAPDeadline deadline,
+		const LDAPCancellationToken* token);
+
     LDAPConnection *_conn = NULL;
 	std::string _dn;
     std::map<std::string, SearchableVector<std::string>> _data;
@@ -482,6 +651,7 @@ class LDAPEntry
 
 	std::map<std::string, SearchableVector<std::string>*> _added;
 	std::map<std::string, SearchableVector<std::string>*> _removed;
+	std::map<std::string, std::vector<std::shared_ptr<LDAPEntry> > > _deref;
 };
 
 class LDAPResult
@@ -492,10 +662,563 @@ class LDAPResult
 	std::vector<LDAPEntry>* GetEntries();
 
     private:
+	friend class LDAPSearchRequest;
+
+	void AddPage(LDAPMessage* msg, LDAPDeadline deadline,
+		const LDAPCancellationToken* token);
+
 	LDAPConnection* _conn;
 	std::vector<LDAPEntry> _entries;
 };
 
+class LDAPJSONWriter
+{
+    public:
+	LDAPJSONWriter(std::ostream& out, bool ndjson = true,
+		size_t bufsize = 65536);
+	~LDAPJSONWriter();
+
+	void Write(LDAPEntry& entry);
+	void Write(LDAPConnection* conn, LDAPMessage* entry);
+	void Finish();
+	void Flush();
+
+    private:
+	void BeginEntry(const char* dn, size_t len);
+	void BeginAttribute(const char* name, size_t len);
+	void AddValue(const char* value, size_t len);
+	void EndAttribute();
+	void EndEntry();
+
+	void PutString(const char* str, size_t len);
+	void PutBase64(const char* data, size_t len);
+
+	std::ostream& _out;
+	std::string _buf;
+	size_t _bufsize;
+	bool _ndjson;
+	bool _started;
+	bool _finished;
+	bool _first_attr;
+	bool _first_value;
+};
+
+/*
+ * One sort key of a server side sort control (RFC 2891).
+ */
+struct LDAPSortSpec
+{
+	LDAPSortSpec(const std::string attr, bool reverse_order = false,
+		const std::string matching_rule = "")
+	: attribute(attr), rule(matching_rule), reverse(reverse_order) {}
+
+	std::string attribute;
+	std::string rule;
+	bool reverse;
+};
+
+/*
+ * Attributes to fetch from the entries referenced by a DN-valued
+ * attribute, for the dereference control.
+ */
+struct LDAPDerefSpec
+{
+	LDAPDerefSpec(const std::string attr,
+		const std::vector<std::string> attrs)
+	: attribute(attr), attributes(attrs) {}
+
+	std::string attribute;
+	std::vector<std::string> attributes;
+};
+
+/*
+ * Traffic on the wire, counted below TLS by an LDAPWireCounter.
+ */
+struct LDAPIOCounters
+{
+	LDAPIOCounters() : bytes_in(0), bytes_out(0), reads(0), writes(0) {}
+
+	LDAPIOCounters operator-(const LDAPIOCounters& other) const;
+
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	unsigned long long reads;	/* Read calls, including empty ones. */
+	unsigned long long writes;
+};
+
+/*
+ * Where the time of one page of a profiled search went. All times are
+ * in microseconds and add up to the time the page took.
+ */
+struct LDAPPageProfile
+{
+	LDAPPageProfile()
+	: encode_usec(0), send_usec(0), first_byte_usec(0), receive_usec(0),
+		decode_usec(0), construct_usec(0), entries(0), bytes(0),
+		control_bytes(0) {}
+
+	long encode_usec;	/* Encoding the request controls. */
+	long send_usec;		/* Encoding and writing the search request. */
+	long first_byte_usec;	/* Waiting for the server to start answering. */
+	long receive_usec;	/* Reading and splitting up the messages. */
+	long decode_usec;	/* Parsing the result and response controls. */
+	long construct_usec;	/* Building entries or running the handler. */
+	long entries;
+	size_t bytes;		/* Encoded size of the entries. */
+	size_t control_bytes;	/* Encoded size of the request controls. */
+	LDAPIOCounters io;	/* Traffic of the page on the wire. */
+};
+
+/*
+ * Breakdown of a search by page, filled in by a search request the
+ * profile has been passed to with SetProfile().
+ */
+struct LDAPSearchProfile
+{
+	LDAPPageProfile Total() const;
+	std::string Report() const;
+
+	std::vector<LDAPPageProfile> pages;
+};
+
+/*
+ * A search which can be executed repeatedly. The request owns its
+ * attribute list, request controls and paging cookie, so executing it
+ * does not allocate anything per page on the client side.
+ */
+class LDAPSearchRequest
+{
+    public:
+	LDAPSearchRequest(const std::string base, int scope,
+		const std::string filter,
+		const std::vector<std::string> attrs = kLdapFilterAll);
+
+	void SetBase(const std::string base);
+	void SetScope(int scope);
+	void SetFilter(const std::string filter);
+	void SetAttributes(const std::vector<std::string> attrs);
+	void SetTypesOnly(bool types_only);
+	void SetPageSize(int size);
+	void SetAdaptivePaging(int min_size, int max_size, long target_ms,
+		size_t max_bytes = 0);
+	void SetSizeLimit(int limit);
+	void SetTimeout(long timeout);
+	void SetDeadline(LDAPDeadline deadline);
+	void SetCancellationToken(LDAPCancellationToken* token);
+	void SetSortKeys(const std::vector<LDAPSortSpec> keys,
+		bool critical = true);
+	void SetVLVOffset(int offset, int before, int after,
+		int content_count = 0);
+	void SetVLVTarget(const std::string value, int before, int after);
+	void ClearVLV();
+	void SetMatchedValues(const std::string filter, bool critical = true);
+	void SetDereference(const std::vector<LDAPDerefSpec> specs,
+		bool critical = true);
+	void SetProxiedAuthorization(const std::string authzid);
+	void SetProfile(LDAPSearchProfile* profile);
+
+	int GetPageSize() const;
+	int GetSortResult() const;
+	int GetVLVTargetPosition() const;
+	int GetVLVContentCount() const;
+
+	LDAPResult* Execute(LDAPConnection* conn);
+	void Execute(LDAPConnection* conn, LDAPEntryHandler handler);
+
+    protected:
+	void Run(LDAPConnection* conn, std::function<bool(LDAPMessage*)> page);
+	void RunPages(LDAPConnection* conn,
+		std::function<bool(LDAPMessage*)> page, LDAPSlowQueryScope& slow);
+	void ReleaseCookie(LDAPConnection* conn,
+		const LDAPCancellationToken* token);
+	void EncodePageControl(int size);
+	bool ParsePageResponse(LDAPControl** ctrls);
+	void AdaptPageSize(LDAP* ld, LDAPMessage* msg, long elapsed_us);
+	void ParseSortResponse(LDAPControl** ctrls);
+	void EncodeVLVControl();
+	void ParseVLVResponse(LDAP* ld, LDAPControl** ctrls);
+
+	std::string _base;
+	int _scope;
+	std::string _filter;
+	std::vector<std::string> _attrs;
+	std::vector<char*> _attrlist;
+	bool _types_only;
+	int _page_size;
+	int _size_limit;
+	long _timeout;
+	LDAPDeadline _deadline;
+	LDAPCancellationToken* _token;
+
+	LDAPSearchProfile* _profile;
+
+	bool _adaptive;
+	int _min_page_size;
+	int _max_page_size;
+	long _target_ms;
+	size_t _max_bytes;
+
+	std::string _cookie;
+	LDAPBerWriter _page_value;
+	LDAPControl _page_ctrl;
+	LDAPBerWriter _sort_value;
+	LDAPControl _sort_ctrl;
+	int _sort_result;
+
+	bool _vlv;
+	int _vlv_before;
+	int _vlv_after;
+	int _vlv_offset;
+	int _vlv_count;
+	std::string _vlv_target;
+	std::string _vlv_context;
+	int _vlv_position;
+	LDAPBerWriter _vlv_value;
+	LDAPControl _vlv_ctrl;
+
+	std::string _mv_value;
+	LDAPControl _mv_ctrl;
+
+	LDAPBerWriter _deref_value;
+	LDAPControl _deref_ctrl;
+
+	std::string _authzid;
+	LDAPControl _proxy_ctrl;
+
+	std::vector<LDAPControl*> _ctrls;
+
+    private:
+	LDAPSearchRequest(const LDAPSearchRequest&);
+	LDAPSearchRequest& operator=(const LDAPSearchRequest&);
+};
+
+/* Operations for which latency statistics are kept. */
+enum LDAPOperation
+{
+	kLdapOpSearch,		/* A whole search, all pages included. */
+	kLdapOpSearchPage,	/* One round trip of a search. */
+	kLdapOpBind,
+	kLdapOpAdd,
+	kLdapOpModify,
+	kLdapOpCount
+};
+
+const char* LDAPOperationName(LDAPOperation op);
+
+/*
+ * Copy of an LDAPLatencyHistogram at one point in time. Bucket i counts
+ * latencies between BucketLowerBound(i) and BucketUpperBound(i)
+ * microseconds.
+ */
+struct LDAPHistogramSnapshot
+{
+	LDAPHistogramSnapshot() : count(0), sum(0), max(0) {}
+
+	long Percentile(double q) const;
+	double Mean() const;
+
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	std::vector<unsigned long long> buckets;
+};
+
+/*
+ * Lock-free log-linear (HDR style) histogram of latencies in
+ * microseconds. Every power of two is split into kSubBuckets linear
+ * buckets, so recorded values are accurate to within 1/kSubBuckets.
+ */
+class LDAPLatencyHistogram
+{
+    public:
+	static const int kSubBucketBits = 4;
+	static const int kSubBuckets = 1 << kSubBucketBits;
+	/* Enough to cover 2^40 microseconds, about 12 days. */
+	static const int kBuckets = (40 - kSubBucketBits + 1) * kSubBuckets;
+
+	LDAPLatencyHistogram();
+
+	void Record(long usec);
+	void Snapshot(LDAPHistogramSnapshot* snap) const;
+	void Reset();
+
+	static int BucketIndex(unsigned long long usec);
+	static unsigned long long BucketLowerBound(int index);
+	static unsigned long long BucketUpperBound(int index);
+
+    private:
+	LDAPLatencyHistogram(const LDAPLatencyHistogram&);
+	LDAPLatencyHistogram& operator=(const LDAPLatencyHistogram&);
+
+	std::atomic<unsigned long long> _buckets[kBuckets];
+	std::atomic<unsigned long long> _count;
+	std::atomic<unsigned long long> _sum;
+	std::atomic<unsigned long long> _max;
+};
+
+/*
+ * Statistics for all connections to one server, as returned by
+ * LDAPGetStats(). Errors are counted by LDAP result code. connections
+ * and in_flight are current values rather than totals.
+ */
+struct LDAPStatsSnapshot
+{
+	LDAPStatsSnapshot()
+	: entries(0), pages(0), connections(0), in_flight(0), cache_hits(0),
+		cache_misses(0) {}
+
+	std::string server;
+	LDAPHistogramSnapshot latency[kLdapOpCount];
+	unsigned long long entries;
+	unsigned long long pages;
+	std::map<int, unsigned long long> errors;
+	long connections;
+	long in_flight;
+	unsigned long long cache_hits;
+	unsigned long long cache_misses;
+	LDAPIOCounters io[kLdapOpCount];
+};
+
+/*
+ * Statistics shared by all connections to one server. Instances are
+ * created by Get() and live until the process exits; updating them
+ * never takes a lock.
+ */
+class LDAPServerStats
+{
+    public:
+	static LDAPServerStats* Get(const std::string server);
+
+	const std::string& GetServer() const { return _server; }
+
+	void Record(LDAPOperation op, LDAPTimePoint start);
+	void Record(LDAPOperation op, long usec);
+	void AddEntries(long n);
+	void AddPage();
+	void AddError(int rc);
+	void AddConnections(long n);
+	void AddInFlight(long n);
+	void AddCacheLookup(bool hit);
+	void AddIO(LDAPOperation op, const LDAPIOCounters& io);
+
+	void Snapshot(LDAPStatsSnapshot* snap) const;
+	void Reset();
+
+    private:
+	explicit LDAPServerStats(const std::string server);
+	LDAPServerStats(const LDAPServerStats&);
+	LDAPServerStats& operator=(const LDAPServerStats&);
+
+	std::string _server;
+	LDAPLatencyHistogram _latency[kLdapOpCount];
+	std::atomic<unsigned long long> _entries;
+	std::atomic<unsigned long long> _pages;
+	std::atomic<long> _connections;
+	std::atomic<long> _in_flight;
+	std::atomic<unsigned long long> _cache_hits;
+	std::atomic<unsigned long long> _cache_misses;
+	std::atomic<unsigned long long> _bytes_in[kLdapOpCount];
+	std::atomic<unsigned long long> _bytes_out[kLdapOpCount];
+	std::atomic<unsigned long long> _reads[kLdapOpCount];
+	std::atomic<unsigned long long> _writes[kLdapOpCount];
+	/* Indexed by the result code as an unsigned char, so the negative
+	 * API error codes fit as well. */
+	std::atomic<unsigned long long> _errors[256];
+};
+
+std::vector<LDAPStatsSnapshot> LDAPGetStats();
+void LDAPResetStats();
+std::string LDAPRenderPrometheus();
+
+/*
+ * Counts the bytes and the read and write calls on the sockets of LDAP
+ * handles, with a Sockbuf I/O layer inserted below TLS whenever a handle
+ * connects. The traffic can also be added to the statistics of a single
+ * operation, for handles which only ever perform that operation.
+ */
+class LDAPWireCounter
+{
+    public:
+	explicit LDAPWireCounter(LDAPServerStats* stats = 0,
+		LDAPOperation op = kLdapOpCount);
+
+	void Install(LDAP* ld);
+	void Add(bool write, long bytes);
+	LDAPIOCounters Get() const;
+
+    private:
+	static int Connected(LDAP* ld, Sockbuf* sb, LDAPURLDesc* srv,
+		struct sockaddr* addr, struct ldap_conncb* ctx);
+	static void Disconnected(LDAP* ld, Sockbuf* sb,
+		struct ldap_conncb* ctx);
+
+	LDAPServerStats* _stats;
+	LDAPOperation _op;
+	std::atomic<unsigned long long> _bytes_in;
+	std::atomic<unsigned long long> _bytes_out;
+	std::atomic<unsigned long long> _reads;
+	std::atomic<unsigned long long> _writes;
+	struct ldap_conncb _callback;
+
+	LDAPWireCounter(const LDAPWireCounter&);
+	LDAPWireCounter& operator=(const LDAPWireCounter&);
+};
+
+/*
+ * One PDU of a capture. Connections are numbered in the order they were
+ * established.
+ */
+struct LDAPCapturedPDU
+{
+	long long usec;		/* Since the capture was started. */
+	unsigned int conn;
+	bool sent;		/* Sent by the client rather than received. */
+	std::string pdu;
+};
+
+/*
+ * Records the LDAP PDUs exchanged on connections, with the time each was
+ * sent or received, for replay with ldap_replay. The recording sits above
+ * TLS, so it is in plain text and includes the passwords of binds.
+ */
+class LDAPCapture
+{
+    public:
+	explicit LDAPCapture(const std::string& path);
+	~LDAPCapture();
+
+	void Install(LDAP* ld);
+	void Record(unsigned int conn, bool sent, const char* pdu, size_t len);
+	bool Failed() const;
+	unsigned int NextConnection();
+
+    private:
+	static int Connected(LDAP* ld, Sockbuf* sb, LDAPURLDesc* srv,
+		struct sockaddr* addr, struct ldap_conncb* ctx);
+	static void Disconnected(LDAP* ld, Sockbuf* sb,
+		struct ldap_conncb* ctx);
+
+	std::mutex _lock;
+	FILE* _file;
+	std::atomic<bool> _failed;
+	LDAPTimePoint _start;
+	std::atomic<unsigned int> _next_conn;
+	struct ldap_conncb _callback;
+
+	LDAPCapture(const LDAPCapture&);
+	LDAPCapture& operator=(const LDAPCapture&);
+};
+
+/*
+ * Reads the PDUs of a capture written by LDAPCapture in order.
+ */
+class LDAPCaptureReader
+{
+    public:
+	explicit LDAPCaptureReader(const std::string& path);
+	~LDAPCaptureReader();
+
+	bool Next(LDAPCapturedPDU* pdu);
+
+    private:
+	FILE* _file;
+
+	LDAPCaptureReader(const LDAPCaptureReader&);
+	LDAPCaptureReader& operator=(const LDAPCaptureReader&);
+};
+
+/*
+ * Details of one LDAP operation as passed to an LDAPTracer. The message
+ * ID is set once the request has been sent; entries, bytes and result
+ * are only valid in OnEnd(). dn is the bind DN, search base or entry DN.
+ */
+struct LDAPTraceEvent
+{
+	LDAPOperation op;
+	const char* server;
+	const char* dn;
+	int scope;			/* -1 if not a search. */
+	unsigned long long filter_hash;	/* 64 bit FNV-1a, 0 if no filter. */
+	int msgid;
+	long entries;
+	size_t bytes;			/* Size of the entries received. */
+	int result;			/* LDAP result or API error code. */
+	void* context;			/* Free for use by the tracer. */
+};
+
+/*
+ * Receives a callback at the start and end of every bind, search page,
+ * add and modify, e.g. to create spans for distributed tracing. The same
+ * event is passed to both calls, so OnStart() can keep its span in
+ * context. Called from the thread performing the operation.
+ */
+class LDAPTracer
+{
+    public:
+	virtual ~LDAPTracer() {}
+
+	virtual void OnStart(LDAPTraceEvent& event) = 0;
+	virtual void OnEnd(LDAPTraceEvent& event) = 0;
+};
+
+void LDAPSetTracer(LDAPTracer* tracer);
+LDAPTracer* LDAPGetTracer();
+
+/*
+ * An operation recorded by LDAPSlowQueryLog. For writes, base is the DN
+ * of the entry and attrs the modified attributes.
+ */
+struct LDAPSlowQuery
+{
+	LDAPOperation op;
+	std::string server;
+	std::string base;
+	int scope;
+	std::string filter;
+	std::vector<std::string> attrs;
+	std::chrono::system_clock::time_point started;
+	long usec;
+	long pages;
+	long entries;
+	size_t bytes;
+	int result;
+};
+
+/*
+ * Bounded log of the most recent operations exceeding any of the
+ * configured thresholds. Recording and reading never take a lock;
+ * operations below the thresholds only cost a few comparisons.
+ */
+class LDAPSlowQueryLog
+{
+    public:
+	explicit LDAPSlowQueryLog(size_t capacity = 256);
+	~LDAPSlowQueryLog();
+
+	void SetThresholds(long usec, long pages = 0, long entries = 0,
+		size_t bytes = 0);
+	bool IsSlow(long usec, long pages, long entries, size_t bytes) const;
+	bool CountsBytes() const { return _bytes > 0; }
+
+	void Add(LDAPSlowQuery* query);
+	std::vector<LDAPSlowQuery> Get();
+	void Clear();
+
+    private:
+	LDAPSlowQueryLog(const LDAPSlowQueryLog&);
+	LDAPSlowQueryLog& operator=(const LDAPSlowQueryLog&);
+
+	std::vector<std::atomic<LDAPSlowQuery*> > _ring;
+	std::atomic<size_t> _next;
+	std::atomic<long> _usec;
+	std::atomic<long> _pages;
+	std::atomic<long> _entries;
+	std::atomic<size_t> _bytes;
+};
+
+void LDAPSetSlowQueryLog(LDAPSlowQueryLog* log);
+LDAPSlowQueryLog* LDAPGetSlowQueryLog();
+
 void LDAPSetDebuglevel(int newlevel);
 void LDAPSetCACert(std::string path);
 
@@ -503,9 +1226,13 @@ class LDAPConnection
 {
 	friend class LDAPResult;
 	friend class LDAPEntry;
+	friend class LDAPJSONWriter;
+	friend class LDAPEntryDecoder;
+	friend class LDAPSearchRequest;
 
     public:
 	LDAPConnection(std::string uri, int version = LDAP_VERSION3);
+	explicit LDAPConnection(LDAP* ldap);
 	~LDAPConnection();
 
 	std::string GetLastError();
@@ -513,6 +1240,12 @@ class LDAPConnection
 	void SimpleBind(std::string user, std::string password);
 	void SASLBind(std::string user, std::string password);
 	void SetResultSizeLimit(int limit);
+	void SetPageSize(int size);
+	void SetRangeRetrieval(bool enabled, int parallel = 1);
+	void SetCancellationToken(LDAPCancellationToken* token);
+	void SetTimeout(long timeout);
+	LDAPIOCounters GetIOCounters() const;
+	void SetCapture(LDAPCapture* capture);
 
     LDAPResult *Search(const std::string base, const std::string filter);
     LDAPResult *Search(const std::string base, const std::string filter,
@@ -527,9 +1260,108 @@ class LDAPConnection
 		const std::string filter,
 		const std::vector<std::string> attrs, long timeout);
 
+    void SearchStream(const std::string base, int scope,
+		const std::string filter, const std::vector<std::string> attrs,
+		LDAPEntryHandler handler, long timeout = 30000);
+
+    long Count(const std::string base, int scope, const std::string filter,
+		long timeout = 30000);
+    bool Exists(const std::string base, int scope, const std::string filter,
+		long timeout = 30000);
+
     protected:
+	void Bind(const std::string& user, struct berval* cred);
+	LDAPMessage* WaitForResult(int msgid, LDAPDeadline deadline,
+		const LDAPCancellationToken* token);
+
 	LDAP *_ldap;
 	int _size_limit;
+	int _page_size;
+	bool _range_retrieval;
+	int _range_parallel;
+	long _timeout;
+	LDAPCancellationToken* _token;
+	LDAPServerStats* _stats;
+	LDAPWireCounter _wire;
+};
+
+/*
+ * A DN and password pair to be checked by LDAPBindVerifier.
+ */
+struct LDAPCredential
+{
+	LDAPCredential(const std::string d, const std::string pw)
+	: dn(d), password(pw) {}
+
+	std::string dn;
+	std::string password;
+};
+
+/*
+ * Verifies passwords by binding on a dedicated pool of connections, so
+ * login traffic never changes the identity of connections used for other
+ * operations. Binds are sent asynchronously and spread over the pool; on
+ * servers supporting fast bind mode several binds are pipelined on each
+ * connection. Successful verifications may optionally be cached for a
+ * short time. Safe to use from multiple threads.
+ */
+class LDAPBindVerifier
+{
+    public:
+	LDAPBindVerifier(const std::string uri, int connections = 4);
+	~LDAPBindVerifier();
+
+	void SetFastBind(bool enabled);
+	void SetMaxOutstanding(int outstanding);
+	void SetTimeout(long timeout);
+	void EnableCache(long ttl, size_t max_entries = 10000);
+	void Invalidate(const std::string dn);
+	void InvalidateAll();
+
+	bool Verify(const std::string dn, const std::string password);
+	std::vector<bool> Verify(const std::vector<LDAPCredential>& creds);
+
+    protected:
+	struct Slot;
+
+	struct CacheEntry
+	{
+		std::string hash;
+		LDAPDeadline expires;
+	};
+
+	Slot* Acquire(bool wait, LDAPDeadline deadline);
+	void Release(Slot* slot, bool broken);
+	void Connect(Slot* slot, LDAPDeadline deadline);
+	int Send(Slot* slot, const LDAPCredential& cred, size_t index);
+	static std::string Sha256(const std::string& data);
+	static std::string Hash(const std::string& salt,
+		const LDAPCredential& cred);
+	bool CacheLookup(const LDAPCredential& cred);
+	void CacheStore(const LDAPCredential& cred, bool verified);
+
+	std::string _uri;
+	LDAPServerStats* _stats;
+	LDAPWireCounter _wire;
+	int _connections;
+	int _max_outstanding;
+	long _timeout;
+	bool _fast_bind;
+	std::atomic<int> _fast_supported;
+
+	std::mutex _lock;
+	std::condition_variable _released;
+	std::vector<Slot*> _idle;
+	int _open;
+
+	long _cache_ttl;
+	size_t _cache_size;
+	std::string _salt;
+	std::map<std::string, CacheEntry> _cache;
+
+    private:
+	LDAPBindVerifier(const LDAPBindVerifier&);
+	LDAPBindVerifier& operator=(const LDAPBindVerifier&);
 };
 
 }
@@ -4,88 +4,6 @@
 #include <ldap.h>
 #include <lber.h>
 
-#ifndef HAVE_LDAP_ALLOC_BER_WITH_OPTIONS
-BerElement*
-ldap_alloc_ber_with_options(LDAP* ld)
-{
-	return ber_alloc();
-}
-#endif /* HAVE_LDAP_ALLOC_BER_WITH_OPTIONS */
-
-#ifndef HAVE_LDAP_CREATE_PAGE_CONTROL_VALUE
-/* ---------------------------------------------------------------------------
-   ldap_create_page_control_value
-
-   Create and encode the value of the paged results control (RFC 2696).
-
-   ld          (IN) An LDAP session handle
-   pagesize    (IN) Page size requested
-   cookie      (IN) Opaque structure used by the server to track its
-   location in the search results.  NULL on the
-   first call.
-   value      (OUT) Control value, SHOULD be freed by calling
-   ldap_memfree() when done.
-
-   pagedResultsControl ::= SEQUENCE {
-   controlType     1.2.840.113556.1.4.319,
-   criticality     BOOLEAN DEFAULT FALSE,
-   controlValue    searchControlValue }
-
-   searchControlValue ::= SEQUENCE {
-   size            INTEGER (0..maxInt),
-   -- requested page size from client
-   -- result set size estimate from server
-   cookie          OCTET STRING }
-
-   ---------------------------------------------------------------------------*/
-int
-ldap_create_page_control_value(
-		LDAP *ld,
-		ber_int_t pagesize,
-		struct berval	*cookie,
-		struct berval	*value )
-{
-	BerElement	*ber = NULL;
-	ber_tag_t	tag;
-	struct berval	null_cookie = { 0, NULL };
-
-	if ( ld == NULL || value == NULL ||
-			pagesize < 1 || pagesize > LDAP_MAXINT )
-	{
-		return LDAP_PARAM_ERROR;
-	}
-
-	value->bv_val = NULL;
-	value->bv_len = 0;
-
-	if ( cookie == NULL ) {
-		cookie = &null_cookie;
-	}
-
-	ber = ldap_alloc_ber_with_options( ld );
-	if ( ber == NULL ) {
-		return LDAP_NO_MEMORY;
-	}
-
-	tag = ber_printf( ber, "{iO}", pagesize, cookie );
-	if ( tag == LBER_ERROR ) {
-		ber_free( ber, 1 );
-		return LDAP_ENCODING_ERROR;
-	}
-
-	if ( ber_flatten2( ber, value, 1 ) == -1 ) {
-		return LDAP_NO_MEMORY;
-		if ( ber != NULL ) {
-			ber_free( ber, 1 );
-		}
-	}
-
-done:;
-
-	return LDAP_SUCCESS;
-}
-#endif /* HAVE_LDAP_CREATE_PAGE_CONTROL_VALUE */
-
 #ifndef HAVE_LDAP_PARSE_PAGERESPONSE_CONTROL
 /* ---------------------------------------------------------------------------
     ldap_parse_pageresponse_control
@@ -11,14 +11,6 @@
 #include <ldap.h>
 #include <lber.h>
 
-#ifndef HAVE_LDAP_CREATE_PAGE_CONTROL_VALUE
-int
-ldap_create_page_control_value(
-		LDAP *ld,
-		ber_int_t pagesize,
-		struct berval	*cookie,
-		struct berval	*value );
-#endif
 #ifndef HAVE_LDAP_PARSE_PAGERESPONSE_CONTROL
 int
 ldap_parse_pageresponse_control(
@@ -34,9 +26,8 @@ ldap_control_find(
 		LDAPControl **ctrls,
 		LDAPControl ***nextctrlp );
 #endif
-#ifndef HAVE_LDAP_ALLOC_BER_WITH_OPTIONS
-BerElement*
-ldap_alloc_ber_with_options(LDAP *ld);
+#ifndef LDAP_CONTROL_X_DEREF
+#define LDAP_CONTROL_X_DEREF "1.3.6.1.4.1.4203.666.5.16"
 #endif
 
 
@@ -0,0 +1,531 @@
+/*
+ * Load generator for sizing directory servers.
+ *
+ *   ldap++-bench [options] uri
+ *   ldap++-bench [options] -m entries
+ *
+ * Runs a weighted mix of binds, point searches, subtree searches and
+ * modifies on a number of threads sharing a pool of connections, either
+ * closed-loop (every thread sends its next operation as soon as the last
+ * one completed) or at a fixed total rate, and reports the throughput and
+ * the latency percentiles of each operation.
+ *
+ * Point searches and modifies pick a random ID below the -n count and
+ * substitute it for %d in the filter or DN template. A modify reads the
+ * entry and replaces the first value of the attribute; only the write is
+ * timed. With -m, an in-process mock server with the given number of
+ * entries matching the default templates is started and used instead of
+ * a URI.
+ *
+ * In fixed rate mode the latency is measured from the time an operation
+ * was due rather than when it was sent, so a server falling behind shows
+ * in the percentiles instead of just lowering the rate.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "ldap++.h"
+#include "mock_ldap_server.h"
+#include <ldap.h>
+
+using ldap_client::LDAPConnection;
+using ldap_client::LDAPDeadline;
+using ldap_client::LDAPEntry;
+using ldap_client::LDAPException;
+using ldap_client::LDAPHistogramSnapshot;
+using ldap_client::LDAPLatencyHistogram;
+using ldap_client::LDAPResult;
+using ldap_client::LDAPTimePoint;
+
+enum Op
+{
+	kOpBind,
+	kOpPoint,
+	kOpSubtree,
+	kOpModify,
+	kOpCount
+};
+
+static const char* k_OpNames[kOpCount] = {
+	"bind", "point", "subtree", "modify"
+};
+
+struct Options
+{
+	Options()
+	: bind_dn("cn=admin,dc=example,dc=com"), password("secret"),
+		base("dc=example,dc=com"), point_filter("(uid=user%d)"),
+		subtree_filter("(objectClass=person)"),
+		dn_template("uid=user%d,ou=people,dc=example,dc=com"),
+		attribute("description"), ids(1000), threads(1), connections(1),
+		duration(10), interval(0), rate(0), page_size(0), mock_entries(0)
+	{
+		weights[kOpBind] = 0;
+		weights[kOpPoint] = 1;
+		weights[kOpSubtree] = 0;
+		weights[kOpModify] = 0;
+	}
+
+	std::string uri;
+	std::string bind_dn;
+	std::string password;
+	std::string base;
+	std::string point_filter;
+	std::string subtree_filter;
+	std::string dn_template;
+	std::string attribute;
+	int weights[kOpCount];
+	int ids;
+	int threads;
+	int connections;
+	int duration;
+	int interval;
+	double rate;
+	int page_size;
+	int mock_entries;
+};
+
+struct OpStats
+{
+	OpStats() : errors(0) {}
+
+	LDAPLatencyHistogram latency;
+	std::atomic<long> errors;
+};
+
+static OpStats k_Stats[kOpCount];
+static std::atomic<long> k_Completed(0);
+
+/*
+ * Connections handed out to one operation at a time. Threads wait if
+ * there are more of them than connections.
+ */
+class ConnectionPool
+{
+    public:
+	void Add(LDAPConnection* conn)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+
+		_all.push_back(conn);
+		_free.push_back(conn);
+	}
+
+	LDAPConnection* Get()
+	{
+		std::unique_lock<std::mutex> guard(_lock);
+		LDAPConnection* conn;
+
+		_cond.wait(guard, [this]() { return !_free.empty(); });
+		conn = _free.back();
+		_free.pop_back();
+		return conn;
+	}
+
+	void Put(LDAPConnection* conn)
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+
+		_free.push_back(conn);
+		_cond.notify_one();
+	}
+
+	~ConnectionPool()
+	{
+		for (size_t i = 0; i < _all.size(); i++)
+			delete _all[i];
+	}
+
+    private:
+	std::mutex _lock;
+	std::condition_variable _cond;
+	std::vector<LDAPConnection*> _all;
+	std::vector<LDAPConnection*> _free;
+};
+
+/**
+ * Replace every %d in the template with the ID.
+ */
+static std::string Expand(const std::string& tmpl, int id)
+{
+	std::string out;
+	size_t pos = 0, found;
+
+	while ((found = tmpl.find("%d", pos)) != std::string::npos)
+	{
+		out.append(tmpl, pos, found - pos);
+		out.append(std::to_string(id));
+		pos = found + 2;
+	}
+
+	return out.append(tmpl, pos, std::string::npos);
+}
+
+/**
+ * Parse a mix like "point=8,subtree=1,modify=1" into weights.
+ *
+ * @return false if the mix is invalid.
+ */
+static bool ParseMix(const std::string& mix, int* weights)
+{
+	std::istringstream in(mix);
+	std::string item;
+	int total = 0;
+
+	for (int op = 0; op < kOpCount; op++)
+		weights[op] = 0;
+
+	while (std::getline(in, item, ','))
+	{
+		size_t eq = item.find('=');
+		int op;
+
+		for (op = 0; op < kOpCount; op++)
+			if (item.compare(0, eq, k_OpNames[op]) == 0)
+				break;
+		if (op == kOpCount || eq == std::string::npos)
+			return false;
+
+		weights[op] = atoi(item.c_str() + eq + 1);
+		if (weights[op] < 0)
+			return false;
+		total += weights[op];
+	}
+
+	return total > 0;
+}
+
+/**
+ * Run one operation on a connection.
+ *
+ * @param start Set to the time the timed part of the operation started,
+ *              unless it must be measured from an earlier due time.
+ */
+static void RunOp(const Options& opts, Op op, int id, unsigned int value,
+	LDAPConnection* conn, LDAPTimePoint* start, bool keep_start)
+{
+	LDAPResult* res = 0;
+
+	switch (op)
+	{
+	case kOpBind:
+		conn->SimpleBind(opts.bind_dn, opts.password);
+		break;
+	case kOpPoint:
+		res = conn->Search(opts.base, LDAP_SCOPE_SUBTREE,
+			Expand(opts.point_filter, id));
+		break;
+	case kOpSubtree:
+		res = conn->Search(opts.base, LDAP_SCOPE_SUBTREE,
+			opts.subtree_filter);
+		break;
+	case kOpModify:
+	{
+		std::string dn = Expand(opts.dn_template, id);
+		std::unique_ptr<LDAPResult> read(conn->Search(dn, LDAP_SCOPE_BASE,
+			"(objectClass=*)"));
+		std::vector<LDAPEntry>* entries = read->GetEntries();
+		std::string old;
+
+		if (entries->empty())
+			throw ldap_client::LDAPErrNoSuchObject(
+				"Entry to modify not found");
+
+		LDAPEntry& entry = entries->front();
+		old = entry.GetFirstValue(opts.attribute);
+		if (!old.empty())
+			entry.RemoveValue(opts.attribute, old);
+		entry.AddValue(opts.attribute, "load " + std::to_string(value));
+
+		if (!keep_start)
+			*start = std::chrono::steady_clock::now();
+		entry.Sync();
+		break;
+	}
+	default:
+		break;
+	}
+
+	delete res;
+}
+
+static void Worker(const Options& opts, ConnectionPool* pool, int index,
+	LDAPTimePoint begin, LDAPDeadline end)
+{
+	std::mt19937 random(index);
+	std::uniform_int_distribution<int> ids(0, opts.ids - 1);
+	int total = 0;
+	std::chrono::nanoseconds period(0);
+	LDAPTimePoint due = begin;
+
+	for (int op = 0; op < kOpCount; op++)
+		total += opts.weights[op];
+	std::uniform_int_distribution<int> pick(0, total - 1);
+
+	if (opts.rate > 0)
+	{
+		period = std::chrono::nanoseconds((long long)
+			(1e9 * opts.threads / opts.rate));
+		// Spread the threads over the period.
+		due += period * index / opts.threads;
+	}
+
+	for (;;)
+	{
+		int choice = pick(random), op = 0;
+		LDAPTimePoint start;
+		LDAPConnection* conn;
+
+		while (choice >= opts.weights[op])
+			choice -= opts.weights[op++];
+
+		if (opts.rate > 0)
+		{
+			if (due >= end)
+				break;
+			std::this_thread::sleep_until(due);
+			start = due;
+			due += period;
+		}
+		else
+		{
+			start = std::chrono::steady_clock::now();
+			if (start >= end)
+				break;
+		}
+
+		conn = pool->Get();
+		try
+		{
+			RunOp(opts, (Op) op, ids(random), random(), conn, &start,
+				opts.rate > 0);
+		}
+		catch (LDAPException& e)
+		{
+			k_Stats[op].errors++;
+		}
+		pool->Put(conn);
+
+		k_Stats[op].latency.Record(
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - start).count());
+		k_Completed++;
+	}
+}
+
+static void Report(double secs)
+{
+	long total = 0;
+
+	printf("%-8s %10s %8s %9s %9s %9s %9s %9s\n", "op", "count", "errors",
+		"p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+	for (int op = 0; op < kOpCount; op++)
+	{
+		LDAPHistogramSnapshot snap;
+
+		k_Stats[op].latency.Snapshot(&snap);
+		if (snap.count == 0)
+			continue;
+
+		total += snap.count;
+		printf("%-8s %10llu %8ld %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+			k_OpNames[op], snap.count, k_Stats[op].errors.load(),
+			snap.Percentile(0.5) / 1e3, snap.Percentile(0.9) / 1e3,
+			snap.Percentile(0.99) / 1e3, snap.Percentile(0.999) / 1e3,
+			snap.max / 1e3);
+	}
+	printf("%ld operations in %.3f s (%.0f/s)\n", total, secs,
+		secs > 0 ? total / secs : 0.0);
+}
+
+/**
+ * Fill the mock server with entries matching the default templates.
+ */
+static void FillMock(testing::MockLDAPServer* server, const Options& opts)
+{
+	server->AddUser(opts.bind_dn, opts.password);
+	for (int i = 0; i < opts.mock_entries; i++)
+	{
+		std::string id = std::to_string(i);
+
+		server->AddEntry("uid=user" + id + ",ou=people,dc=example,dc=com",
+			{{"objectClass", {"person"}}, {"uid", {"user" + id}},
+			 {"cn", {"User " + id}}, {"description", {"initial"}}});
+	}
+}
+
+static void Usage()
+{
+	std::cerr << "usage: ldap++-bench [options] uri | -m entries\n"
+		"  -x mix        operation weights, e.g. point=8,subtree=1,"
+		"modify=1,bind=0\n"
+		"  -t threads    worker threads (1)\n"
+		"  -c conns      connections shared by the threads (1)\n"
+		"  -r rate       total operations per second, 0 for closed loop (0)\n"
+		"  -d seconds    duration of the run (10)\n"
+		"  -i seconds    print the throughput at this interval\n"
+		"  -D dn -w pw   bind identity for connections and bind operations\n"
+		"  -b base       search base\n"
+		"  -f filter     point search filter template, %d is the ID\n"
+		"  -F filter     subtree search filter\n"
+		"  -e dn         template of the DNs to modify\n"
+		"  -a attribute  attribute to modify\n"
+		"  -n ids        IDs are picked from 0 to ids - 1 (1000)\n"
+		"  -P size       page size of subtree searches\n"
+		"  -m entries    run against an in-process mock server" << std::endl;
+	exit(2);
+}
+
+int main(int argc, char** argv)
+{
+	std::unique_ptr<testing::MockLDAPServer> mock;
+	std::vector<std::thread> workers;
+	ConnectionPool pool;
+	LDAPTimePoint begin;
+	LDAPDeadline end;
+	Options opts;
+	bool bind = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "x:t:c:r:d:i:D:w:b:f:F:e:a:n:P:m:")) != -1)
+	{
+		switch (c)
+		{
+		case 'x':
+			if (!ParseMix(optarg, opts.weights))
+				Usage();
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'c':
+			opts.connections = atoi(optarg);
+			break;
+		case 'r':
+			opts.rate = atof(optarg);
+			break;
+		case 'd':
+			opts.duration = atoi(optarg);
+			break;
+		case 'i':
+			opts.interval = atoi(optarg);
+			break;
+		case 'D':
+			opts.bind_dn = optarg;
+			bind = true;
+			break;
+		case 'w':
+			opts.password = optarg;
+			break;
+		case 'b':
+			opts.base = optarg;
+			break;
+		case 'f':
+			opts.point_filter = optarg;
+			break;
+		case 'F':
+			opts.subtree_filter = optarg;
+			break;
+		case 'e':
+			opts.dn_template = optarg;
+			break;
+		case 'a':
+			opts.attribute = optarg;
+			break;
+		case 'n':
+			opts.ids = atoi(optarg);
+			break;
+		case 'P':
+			opts.page_size = atoi(optarg);
+			break;
+		case 'm':
+			opts.mock_entries = atoi(optarg);
+			break;
+		default:
+			Usage();
+		}
+	}
+
+	if (opts.mock_entries > 0 && optind == argc)
+	{
+		mock.reset(new testing::MockLDAPServer);
+		mock->Start();
+		FillMock(mock.get(), opts);
+		opts.uri = mock->GetURI();
+		opts.ids = std::min(opts.ids, opts.mock_entries);
+		bind = true;
+	}
+	else if (opts.mock_entries == 0 && optind == argc - 1)
+		opts.uri = argv[optind];
+	else
+		Usage();
+
+	if (opts.threads < 1 || opts.connections < 1 || opts.duration < 1 ||
+			opts.ids < 1 || opts.rate < 0)
+		Usage();
+
+	try
+	{
+		for (int i = 0; i < opts.connections; i++)
+		{
+			LDAPConnection* conn = new LDAPConnection(opts.uri);
+
+			pool.Add(conn);
+			if (bind)
+				conn->SimpleBind(opts.bind_dn, opts.password);
+			if (opts.page_size > 0)
+				conn->SetPageSize(opts.page_size);
+		}
+	}
+	catch (LDAPException& e)
+	{
+		std::cerr << "ldap++-bench: " << e.what() << std::endl;
+		return 1;
+	}
+
+	begin = std::chrono::steady_clock::now();
+	end = begin + std::chrono::seconds(opts.duration);
+	for (int i = 0; i < opts.threads; i++)
+		workers.push_back(std::thread(Worker, std::cref(opts), &pool, i,
+			begin, end));
+
+	if (opts.interval > 0)
+	{
+		long last = 0;
+
+		for (LDAPTimePoint next = begin + std::chrono::seconds(opts.interval);
+				next <= end; next += std::chrono::seconds(opts.interval))
+		{
+			long done;
+
+			std::this_thread::sleep_until(next);
+			done = k_Completed.load();
+			fprintf(stderr, "%6lds %10.0f/s\n",
+				(long) std::chrono::duration_cast<std::chrono::seconds>(
+					next - begin).count(),
+				(double) (done - last) / opts.interval);
+			last = done;
+		}
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	Report(std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - begin).count() / 1e6);
+
+	return 0;
+}
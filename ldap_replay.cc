@@ -0,0 +1,816 @@
+/*
+ * Replays traffic recorded with LDAPCapture, to benchmark on real
+ * workloads without access to the production directory.
+ *
+ *   ldap_replay serve [-f] [-p port] capture
+ *	Answer requests on 127.0.0.1 with the recorded responses, after the
+ *	recorded server time unless -f is given. Point the client under test
+ *	at the URI printed on startup.
+ *
+ *   ldap_replay run [-f] [-s speed] capture uri
+ *	Send the recorded requests to another server (ldap:// only) with
+ *	their recorded timing, scaled by speed, or as fast as the ordering
+ *	of the recording allows with -f, and report the latencies. The
+ *	server needs the same entries and credentials as the recorded one.
+ *
+ * Both modes work on plain PDUs, so StartTLS and SASL binds with a
+ * security layer can't be replayed.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "ldap++.h"
+#include <ldap.h>
+
+using ldap_client::LDAPBerReader;
+using ldap_client::LDAPBerWriter;
+using ldap_client::LDAPCaptureReader;
+using ldap_client::LDAPCapturedPDU;
+using ldap_client::LDAPException;
+using ldap_client::LDAPHistogramSnapshot;
+using ldap_client::LDAPLatencyHistogram;
+using ldap_client::LDAPTimePoint;
+
+static const char k_PagedOID[] = "1.2.840.113556.1.4.319";
+static const unsigned char k_TagControls = 0xa0;
+
+/*
+ * An LDAPMessage split into its message ID and the elements following
+ * it: the protocol operation and optionally the controls.
+ */
+struct Element
+{
+	unsigned char tag;
+	std::string contents;
+};
+
+struct Message
+{
+	int msgid;
+	std::vector<Element> elements;
+
+	unsigned char Op() const { return elements.empty() ? 0 : elements[0].tag; }
+};
+
+static bool Decode(const std::string& pdu, Message* msg)
+{
+	try
+	{
+		LDAPBerReader outer(pdu.data(), pdu.size());
+		LDAPBerReader reader = outer.ReadSequence();
+
+		msg->msgid = reader.ReadInteger();
+		msg->elements.clear();
+		while (!reader.AtEnd())
+		{
+			struct berval bv;
+			Element e;
+
+			e.tag = reader.ReadElement(&bv);
+			e.contents.assign(bv.bv_val, bv.bv_len);
+			msg->elements.push_back(e);
+		}
+	}
+	catch (LDAPException& e)
+	{
+		return false;
+	}
+
+	return !msg->elements.empty();
+}
+
+static std::string Encode(const Message& msg, int msgid)
+{
+	LDAPBerWriter ber;
+
+	ber.StartSequence();
+	ber.AddInteger(msgid);
+	for (size_t i = 0; i < msg.elements.size(); i++)
+		ber.AddOctetString(msg.elements[i].contents.data(),
+			msg.elements[i].contents.size(), msg.elements[i].tag);
+	ber.EndSequence();
+
+	return std::string(ber.Data(), ber.Length());
+}
+
+/* Requests to which the server doesn't respond. */
+static bool ExpectsResponse(unsigned char op)
+{
+	return op != LDAP_REQ_UNBIND && op != LDAP_REQ_ABANDON;
+}
+
+/* Responses after which no more are sent for the same request. */
+static bool IsFinal(unsigned char op)
+{
+	return op != LDAP_RES_SEARCH_ENTRY && op != LDAP_RES_SEARCH_REFERENCE &&
+		op != LDAP_RES_INTERMEDIATE;
+}
+
+static unsigned char ResponseTag(unsigned char op)
+{
+	switch (op)
+	{
+	case LDAP_REQ_SEARCH:
+		return LDAP_RES_SEARCH_RESULT;
+	case LDAP_REQ_DELETE:
+		return LDAP_RES_DELETE;
+	default:
+		return op + 1;
+	}
+}
+
+static const char* OpName(unsigned char op)
+{
+	switch (op)
+	{
+	case LDAP_REQ_BIND:
+		return "bind";
+	case LDAP_REQ_SEARCH:
+		return "search";
+	case LDAP_REQ_MODIFY:
+		return "modify";
+	case LDAP_REQ_ADD:
+		return "add";
+	case LDAP_REQ_DELETE:
+		return "delete";
+	case LDAP_REQ_MODDN:
+		return "moddn";
+	case LDAP_REQ_COMPARE:
+		return "compare";
+	case LDAP_REQ_EXTENDED:
+		return "extended";
+	default:
+		return "other";
+	}
+}
+
+/**
+ * Get the result code of a final response.
+ */
+static int ResultCode(const Message& msg)
+{
+	try
+	{
+		LDAPBerReader reader(msg.elements[0].contents.data(),
+			msg.elements[0].contents.size());
+
+		return reader.ReadInteger(0x0a);
+	}
+	catch (LDAPException& e)
+	{
+		return LDAP_DECODING_ERROR;
+	}
+}
+
+/**
+ * Find the cookie of the paged results control of a message.
+ *
+ * @return false if the message has no paged results control.
+ */
+static bool GetCookie(const Message& msg, std::string* cookie)
+{
+	try
+	{
+		for (size_t i = 1; i < msg.elements.size(); i++)
+		{
+			LDAPBerReader ctrls(msg.elements[i].contents.data(),
+				msg.elements[i].contents.size());
+
+			if (msg.elements[i].tag != k_TagControls)
+				continue;
+
+			while (!ctrls.AtEnd())
+			{
+				LDAPBerReader ctrl = ctrls.ReadSequence();
+				std::string oid = ctrl.ReadString();
+
+				if (oid != k_PagedOID)
+					continue;
+				if (!ctrl.AtEnd() && ctrl.PeekTag() == 0x01)
+					ctrl.ReadBoolean();
+
+				std::string value = ctrl.ReadString();
+				LDAPBerReader outer(value.data(), value.size());
+				LDAPBerReader paged = outer.ReadSequence();
+
+				paged.ReadInteger();
+				*cookie = paged.ReadString();
+				return true;
+			}
+		}
+	}
+	catch (LDAPException& e)
+	{
+	}
+
+	return false;
+}
+
+/**
+ * Replace the cookie of the paged results control of a request.
+ */
+static void SetCookie(Message* msg, const std::string& cookie)
+{
+	for (size_t i = 1; i < msg->elements.size(); i++)
+	{
+		std::string contents = msg->elements[i].contents;
+		LDAPBerReader ctrls(contents.data(), contents.size());
+		LDAPBerWriter ber;
+
+		if (msg->elements[i].tag != k_TagControls)
+			continue;
+
+		while (!ctrls.AtEnd())
+		{
+			LDAPBerReader ctrl = ctrls.ReadSequence();
+			std::string oid = ctrl.ReadString();
+			std::string value;
+			bool has_critical = false, critical = false, has_value;
+
+			if (!ctrl.AtEnd() && ctrl.PeekTag() == 0x01)
+			{
+				has_critical = true;
+				critical = ctrl.ReadBoolean();
+			}
+			has_value = !ctrl.AtEnd();
+			if (has_value)
+				value = ctrl.ReadString();
+
+			if (oid == k_PagedOID && has_value)
+			{
+				LDAPBerReader outer(value.data(), value.size());
+				LDAPBerReader paged = outer.ReadSequence();
+				LDAPBerWriter pv;
+
+				pv.StartSequence();
+				pv.AddInteger(paged.ReadInteger());
+				pv.AddOctetString(cookie);
+				pv.EndSequence();
+				value.assign(pv.Data(), pv.Length());
+			}
+
+			ber.StartSequence();
+			ber.AddOctetString(oid);
+			if (has_critical)
+				ber.AddBoolean(critical);
+			if (has_value)
+				ber.AddOctetString(value);
+			ber.EndSequence();
+		}
+
+		msg->elements[i].contents.assign(ber.Data(), ber.Length());
+	}
+}
+
+static bool ReadFull(int fd, char* buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = read(fd, buf, len);
+
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool WriteFull(int fd, const std::string& data)
+{
+	const char* buf = data.data();
+	size_t len = data.size();
+
+	while (len > 0)
+	{
+		ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/**
+ * Read one complete PDU from a socket.
+ */
+static bool ReadPDU(int fd, std::string* pdu)
+{
+	char header[6];
+	size_t len = 0, n = 0;
+
+	if (!ReadFull(fd, header, 2))
+		return false;
+
+	if (header[1] & 0x80)
+	{
+		n = header[1] & 0x7f;
+		if (n == 0 || n > 4 || !ReadFull(fd, header + 2, n))
+			return false;
+		for (size_t i = 0; i < n; i++)
+			len = (len << 8) | (unsigned char) header[2 + i];
+	}
+	else
+		len = header[1];
+
+	pdu->assign(header, 2 + n);
+	pdu->resize(2 + n + len);
+	return len == 0 || ReadFull(fd, &(*pdu)[2 + n], len);
+}
+
+/*
+ * serve: responses recorded for each distinct request, handed out in
+ * turn when the same request is received repeatedly.
+ */
+struct Response
+{
+	long long delay;	/* Microseconds after the request. */
+	Message msg;
+};
+
+struct Recording
+{
+	Recording() : next(0) {}
+
+	std::vector<std::vector<Response> > exchanges;
+	size_t next;
+};
+
+static std::mutex k_RecordingsLock;
+static std::map<std::string, Recording> k_Recordings;
+
+static void LoadRecordings(const std::string& path)
+{
+	struct Pending
+	{
+		std::string key;
+		size_t index;
+		long long usec;
+	};
+	std::map<std::pair<unsigned int, int>, Pending> pending;
+	LDAPCaptureReader reader(path);
+	LDAPCapturedPDU pdu;
+	size_t requests = 0;
+
+	while (reader.Next(&pdu))
+	{
+		Message msg;
+		std::pair<unsigned int, int> id;
+
+		if (!Decode(pdu.pdu, &msg))
+			continue;
+		id = std::make_pair(pdu.conn, msg.msgid);
+
+		if (pdu.sent)
+		{
+			Pending p;
+
+			if (!ExpectsResponse(msg.Op()))
+				continue;
+
+			p.key = Encode(msg, 0);
+			p.usec = pdu.usec;
+			p.index = k_Recordings[p.key].exchanges.size();
+			k_Recordings[p.key].exchanges.push_back(
+				std::vector<Response>());
+			pending[id] = p;
+			requests++;
+		}
+		else if (pending.count(id))
+		{
+			Pending& p = pending[id];
+			Response r;
+
+			r.delay = pdu.usec - p.usec;
+			r.msg = msg;
+			k_Recordings[p.key].exchanges[p.index].push_back(r);
+			if (IsFinal(msg.Op()))
+				pending.erase(id);
+		}
+	}
+
+	std::cerr << "Loaded " << requests << " requests, "
+		<< k_Recordings.size() << " distinct" << std::endl;
+}
+
+static void Serve(int fd, bool fast)
+{
+	std::string pdu;
+
+	while (ReadPDU(fd, &pdu))
+	{
+		LDAPTimePoint start = std::chrono::steady_clock::now();
+		std::vector<Response> responses;
+		Message req;
+
+		if (!Decode(pdu, &req) || req.Op() == LDAP_REQ_UNBIND)
+			break;
+		if (!ExpectsResponse(req.Op()))
+			continue;
+
+		{
+			std::lock_guard<std::mutex> guard(k_RecordingsLock);
+			auto iter = k_Recordings.find(Encode(req, 0));
+
+			if (iter != k_Recordings.end())
+			{
+				Recording& r = iter->second;
+
+				responses = r.exchanges[r.next];
+				r.next = (r.next + 1) % r.exchanges.size();
+			}
+		}
+
+		if (responses.empty())
+		{
+			LDAPBerWriter ber;
+
+			ber.StartSequence();
+			ber.AddInteger(req.msgid);
+			ber.StartSequence(ResponseTag(req.Op()));
+			ber.AddInteger(LDAP_UNWILLING_TO_PERFORM, 0x0a);
+			ber.AddOctetString("");
+			ber.AddOctetString("No recorded response");
+			ber.EndSequence();
+			ber.EndSequence();
+
+			if (!WriteFull(fd, std::string(ber.Data(), ber.Length())))
+				break;
+			continue;
+		}
+
+		for (size_t i = 0; i < responses.size(); i++)
+		{
+			if (!fast)
+				std::this_thread::sleep_until(start +
+					std::chrono::microseconds(responses[i].delay));
+			if (!WriteFull(fd, Encode(responses[i].msg, req.msgid)))
+				break;
+		}
+	}
+
+	close(fd);
+}
+
+static int RunServer(const std::string& path, int port, bool fast)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int s, one = 1;
+
+	LoadRecordings(path);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	if (bind(s, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+			listen(s, 128) < 0 ||
+			getsockname(s, (struct sockaddr*) &addr, &len) < 0)
+	{
+		perror("ldap_replay");
+		return 1;
+	}
+
+	std::cout << "ldap://127.0.0.1:" << ntohs(addr.sin_port) << std::endl;
+
+	for (;;)
+	{
+		int fd = accept(s, 0, 0);
+
+		if (fd < 0)
+			continue;
+		// Responses are written one by one, at their recorded times.
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		std::thread(Serve, fd, fast).detach();
+	}
+}
+
+/*
+ * run: the requests of each recorded connection, each with the number of
+ * requests on the connection which had completed when it was sent. A
+ * request isn't replayed before as many have completed again.
+ */
+struct Request
+{
+	long long usec;
+	Message msg;
+	size_t after;
+};
+
+struct Connection
+{
+	std::vector<Request> requests;
+	/* Paged results cookies returned for each message ID. */
+	std::map<int, std::string> cookies;
+};
+
+struct OpStats
+{
+	OpStats() : errors(0) {}
+
+	LDAPLatencyHistogram latency;
+	std::atomic<long> errors;
+};
+
+static std::map<unsigned char, OpStats> k_OpStats;
+
+static void LoadConnections(const std::string& path,
+	std::map<unsigned int, Connection>* conns)
+{
+	std::map<unsigned int, size_t> done;
+	std::map<std::pair<unsigned int, int>, bool> pending;
+	LDAPCaptureReader reader(path);
+	LDAPCapturedPDU pdu;
+
+	while (reader.Next(&pdu))
+	{
+		Connection& conn = (*conns)[pdu.conn];
+		std::pair<unsigned int, int> id;
+		std::string cookie;
+		Message msg;
+
+		if (!Decode(pdu.pdu, &msg))
+			continue;
+		id = std::make_pair(pdu.conn, msg.msgid);
+
+		if (pdu.sent)
+		{
+			Request r;
+
+			r.usec = pdu.usec;
+			r.msg = msg;
+			r.after = done[pdu.conn];
+			conn.requests.push_back(r);
+			k_OpStats[msg.Op()];
+
+			if (ExpectsResponse(msg.Op()))
+				pending[id] = true;
+			else
+				done[pdu.conn]++;
+		}
+		else if (pending.count(id) && IsFinal(msg.Op()))
+		{
+			if (GetCookie(msg, &cookie) && !cookie.empty())
+				conn.cookies[msg.msgid] = cookie;
+			pending.erase(id);
+			done[pdu.conn]++;
+		}
+	}
+}
+
+static int Connect(const std::string& uri)
+{
+	LDAPURLDesc* lud = 0;
+	struct addrinfo hints, *res = 0;
+	std::string port;
+	int fd = -1, one = 1;
+
+	if (ldap_url_parse(uri.c_str(), &lud) != LDAP_SUCCESS)
+		return -1;
+
+	port = std::to_string(lud->lud_port ? lud->lud_port : LDAP_PORT);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(lud->lud_host && *lud->lud_host ? lud->lud_host :
+				"localhost", port.c_str(), &hints, &res) == 0)
+	{
+		for (struct addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next)
+		{
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+			{
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(res);
+	}
+
+	ldap_free_urldesc(lud);
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+/**
+ * Replay the requests of one recorded connection.
+ */
+static void Replay(const std::string& uri, Connection* conn,
+	LDAPTimePoint begin, double speed, bool fast)
+{
+	const std::chrono::seconds patience(60);
+	std::mutex lock;
+	std::condition_variable cond;
+	std::map<int, std::pair<unsigned char, LDAPTimePoint> > sent;
+	std::map<std::string, std::string> cookies;
+	size_t done = 0;
+	int fd = Connect(uri);
+
+	if (fd < 0)
+	{
+		std::cerr << "Cannot connect to " << uri << std::endl;
+		return;
+	}
+
+	std::thread reader([&]() {
+		std::string pdu;
+		Message msg;
+
+		while (ReadPDU(fd, &pdu))
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			std::string cookie;
+
+			if (!Decode(pdu, &msg) || !IsFinal(msg.Op()) ||
+					!sent.count(msg.msgid))
+				continue;
+
+			OpStats& stats = k_OpStats.at(sent[msg.msgid].first);
+			stats.latency.Record(
+				std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() -
+					sent[msg.msgid].second).count());
+			if (ResultCode(msg) != LDAP_SUCCESS)
+				stats.errors++;
+
+			if (conn->cookies.count(msg.msgid) && GetCookie(msg, &cookie))
+				cookies[conn->cookies[msg.msgid]] = cookie;
+
+			sent.erase(msg.msgid);
+			done++;
+			cond.notify_all();
+		}
+
+		// Let the writer finish if the server went away.
+		std::lock_guard<std::mutex> guard(lock);
+		done = conn->requests.size();
+		cond.notify_all();
+	});
+
+	for (size_t i = 0; i < conn->requests.size(); i++)
+	{
+		Request& r = conn->requests[i];
+		std::string cookie;
+
+		{
+			std::unique_lock<std::mutex> guard(lock);
+
+			if (!cond.wait_for(guard, patience,
+						[&]() { return done >= r.after; }))
+				std::cerr << "Request " << r.msg.msgid
+					<< " sent without waiting for earlier ones"
+					<< std::endl;
+			if (GetCookie(r.msg, &cookie) && cookies.count(cookie))
+				SetCookie(&r.msg, cookies[cookie]);
+		}
+
+		if (!fast)
+			std::this_thread::sleep_until(begin +
+				std::chrono::microseconds((long long) (r.usec / speed)));
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			if (ExpectsResponse(r.msg.Op()))
+				sent[r.msg.msgid] = std::make_pair(r.msg.Op(),
+					std::chrono::steady_clock::now());
+			else
+				done++;
+		}
+
+		if (!WriteFull(fd, Encode(r.msg, r.msg.msgid)))
+			break;
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(lock);
+
+		cond.wait_for(guard, patience,
+			[&]() { return done >= conn->requests.size(); });
+	}
+
+	shutdown(fd, SHUT_RDWR);
+	reader.join();
+	close(fd);
+}
+
+static int RunClient(const std::string& path, const std::string& uri,
+	double speed, bool fast)
+{
+	std::map<unsigned int, Connection> conns;
+	std::vector<std::thread> threads;
+	LDAPTimePoint begin;
+	double secs;
+	long total = 0;
+
+	LoadConnections(path, &conns);
+
+	begin = std::chrono::steady_clock::now();
+	for (auto iter = conns.begin(); iter != conns.end(); iter++)
+		threads.push_back(std::thread(Replay, uri, &iter->second, begin,
+			speed, fast));
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	secs = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - begin).count() / 1e6;
+
+	printf("%-10s %8s %8s %10s %10s %10s\n", "op", "count", "errors",
+		"p50 ms", "p99 ms", "max ms");
+	for (auto iter = k_OpStats.begin(); iter != k_OpStats.end(); iter++)
+	{
+		LDAPHistogramSnapshot snap;
+
+		iter->second.latency.Snapshot(&snap);
+		if (snap.count == 0)
+			continue;
+
+		total += snap.count;
+		printf("%-10s %8llu %8ld %10.3f %10.3f %10.3f\n",
+			OpName(iter->first), snap.count, iter->second.errors.load(),
+			snap.Percentile(0.5) / 1e3, snap.Percentile(0.99) / 1e3,
+			snap.max / 1e3);
+	}
+	printf("%ld operations on %zu connections in %.3f s (%.0f/s)\n", total,
+		conns.size(), secs, secs > 0 ? total / secs : 0.0);
+
+	return 0;
+}
+
+static void Usage()
+{
+	std::cerr << "usage: ldap_replay serve [-f] [-p port] capture\n"
+		"       ldap_replay run [-f] [-s speed] capture uri" << std::endl;
+	exit(2);
+}
+
+int main(int argc, char** argv)
+{
+	std::string mode;
+	double speed = 1.0;
+	bool fast = false;
+	int port = 0, c;
+
+	if (argc < 2)
+		Usage();
+	mode = argv[1];
+	optind = 2;
+
+	while ((c = getopt(argc, argv, "fp:s:")) != -1)
+	{
+		switch (c)
+		{
+		case 'f':
+			fast = true;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		default:
+			Usage();
+		}
+	}
+
+	try
+	{
+		if (mode == "serve" && argc - optind == 1)
+			return RunServer(argv[optind], port, fast);
+		if (mode == "run" && argc - optind == 2 && speed > 0)
+			return RunClient(argv[optind], argv[optind + 1], speed, fast);
+	}
+	catch (LDAPException& e)
+	{
+		std::cerr << "ldap_replay: " << e.what() << std::endl;
+		return 1;
+	}
+
+	Usage();
+}
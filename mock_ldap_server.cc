@@ -0,0 +1,1272 @@
+/*
+ * In-process LDAP server for tests and benchmarks.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "mock_ldap_server.h"
+
+using ldap_client::LDAPBerReader;
+using ldap_client::LDAPBerWriter;
+
+namespace testing
+{
+typedef std::vector<std::pair<std::string, std::string> > ControlList;
+
+static bool EqualsIgnoreCase(const std::string& a, const std::string& b)
+{
+	return a.length() == b.length() && !strcasecmp(a.c_str(), b.c_str());
+}
+
+static std::string ToString(const struct berval& bv)
+{
+	return std::string(bv.bv_val, bv.bv_len);
+}
+
+/**
+ * Find an attribute by name, ignoring case.
+ */
+static const std::vector<std::string>* FindAttribute(
+	const MockLDAPServer::Attributes& attrs, const std::string& name)
+{
+	for (MockLDAPServer::Attributes::const_iterator it = attrs.begin();
+			it != attrs.end(); it++)
+		if (EqualsIgnoreCase(it->first, name))
+			return &it->second;
+
+	return 0;
+}
+
+/**
+ * Get the attribute type a simple filter item applies to.
+ */
+static std::string ItemType(unsigned char tag, const struct berval& contents)
+{
+	LDAPBerReader r(contents);
+
+	if (tag == 0x87)
+		return ToString(contents);
+
+	return r.ReadString();
+}
+
+/**
+ * Check whether a single value satisfies a simple filter item (equality,
+ * substrings, ordering, presence or approximate match). Comparisons
+ * ignore case.
+ */
+static bool ValueMatches(unsigned char tag, const struct berval& contents,
+	const std::string& value)
+{
+	LDAPBerReader r(contents);
+
+	if (tag == 0x87)
+		return true;
+
+	r.ReadString();
+
+	if (tag == 0xa4)
+	{
+		LDAPBerReader subs = r.ReadSequence();
+		std::string v = value;
+		size_t pos = 0;
+
+		std::transform(v.begin(), v.end(), v.begin(), ::tolower);
+		while (!subs.AtEnd())
+		{
+			struct berval bv;
+			unsigned char t = subs.ReadElement(&bv);
+			std::string p = ToString(bv);
+
+			std::transform(p.begin(), p.end(), p.begin(), ::tolower);
+			if (t == 0x80)
+			{
+				if (v.compare(0, p.length(), p) != 0)
+					return false;
+				pos = p.length();
+			}
+			else if (t == 0x81)
+			{
+				size_t found = v.find(p, pos);
+
+				if (found == std::string::npos)
+					return false;
+				pos = found + p.length();
+			}
+			else if (v.length() < pos + p.length() ||
+					v.compare(v.length() - p.length(), p.length(), p) != 0)
+				return false;
+		}
+		return true;
+	}
+
+	int cmp = strcasecmp(value.c_str(), r.ReadString().c_str());
+
+	switch (tag)
+	{
+	case 0xa3:
+	case 0xa8:
+		return cmp == 0;
+	case 0xa5:
+		return cmp >= 0;
+	case 0xa6:
+		return cmp <= 0;
+	default:
+		return false;
+	}
+}
+
+MockLDAPServer::MockLDAPServer()
+: _listen_fd(-1), _port(0), _running(false), _max_page_size(0),
+	_max_val_range(0), _connections(0)
+{
+	_supported.insert(LDAP_CONTROL_PAGEDRESULTS);
+	_supported.insert(LDAP_CONTROL_SORTREQUEST);
+	_supported.insert(LDAP_CONTROL_VLVREQUEST);
+	_supported.insert(LDAP_CONTROL_VALUESRETURNFILTER);
+	_supported.insert(LDAP_CONTROL_X_DEREF);
+}
+
+MockLDAPServer::~MockLDAPServer()
+{
+	Stop();
+}
+
+/**
+ * Start listening on an ephemeral port of the loopback interface.
+ *
+ * @throws LDAPErrLocalError The socket could not be set up.
+ */
+void MockLDAPServer::Start()
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int on = 1;
+
+	_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (_listen_fd < 0)
+		throw ldap_client::LDAPErrLocalError("socket failed");
+
+	setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	if (bind(_listen_fd, (struct sockaddr*) &addr, sizeof(addr)) ||
+			listen(_listen_fd, 128) ||
+			getsockname(_listen_fd, (struct sockaddr*) &addr, &len))
+	{
+		close(_listen_fd);
+		_listen_fd = -1;
+		throw ldap_client::LDAPErrLocalError("Unable to listen");
+	}
+
+	_port = ntohs(addr.sin_port);
+	_running = true;
+	_acceptor = std::thread(&MockLDAPServer::AcceptLoop, this);
+}
+
+/**
+ * Stop the server and disconnect all clients.
+ */
+void MockLDAPServer::Stop()
+{
+	if (!_running.exchange(false))
+		return;
+
+	shutdown(_listen_fd, SHUT_RDWR);
+	_acceptor.join();
+	close(_listen_fd);
+	_listen_fd = -1;
+
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		for (size_t i = 0; i < _client_fds.size(); i++)
+			shutdown(_client_fds[i], SHUT_RDWR);
+	}
+
+	for (size_t i = 0; i < _workers.size(); i++)
+		_workers[i].join();
+	for (size_t i = 0; i < _client_fds.size(); i++)
+		close(_client_fds[i]);
+	_workers.clear();
+	_client_fds.clear();
+}
+
+/**
+ * Disconnect all clients, as if the server had been restarted, but keep
+ * accepting new connections.
+ */
+void MockLDAPServer::DropConnections()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	for (size_t i = 0; i < _client_fds.size(); i++)
+		shutdown(_client_fds[i], SHUT_RDWR);
+}
+
+/**
+ * Get the URI clients should connect to.
+ */
+std::string MockLDAPServer::GetURI() const
+{
+	return "ldap://127.0.0.1:" + std::to_string(_port);
+}
+
+/**
+ * Add or replace an entry in the directory.
+ */
+void MockLDAPServer::AddEntry(const std::string& dn, const Attributes& attrs)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	Entry& e = _entries[Normalize(dn)];
+
+	e.dn = dn;
+	e.ndn = Normalize(dn);
+	e.attrs = attrs;
+}
+
+/**
+ * Allow simple binds as dn with the given password.
+ */
+void MockLDAPServer::AddUser(const std::string& dn,
+	const std::string& password)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	_passwords[Normalize(dn)] = password;
+}
+
+bool MockLDAPServer::HasEntry(const std::string& dn)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	return _entries.count(Normalize(dn)) > 0;
+}
+
+MockLDAPServer::Attributes MockLDAPServer::GetEntry(const std::string& dn)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	std::map<std::string, Entry>::iterator it = _entries.find(Normalize(dn));
+
+	if (it == _entries.end())
+		return Attributes();
+
+	return it->second.attrs;
+}
+
+/**
+ * Delay every response to the given operation.
+ *
+ * @param op   Request tag, e.g. LDAP_REQ_SEARCH.
+ * @param usec Delay in microseconds.
+ */
+void MockLDAPServer::SetLatency(int op, long usec)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	_latency[op] = usec;
+}
+
+/**
+ * Fail every request of the given operation with the given result code.
+ * Pass LDAP_SUCCESS to stop injecting errors.
+ *
+ * @param op     Request tag, e.g. LDAP_REQ_SEARCH.
+ * @param result LDAP result code to return.
+ */
+void MockLDAPServer::SetError(int op, int result)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	_errors[op] = result;
+}
+
+/**
+ * Limit the size of result pages, regardless of the requested size, like
+ * servers enforcing a MaxPageSize. 0 disables the limit.
+ */
+void MockLDAPServer::SetMaxPageSize(int size)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	_max_page_size = size;
+}
+
+/**
+ * Return attributes with more than size values in ranges of size values,
+ * like servers enforcing MaxValRange. 0 disables ranges.
+ */
+void MockLDAPServer::SetMaxValRange(size_t size)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	_max_val_range = size;
+}
+
+/**
+ * Enable or disable support for a request control. Requests carrying an
+ * unsupported critical control fail with unavailableCriticalExtension;
+ * unsupported non-critical controls are ignored.
+ */
+void MockLDAPServer::SetControlSupported(const std::string& oid,
+	bool supported)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	if (supported)
+		_supported.insert(oid);
+	else
+		_supported.erase(oid);
+}
+
+int MockLDAPServer::GetRequestCount(int op)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	return _request_count[op];
+}
+
+int MockLDAPServer::GetConnectionCount()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	return _connections;
+}
+
+/**
+ * Get the OIDs of the controls sent with the most recent request.
+ */
+std::vector<std::string> MockLDAPServer::GetLastControls()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	return _last_controls;
+}
+
+/**
+ * Get the sizes requested by all paged searches so far, in order.
+ */
+std::vector<int> MockLDAPServer::GetPageSizes()
+{
+	std::lock_guard<std::mutex> guard(_lock);
+
+	return _page_sizes;
+}
+
+void MockLDAPServer::AcceptLoop()
+{
+	while (_running)
+	{
+		int fd = accept(_listen_fd, 0, 0);
+		int on = 1;
+
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		std::lock_guard<std::mutex> guard(_lock);
+		_connections++;
+		_client_fds.push_back(fd);
+		_workers.push_back(std::thread(&MockLDAPServer::Serve, this, fd));
+	}
+}
+
+void MockLDAPServer::Serve(int fd)
+{
+	std::string pdu;
+
+	while (_running && ReadPDU(fd, pdu))
+	{
+		Request req;
+
+		try
+		{
+			ParseRequest(pdu, req);
+		}
+		catch (ldap_client::LDAPException&)
+		{
+			break;
+		}
+
+		if (req.op == LDAP_REQ_UNBIND)
+			break;
+
+		Respond(fd, req);
+	}
+
+	shutdown(fd, SHUT_RDWR);
+}
+
+/**
+ * Read one complete LDAPMessage from the socket.
+ */
+bool MockLDAPServer::ReadPDU(int fd, std::string& buf)
+{
+	unsigned char hdr[2 + sizeof(size_t)];
+	size_t hdrlen = 2, len;
+
+	buf.clear();
+
+	for (size_t got = 0; got < hdrlen; )
+	{
+		ssize_t n = read(fd, hdr + got, hdrlen - got);
+
+		if (n <= 0)
+			return false;
+		got += n;
+
+		if (got == 2 && (hdr[1] & 0x80))
+		{
+			hdrlen = 2 + (hdr[1] & 0x7f);
+			if (hdrlen > sizeof(hdr))
+				return false;
+		}
+	}
+
+	if (hdr[1] & 0x80)
+		for (len = 0, hdrlen = 2; hdrlen < 2 + (size_t) (hdr[1] & 0x7f);
+				hdrlen++)
+			len = (len << 8) | hdr[hdrlen];
+	else
+		len = hdr[1];
+
+	buf.assign(reinterpret_cast<char*>(hdr), hdrlen);
+	buf.resize(hdrlen + len);
+
+	for (size_t got = 0; got < len; )
+	{
+		ssize_t n = read(fd, &buf[hdrlen + got], len - got);
+
+		if (n <= 0)
+			return false;
+		got += n;
+	}
+
+	return true;
+}
+
+bool MockLDAPServer::WritePDU(int fd, const LDAPBerWriter& ber)
+{
+	return WriteAll(fd, ber.Data(), ber.Length());
+}
+
+bool MockLDAPServer::WriteAll(int fd, const char* p, size_t left)
+{
+	while (left > 0)
+	{
+		ssize_t n = send(fd, p, left, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		left -= n;
+	}
+
+	return true;
+}
+
+void MockLDAPServer::ParseRequest(const std::string& pdu, Request& req)
+{
+	LDAPBerReader outer(pdu.data(), pdu.length());
+	LDAPBerReader msg = outer.ReadSequence();
+
+	req.msgid = msg.ReadInteger();
+	req.op = msg.ReadElement(&req.body);
+
+	if (msg.PeekTag() == 0xa0)
+	{
+		LDAPBerReader ctrls = msg.ReadSequence(0xa0);
+
+		while (!ctrls.AtEnd())
+		{
+			LDAPBerReader ctrl = ctrls.ReadSequence();
+			std::string oid = ctrl.ReadString();
+			std::string value;
+			bool critical = false;
+
+			if (ctrl.PeekTag() == 0x01)
+				critical = ctrl.ReadBoolean();
+			if (ctrl.PeekTag() == 0x04)
+				value = ctrl.ReadString();
+
+			req.controls.push_back(std::make_pair(oid, value));
+			if (critical)
+				req.critical.insert(oid);
+		}
+	}
+}
+
+void MockLDAPServer::Respond(int fd, Request& req)
+{
+	long latency;
+	int error;
+
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+
+		_request_count[req.op]++;
+		latency = _latency[req.op];
+		error = _errors[req.op];
+
+		_last_controls.clear();
+		for (size_t i = 0; i < req.controls.size(); i++)
+		{
+			_last_controls.push_back(req.controls[i].first);
+			if (!_supported.count(req.controls[i].first) &&
+					req.critical.count(req.controls[i].first))
+				error = LDAP_UNAVAILABLE_CRITICAL_EXTENSION;
+		}
+
+		// Unsupported non-critical controls are ignored.
+		for (size_t i = req.controls.size(); i > 0; i--)
+			if (!_supported.count(req.controls[i - 1].first))
+				req.controls.erase(req.controls.begin() + i - 1);
+	}
+
+	if (latency > 0)
+		usleep(latency);
+
+	if (req.op == LDAP_REQ_ABANDON)
+		return;
+
+	unsigned char resp = req.op + 1;
+	if (req.op == LDAP_REQ_SEARCH)
+		resp = LDAP_RES_SEARCH_RESULT;
+	else if (req.op == LDAP_REQ_DELETE)
+		resp = LDAP_RES_DELETE;
+	else if (req.op == LDAP_REQ_EXTENDED)
+		resp = LDAP_RES_EXTENDED;
+
+	if (error != LDAP_SUCCESS)
+	{
+		WriteResult(fd, req.msgid, resp, error, "Injected error");
+		return;
+	}
+
+	try
+	{
+		switch (req.op)
+		{
+		case LDAP_REQ_BIND:
+			HandleBind(fd, req);
+			break;
+		case LDAP_REQ_SEARCH:
+			HandleSearch(fd, req);
+			break;
+		case LDAP_REQ_MODIFY:
+			HandleModify(fd, req);
+			break;
+		case LDAP_REQ_ADD:
+			HandleAdd(fd, req);
+			break;
+		case LDAP_REQ_DELETE:
+			HandleDelete(fd, req);
+			break;
+		case LDAP_REQ_EXTENDED:
+			HandleExtended(fd, req);
+			break;
+		default:
+			WriteResult(fd, req.msgid, resp, LDAP_UNWILLING_TO_PERFORM,
+				"Operation not supported");
+		}
+	}
+	catch (ldap_client::LDAPException& e)
+	{
+		WriteResult(fd, req.msgid, resp, LDAP_PROTOCOL_ERROR, e.what());
+	}
+}
+
+/**
+ * Extended operations succeed without a response value if their OID was
+ * enabled with SetControlSupported().
+ */
+void MockLDAPServer::HandleExtended(int fd, Request& req)
+{
+	LDAPBerReader body(req.body);
+	struct berval oid;
+	bool supported;
+
+	body.ReadOctetString(&oid, 0x80);
+
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		supported = _supported.count(ToString(oid)) > 0;
+	}
+
+	WriteResult(fd, req.msgid, LDAP_RES_EXTENDED,
+		supported ? LDAP_SUCCESS : LDAP_PROTOCOL_ERROR);
+}
+
+void MockLDAPServer::HandleBind(int fd, Request& req)
+{
+	LDAPBerReader body(req.body);
+	struct berval cred;
+	std::string dn;
+	int result = LDAP_SUCCESS;
+
+	body.ReadInteger();
+	dn = body.ReadString();
+	body.ReadOctetString(&cred, 0x80);
+
+	if (!dn.empty())
+	{
+		std::lock_guard<std::mutex> guard(_lock);
+		std::map<std::string, std::string>::iterator it =
+			_passwords.find(Normalize(dn));
+
+		if (it == _passwords.end() || it->second != ToString(cred))
+			result = LDAP_INVALID_CREDENTIALS;
+	}
+
+	WriteResult(fd, req.msgid, LDAP_RES_BIND, result);
+}
+
+void MockLDAPServer::HandleSearch(int fd, Request& req)
+{
+	LDAPBerReader body(req.body);
+	std::string base = Normalize(body.ReadString());
+	int scope = body.ReadInteger(0x0a);
+	struct berval filter;
+	std::vector<std::string> attrs;
+	std::vector<const Entry*> matches;
+	ControlList resp_ctrls;
+	std::string page_cookie;
+	int size_limit, page_size = -1, max_page;
+	bool types_only, all_user = false;
+	size_t start = 0, end;
+	LDAPBerWriter ber;
+
+	body.ReadInteger(0x0a);
+	size_limit = body.ReadInteger();
+	body.ReadInteger();
+	types_only = body.ReadBoolean();
+	unsigned char ftag = body.ReadElement(&filter);
+
+	LDAPBerReader attrlist = body.ReadSequence();
+	while (!attrlist.AtEnd())
+		attrs.push_back(attrlist.ReadString());
+	if (attrs.empty() || std::find(attrs.begin(), attrs.end(), "*") !=
+			attrs.end())
+		all_user = true;
+
+	if (const std::string* ctrl = FindControl(req, LDAP_CONTROL_PAGEDRESULTS))
+	{
+		LDAPBerReader r(ctrl->data(), ctrl->length());
+		LDAPBerReader v = r.ReadSequence();
+
+		page_size = v.ReadInteger();
+		page_cookie = v.ReadString();
+
+		std::lock_guard<std::mutex> guard(_lock);
+		_page_sizes.push_back(page_size);
+	}
+
+	const std::string* sort_ctrl = FindControl(req, LDAP_CONTROL_SORTREQUEST);
+	const std::string* vlv_ctrl = FindControl(req, LDAP_CONTROL_VLVREQUEST);
+	const std::string* vr_ctrl = FindControl(req,
+		LDAP_CONTROL_VALUESRETURNFILTER);
+	std::vector<std::pair<unsigned char, struct berval> > vr_items;
+	const std::string* deref_ctrl = FindControl(req, LDAP_CONTROL_X_DEREF);
+	std::vector<std::pair<std::string, std::vector<std::string> > > derefs;
+	std::vector<std::string> primary;
+	std::string out;
+
+	// Responses are encoded under the lock but written without it, so a
+	// slow client doesn't hold up the others.
+	std::unique_lock<std::mutex> guard(_lock);
+
+	for (std::map<std::string, Entry>::const_iterator it = _entries.begin();
+			it != _entries.end(); it++)
+		if (InScope(it->second, base, scope) &&
+				Matches(it->second, ftag, filter))
+			matches.push_back(&it->second);
+
+	if (matches.empty() && scope == LDAP_SCOPE_BASE)
+	{
+		WriteResult(fd, req.msgid, LDAP_RES_SEARCH_RESULT,
+			LDAP_NO_SUCH_OBJECT);
+		return;
+	}
+
+	if (vr_ctrl)
+	{
+		LDAPBerReader r(vr_ctrl->data(), vr_ctrl->length());
+		LDAPBerReader items = r.ReadSequence();
+
+		while (!items.AtEnd())
+		{
+			struct berval item;
+			unsigned char t = items.ReadElement(&item);
+
+			vr_items.push_back(std::make_pair(t, item));
+		}
+	}
+
+	if (deref_ctrl)
+	{
+		LDAPBerReader r(deref_ctrl->data(), deref_ctrl->length());
+		LDAPBerReader specs = r.ReadSequence();
+
+		while (!specs.AtEnd())
+		{
+			LDAPBerReader spec = specs.ReadSequence();
+			std::string type = spec.ReadString();
+			LDAPBerReader list = spec.ReadSequence();
+			std::vector<std::string> wanted;
+
+			while (!list.AtEnd())
+				wanted.push_back(list.ReadString());
+			derefs.push_back(std::make_pair(type, wanted));
+		}
+	}
+
+	if (vlv_ctrl && !sort_ctrl)
+	{
+		WriteResult(fd, req.msgid, LDAP_RES_SEARCH_RESULT,
+			LDAP_VLV_ERROR, "VLV requires sorting");
+		return;
+	}
+
+	if (sort_ctrl)
+	{
+		LDAPBerReader r(sort_ctrl->data(), sort_ctrl->length());
+		LDAPBerReader keys = r.ReadSequence();
+		std::vector<std::pair<std::string, bool> > order;
+		LDAPBerWriter sv;
+
+		while (!keys.AtEnd())
+		{
+			LDAPBerReader key = keys.ReadSequence();
+			std::string type = key.ReadString();
+			bool reverse = false;
+
+			if (!key.AtEnd() && key.PeekTag() == 0x80)
+				key.Skip();
+			if (!key.AtEnd() && key.PeekTag() == 0x81)
+				reverse = key.ReadBoolean(0x81);
+			order.push_back(std::make_pair(type, reverse));
+		}
+
+		primary.push_back(order[0].first);
+		primary.push_back(order[0].second ? "reverse" : "");
+
+		std::stable_sort(matches.begin(), matches.end(),
+			[&order](const Entry* a, const Entry* b) {
+				for (size_t i = 0; i < order.size(); i++)
+				{
+					const std::vector<std::string>* va =
+						FindAttribute(a->attrs, order[i].first);
+					const std::vector<std::string>* vb =
+						FindAttribute(b->attrs, order[i].first);
+					int cmp;
+
+					// Entries without the attribute sort last.
+					if (!va || va->empty() || !vb || vb->empty())
+					{
+						cmp = (va && !va->empty()) - (vb && !vb->empty());
+						if (cmp)
+							return cmp > 0;
+						continue;
+					}
+
+					cmp = strcasecmp((*va)[0].c_str(), (*vb)[0].c_str());
+					if (cmp)
+						return order[i].second ? cmp > 0 : cmp < 0;
+				}
+				return false;
+			});
+
+		sv.StartSequence();
+		sv.AddInteger(LDAP_SUCCESS, 0x0a);
+		sv.EndSequence();
+		resp_ctrls.push_back(std::make_pair(
+			std::string(LDAP_CONTROL_SORTRESPONSE),
+			std::string(sv.Data(), sv.Length())));
+	}
+
+	end = matches.size();
+	max_page = _max_page_size;
+
+	if (vlv_ctrl)
+	{
+		LDAPBerReader r(vlv_ctrl->data(), vlv_ctrl->length());
+		LDAPBerReader v = r.ReadSequence();
+		long before = v.ReadInteger(), after = v.ReadInteger();
+		std::string context = "vlv-context";
+		long target = 0;
+		LDAPBerWriter vv;
+
+		if (v.PeekTag() == 0xa0)
+		{
+			LDAPBerReader off = v.ReadSequence(0xa0);
+			long offset = off.ReadInteger(), count = off.ReadInteger();
+
+			if (count > 0 && offset > 0)
+				offset = (offset * (long) matches.size() + count - 1) / count;
+			target = std::max(0L, std::min(offset - 1,
+				(long) matches.size() - 1));
+		}
+		else
+		{
+			std::string value = v.ReadString(0x81);
+
+			for (target = 0; target < (long) matches.size(); target++)
+			{
+				const std::vector<std::string>* vals =
+					FindAttribute(matches[target]->attrs, primary[0]);
+				int cmp;
+
+				if (!vals || vals->empty())
+					break;
+				cmp = strcasecmp((*vals)[0].c_str(), value.c_str());
+				if (primary[1].empty() ? cmp >= 0 : cmp <= 0)
+					break;
+			}
+		}
+
+		if (!v.AtEnd())
+			context = v.ReadString();
+
+		start = std::max(0L, target - before);
+		end = std::min((long) matches.size(), target + after + 1);
+		page_size = -1;
+
+		vv.StartSequence();
+		vv.AddInteger(target + 1);
+		vv.AddInteger(matches.size());
+		vv.AddInteger(LDAP_SUCCESS, 0x0a);
+		vv.AddOctetString(context);
+		vv.EndSequence();
+		resp_ctrls.push_back(std::make_pair(
+			std::string(LDAP_CONTROL_VLVRESPONSE),
+			std::string(vv.Data(), vv.Length())));
+	}
+
+	if (page_size >= 0)
+	{
+		if (!page_cookie.empty())
+			start = std::min((size_t) atol(page_cookie.c_str()), end);
+		if (max_page > 0 && (page_size == 0 || page_size > max_page))
+			page_size = std::max(page_size, 0) ? max_page : 0;
+		end = std::min(end, start + page_size);
+	}
+
+	if (size_limit > 0 && end > (size_t) size_limit)
+		end = size_limit;
+
+	for (size_t i = start; i < end; i++)
+	{
+		const Entry* e = matches[i];
+
+		ber.Reset();
+		ber.StartSequence();
+		ber.AddInteger(req.msgid);
+		ber.StartSequence(LDAP_RES_SEARCH_ENTRY);
+		ber.AddOctetString(e->dn);
+		ber.StartSequence();
+
+		for (Attributes::const_iterator a = e->attrs.begin();
+				a != e->attrs.end(); a++)
+		{
+			bool wanted = all_user;
+			size_t first = 0, last = a->second.size();
+			std::string name = a->first;
+
+			for (size_t j = 0; j < attrs.size(); j++)
+			{
+				size_t pos = attrs[j].find(";range=");
+
+				if (!EqualsIgnoreCase(attrs[j].substr(0, pos), a->first))
+					continue;
+
+				wanted = true;
+				if (pos != std::string::npos)
+				{
+					const char* p = attrs[j].c_str() + pos + 7;
+
+					first = strtoul(p, 0, 10);
+					if (strchr(p, '-') && strchr(p, '-')[1] != '*')
+						last = strtoul(strchr(p, '-') + 1, 0, 10) + 1;
+				}
+			}
+			if (!wanted)
+				continue;
+
+			// Emulate MaxValRange by returning large attributes in ranges.
+			if (_max_val_range > 0 &&
+					(first > 0 || a->second.size() > _max_val_range))
+			{
+				last = std::min(std::min(last, first + _max_val_range),
+					a->second.size());
+				first = std::min(first, last);
+				name += ";range=" + std::to_string(first) + "-" +
+					(last == a->second.size() ? std::string("*") :
+					 std::to_string(last - 1));
+			}
+			else
+			{
+				first = 0;
+				last = a->second.size();
+			}
+
+			ber.StartSequence();
+			ber.AddOctetString(name);
+			ber.StartSequence(0x31);
+			for (size_t j = first; !types_only && j < last; j++)
+			{
+				bool match = !vr_ctrl;
+
+				// Only values matching the values return filter are sent.
+				for (size_t k = 0; !match && k < vr_items.size(); k++)
+					match = EqualsIgnoreCase(ItemType(vr_items[k].first,
+							vr_items[k].second), a->first) &&
+						ValueMatches(vr_items[k].first, vr_items[k].second,
+							a->second[j]);
+				if (match)
+					ber.AddOctetString(a->second[j]);
+			}
+			ber.EndSequence();
+			ber.EndSequence();
+		}
+
+		ber.EndSequence();
+		ber.EndSequence();
+
+		if (!derefs.empty())
+		{
+			LDAPBerWriter dv;
+
+			dv.StartSequence();
+			WriteDerefResults(dv, *e, derefs);
+			dv.EndSequence();
+
+			ber.StartSequence(0xa0);
+			ber.StartSequence();
+			ber.AddOctetString(LDAP_CONTROL_X_DEREF);
+			ber.AddOctetString(dv.Data(), dv.Length());
+			ber.EndSequence();
+			ber.EndSequence();
+		}
+
+		ber.EndSequence();
+		out.append(ber.Data(), ber.Length());
+	}
+
+	if (page_size >= 0)
+	{
+		LDAPBerWriter pv;
+		std::string cookie;
+
+		if (end < matches.size() && page_size > 0)
+			cookie = std::to_string(end);
+
+		pv.StartSequence();
+		pv.AddInteger(matches.size());
+		pv.AddOctetString(cookie);
+		pv.EndSequence();
+		resp_ctrls.push_back(std::make_pair(
+			std::string(LDAP_CONTROL_PAGEDRESULTS),
+			std::string(pv.Data(), pv.Length())));
+	}
+
+	guard.unlock();
+	if (!WriteAll(fd, out.data(), out.length()))
+		return;
+
+	WriteResult(fd, req.msgid, LDAP_RES_SEARCH_RESULT,
+		size_limit > 0 && matches.size() > (size_t) size_limit &&
+		page_size < 0 ? LDAP_SIZELIMIT_EXCEEDED : LDAP_SUCCESS, "",
+		&resp_ctrls);
+}
+
+void MockLDAPServer::HandleModify(int fd, Request& req)
+{
+	LDAPBerReader body(req.body);
+	std::string ndn = Normalize(body.ReadString());
+	LDAPBerReader changes = body.ReadSequence();
+	std::lock_guard<std::mutex> guard(_lock);
+	std::map<std::string, Entry>::iterator it = _entries.find(ndn);
+
+	if (it == _entries.end())
+	{
+		WriteResult(fd, req.msgid, LDAP_RES_MODIFY, LDAP_NO_SUCH_OBJECT);
+		return;
+	}
+
+	while (!changes.AtEnd())
+	{
+		LDAPBerReader change = changes.ReadSequence();
+		int op = change.ReadInteger(0x0a);
+		LDAPBerReader mod = change.ReadSequence();
+		std::string type = mod.ReadString();
+		LDAPBerReader vals = mod.ReadSequence(0x31);
+		std::vector<std::string>& values = it->second.attrs[type];
+
+		if (op == LDAP_MOD_REPLACE)
+			values.clear();
+
+		while (!vals.AtEnd())
+		{
+			std::string v = vals.ReadString();
+
+			if (op == LDAP_MOD_DELETE)
+				values.erase(std::remove(values.begin(), values.end(), v),
+					values.end());
+			else
+				values.push_back(v);
+		}
+
+		if (values.empty())
+			it->second.attrs.erase(type);
+	}
+
+	WriteResult(fd, req.msgid, LDAP_RES_MODIFY, LDAP_SUCCESS);
+}
+
+void MockLDAPServer::HandleAdd(int fd, Request& req)
+{
+	LDAPBerReader body(req.body);
+	Entry e;
+	LDAPBerReader attrs;
+
+	e.dn = body.ReadString();
+	e.ndn = Normalize(e.dn);
+	attrs = body.ReadSequence();
+
+	while (!attrs.AtEnd())
+	{
+		LDAPBerReader attr = attrs.ReadSequence();
+		std::string type = attr.ReadString();
+		LDAPBerReader vals = attr.ReadSequence(0x31);
+
+		while (!vals.AtEnd())
+			e.attrs[type].push_back(vals.ReadString());
+	}
+
+	std::lock_guard<std::mutex> guard(_lock);
+
+	if (_entries.count(e.ndn))
+	{
+		WriteResult(fd, req.msgid, LDAP_RES_ADD, LDAP_ALREADY_EXISTS);
+		return;
+	}
+
+	_entries[e.ndn] = e;
+	WriteResult(fd, req.msgid, LDAP_RES_ADD, LDAP_SUCCESS);
+}
+
+void MockLDAPServer::HandleDelete(int fd, Request& req)
+{
+	std::lock_guard<std::mutex> guard(_lock);
+	int result = _entries.erase(Normalize(ToString(req.body))) ?
+		LDAP_SUCCESS : LDAP_NO_SUCH_OBJECT;
+
+	WriteResult(fd, req.msgid, LDAP_RES_DELETE, result);
+}
+
+/**
+ * Evaluate a search filter against an entry. Extensible matches are not
+ * supported and never match.
+ */
+bool MockLDAPServer::Matches(const Entry& e, unsigned char tag,
+	const struct berval& contents)
+{
+	LDAPBerReader r(contents);
+
+	switch (tag)
+	{
+	case 0xa0:
+	case 0xa1:
+		while (!r.AtEnd())
+		{
+			struct berval sub;
+			unsigned char t = r.ReadElement(&sub);
+
+			if (Matches(e, t, sub) == (tag == 0xa1))
+				return tag == 0xa1;
+		}
+		return tag == 0xa0;
+	case 0xa2:
+	{
+		struct berval sub;
+		unsigned char t = r.ReadElement(&sub);
+
+		return !Matches(e, t, sub);
+	}
+	case 0x87:
+	case 0xa3:
+	case 0xa4:
+	case 0xa5:
+	case 0xa6:
+	case 0xa8:
+	{
+		std::string type = ItemType(tag, contents);
+		const std::vector<std::string>* values =
+			FindAttribute(e.attrs, type);
+
+		if (tag == 0x87 && EqualsIgnoreCase(type, "objectClass"))
+			return true;
+		if (!values)
+			return false;
+
+		for (size_t i = 0; i < values->size(); i++)
+			if (ValueMatches(tag, contents, (*values)[i]))
+				return true;
+		return false;
+	}
+	default:
+		return false;
+	}
+}
+
+/**
+ * Encode a DerefRes for every value of the dereferenced attributes which
+ * names an existing entry. The caller must hold the lock.
+ */
+void MockLDAPServer::WriteDerefResults(LDAPBerWriter& ber, const Entry& e,
+	const std::vector<std::pair<std::string, std::vector<std::string> > >&
+		specs)
+{
+	for (size_t i = 0; i < specs.size(); i++)
+	{
+		const std::vector<std::string>* dns =
+			FindAttribute(e.attrs, specs[i].first);
+
+		for (size_t j = 0; dns && j < dns->size(); j++)
+		{
+			std::map<std::string, Entry>::const_iterator target =
+				_entries.find(Normalize((*dns)[j]));
+
+			ber.StartSequence();
+			ber.AddOctetString(specs[i].first);
+			ber.AddOctetString((*dns)[j]);
+
+			if (target != _entries.end())
+			{
+				ber.StartSequence(0xa0);
+				for (size_t k = 0; k < specs[i].second.size(); k++)
+				{
+					const std::vector<std::string>* vals = FindAttribute(
+						target->second.attrs, specs[i].second[k]);
+
+					if (!vals)
+						continue;
+
+					ber.StartSequence();
+					ber.AddOctetString(specs[i].second[k]);
+					ber.StartSequence(0x31);
+					for (size_t l = 0; l < vals->size(); l++)
+						ber.AddOctetString((*vals)[l]);
+					ber.EndSequence();
+					ber.EndSequence();
+				}
+				ber.EndSequence();
+			}
+
+			ber.EndSequence();
+		}
+	}
+}
+
+const std::string* MockLDAPServer::FindControl(const Request& req,
+	const char* oid)
+{
+	for (size_t i = 0; i < req.controls.size(); i++)
+		if (req.controls[i].first == oid)
+			return &req.controls[i].second;
+
+	return 0;
+}
+
+bool MockLDAPServer::InScope(const Entry& e, const std::string& nbase,
+	int scope)
+{
+	if (scope == LDAP_SCOPE_BASE)
+		return e.ndn == nbase;
+
+	if (nbase.empty())
+		return scope == LDAP_SCOPE_SUBTREE ||
+			e.ndn.find(',') == std::string::npos;
+
+	if (e.ndn.length() <= nbase.length() + 1 ||
+			e.ndn.compare(e.ndn.length() - nbase.length(), nbase.length(),
+				nbase) != 0 ||
+			e.ndn[e.ndn.length() - nbase.length() - 1] != ',')
+		return scope == LDAP_SCOPE_SUBTREE && e.ndn == nbase;
+
+	if (scope == LDAP_SCOPE_ONELEVEL)
+		return e.ndn.find(',') == e.ndn.length() - nbase.length() - 1;
+
+	return true;
+}
+
+void MockLDAPServer::WriteResult(int fd, int msgid, unsigned char op,
+	int result, const std::string& diag, const ControlList* ctrls)
+{
+	LDAPBerWriter ber;
+
+	ber.StartSequence();
+	ber.AddInteger(msgid);
+	ber.StartSequence(op);
+	ber.AddInteger(result, 0x0a);
+	ber.AddOctetString("", 0);
+	ber.AddOctetString(diag);
+	ber.EndSequence();
+
+	if (ctrls && !ctrls->empty())
+	{
+		ber.StartSequence(0xa0);
+		for (size_t i = 0; i < ctrls->size(); i++)
+		{
+			ber.StartSequence();
+			ber.AddOctetString((*ctrls)[i].first);
+			ber.AddOctetString((*ctrls)[i].second);
+			ber.EndSequence();
+		}
+		ber.EndSequence();
+	}
+
+	ber.EndSequence();
+	WritePDU(fd, ber);
+}
+
+/**
+ * Normalize a DN for comparisons: lower case, no spaces after commas.
+ */
+std::string MockLDAPServer::Normalize(const std::string& dn)
+{
+	std::string ndn;
+
+	for (size_t i = 0; i < dn.length(); i++)
+	{
+		if (dn[i] == ' ' && i > 0 && dn[i - 1] == ',')
+			continue;
+		ndn.push_back(tolower(dn[i]));
+	}
+
+	return ndn;
+}
+}
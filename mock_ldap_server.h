@@ -0,0 +1,125 @@
+/*
+ * In-process LDAP server for tests and benchmarks. Serves entries from
+ * memory over a loopback TCP socket.
+ */
+
+#ifndef MOCK_LDAP_SERVER_H_
+#define MOCK_LDAP_SERVER_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include "ldap++.h"
+
+namespace testing
+{
+/*
+ * Answers simple binds, searches (with paged results, server side
+ * sorting, VLV, values return filters, dereferencing and ranged
+ * attribute retrieval), modify, add and delete from an in-memory
+ * directory, with one thread per connection. Latency and errors can be
+ * injected per operation so tests and benchmarks of the client are
+ * deterministic without an external server.
+ */
+class MockLDAPServer
+{
+    public:
+	typedef std::map<std::string, std::vector<std::string> > Attributes;
+
+	MockLDAPServer();
+	~MockLDAPServer();
+
+	void Start();
+	void Stop();
+	void DropConnections();
+	std::string GetURI() const;
+
+	void AddEntry(const std::string& dn, const Attributes& attrs);
+	void AddUser(const std::string& dn, const std::string& password);
+	bool HasEntry(const std::string& dn);
+	Attributes GetEntry(const std::string& dn);
+
+	void SetLatency(int op, long usec);
+	void SetError(int op, int result);
+	void SetMaxPageSize(int size);
+	void SetMaxValRange(size_t size);
+	void SetControlSupported(const std::string& oid, bool supported);
+
+	int GetRequestCount(int op);
+	int GetConnectionCount();
+	std::vector<std::string> GetLastControls();
+	std::vector<int> GetPageSizes();
+
+    private:
+	struct Entry
+	{
+		std::string dn;
+		std::string ndn;
+		Attributes attrs;
+	};
+
+	struct Request
+	{
+		int msgid;
+		unsigned char op;
+		struct berval body;
+		std::vector<std::pair<std::string, std::string> > controls;
+		std::set<std::string> critical;
+	};
+
+	const std::string* FindControl(const Request& req, const char* oid);
+
+	void AcceptLoop();
+	void Serve(int fd);
+	bool ReadPDU(int fd, std::string& buf);
+	bool WritePDU(int fd, const ldap_client::LDAPBerWriter& ber);
+	bool WriteAll(int fd, const char* data, size_t len);
+	void ParseRequest(const std::string& pdu, Request& req);
+	void Respond(int fd, Request& req);
+
+	void HandleBind(int fd, Request& req);
+	void HandleSearch(int fd, Request& req);
+	void HandleModify(int fd, Request& req);
+	void HandleAdd(int fd, Request& req);
+	void HandleDelete(int fd, Request& req);
+	void HandleExtended(int fd, Request& req);
+
+	bool Matches(const Entry& e, unsigned char tag,
+		const struct berval& contents);
+	void WriteDerefResults(ldap_client::LDAPBerWriter& ber, const Entry& e,
+		const std::vector<std::pair<std::string,
+			std::vector<std::string> > >& specs);
+	bool InScope(const Entry& e, const std::string& nbase, int scope);
+	void WriteResult(int fd, int msgid, unsigned char op, int result,
+		const std::string& diag = "",
+		const std::vector<std::pair<std::string, std::string> >* ctrls = 0);
+
+	static std::string Normalize(const std::string& dn);
+
+	int _listen_fd;
+	int _port;
+	std::atomic<bool> _running;
+	std::thread _acceptor;
+	std::vector<std::thread> _workers;
+	std::vector<int> _client_fds;
+
+	std::mutex _lock;
+	std::map<std::string, Entry> _entries;
+	std::map<std::string, std::string> _passwords;
+	std::map<int, long> _latency;
+	std::map<int, int> _errors;
+	std::map<int, int> _request_count;
+	std::vector<std::string> _last_controls;
+	std::vector<int> _page_sizes;
+	std::set<std::string> _supported;
+	int _max_page_size;
+	size_t _max_val_range;
+	int _connections;
+};
+}
+
+#endif /* MOCK_LDAP_SERVER_H_ */
@@ -0,0 +1,151 @@
+/*
+ * mock_ldap_server_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <string>
+#include <chrono>
+#include "ldap++.h"
+#include "mock_ldap_server.h"
+
+using namespace std;
+using ldap_client::LDAPConnection;
+using ldap_client::LDAPEntry;
+using ldap_client::LDAPResult;
+using ldap_client::LDAPSearchRequest;
+
+namespace testing {
+class MockLDAPServerTest : public CppUnit::TestCase {
+	CPPUNIT_TEST_SUITE(MockLDAPServerTest);
+	CPPUNIT_TEST(testBind);
+	CPPUNIT_TEST(testPagedSearch);
+	CPPUNIT_TEST(testWrites);
+	CPPUNIT_TEST(testInjection);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+	void tearDown();
+
+	void testBind();
+	void testPagedSearch();
+	void testWrites();
+	void testInjection();
+
+private:
+	MockLDAPServer* _server;
+};
+
+void
+MockLDAPServerTest::setUp()
+{
+	_server = new MockLDAPServer;
+	_server->Start();
+	_server->AddUser("uid=admin,dc=example,dc=com", "secret");
+
+	for (int i = 0; i < 25; i++)
+		_server->AddEntry("cn=user" + to_string(i) + ",dc=example,dc=com",
+			{{"cn", {"user" + to_string(i)}}, {"objectClass", {"person"}}});
+}
+
+void
+MockLDAPServerTest::tearDown()
+{
+	delete _server;
+}
+
+void
+MockLDAPServerTest::testBind()
+{
+	LDAPConnection conn(_server->GetURI());
+
+	conn.SimpleBind("uid=admin,dc=example,dc=com", "secret");
+	CPPUNIT_ASSERT_THROW(conn.SimpleBind("uid=admin,dc=example,dc=com",
+		"wrong"), ldap_client::LDAPException);
+	CPPUNIT_ASSERT_EQUAL(2, _server->GetRequestCount(LDAP_REQ_BIND));
+	CPPUNIT_ASSERT_EQUAL(1, _server->GetConnectionCount());
+}
+
+void
+MockLDAPServerTest::testPagedSearch()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("dc=example,dc=com", LDAP_SCOPE_SUBTREE,
+		"(cn=user1*)");
+	LDAPResult* res;
+
+	req.SetPageSize(4);
+	res = req.Execute(&conn);
+
+	// user1 and user10 to user19.
+	CPPUNIT_ASSERT_EQUAL((size_t) 11, res->GetEntries()->size());
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetRequestCount(LDAP_REQ_SEARCH));
+	delete res;
+}
+
+void
+MockLDAPServerTest::testWrites()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPEntry added(&conn, "cn=new,dc=example,dc=com");
+	LDAPResult* res;
+
+	added.AddValue("objectClass", "person");
+	added.AddValue("cn", "new");
+	added.Sync();
+	CPPUNIT_ASSERT(_server->HasEntry("cn=new, dc=example, dc=com"));
+
+	res = conn.Search("cn=user3,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)");
+	CPPUNIT_ASSERT_EQUAL((size_t) 1, res->GetEntries()->size());
+
+	LDAPEntry& entry = res->GetEntries()->front();
+	entry.AddValue("mail", "user3@example.com");
+	entry.Sync();
+	delete res;
+
+	CPPUNIT_ASSERT_EQUAL(string("user3@example.com"),
+		_server->GetEntry("cn=user3,dc=example,dc=com")["mail"][0]);
+}
+
+void
+MockLDAPServerTest::testInjection()
+{
+	LDAPConnection conn(_server->GetURI());
+	chrono::steady_clock::time_point start;
+	LDAPResult* res;
+
+	_server->SetLatency(LDAP_REQ_SEARCH, 50000);
+	start = chrono::steady_clock::now();
+	res = conn.Search("cn=user3,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)");
+	delete res;
+	CPPUNIT_ASSERT(chrono::steady_clock::now() - start >=
+		chrono::milliseconds(50));
+
+	_server->SetLatency(LDAP_REQ_SEARCH, 0);
+	_server->SetError(LDAP_REQ_SEARCH, LDAP_BUSY);
+	CPPUNIT_ASSERT_THROW(conn.Search("cn=user3,dc=example,dc=com",
+		LDAP_SCOPE_BASE, "(objectClass=*)"), ldap_client::LDAPException);
+
+	_server->SetError(LDAP_REQ_SEARCH, LDAP_SUCCESS);
+	res = conn.Search("cn=user3,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)");
+	CPPUNIT_ASSERT_EQUAL((size_t) 1, res->GetEntries()->size());
+	delete res;
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(MockLDAPServerTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
@@ -0,0 +1,55 @@
+/*
+ * Test fixture running every test against a fresh MockLDAPServer.
+ */
+
+#ifndef MOCK_SERVER_FIXTURE_H_
+#define MOCK_SERVER_FIXTURE_H_
+
+#include <cppunit/TestCase.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "mock_ldap_server.h"
+
+namespace testing
+{
+/*
+ * Starts the server before every test and stops it afterwards. Test
+ * cases which need entries override setUp() and add them after calling
+ * the one of this class.
+ */
+class MockServerFixture : public CppUnit::TestCase
+{
+    public:
+	MockServerFixture() : _server(0) {}
+
+	void setUp()
+	{
+		_server = new MockLDAPServer;
+		_server->Start();
+	}
+
+	void tearDown()
+	{
+		delete _server;
+		_server = 0;
+	}
+
+    protected:
+	/*
+	 * Whether the last request the server received carried the control.
+	 */
+	bool sent(const char* oid)
+	{
+		std::vector<std::string> ctrls = _server->GetLastControls();
+
+		return std::find(ctrls.begin(), ctrls.end(), std::string(oid)) !=
+			ctrls.end();
+	}
+
+	MockLDAPServer* _server;
+};
+}
+
+#endif /* MOCK_SERVER_FIXTURE_H_ */
@@ -0,0 +1,241 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <vector>
+#include <cstdio>
+#include "ldap++.h"
+#include <ldap.h>
+
+namespace ldap_client
+{
+/*
+ * Upper bounds of the exported histogram buckets in microseconds. The
+ * internal buckets are finer but don't fall on these values exactly, so
+ * each is counted under the first bound at or above its upper end.
+ */
+static const unsigned long long k_PrometheusBounds[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+/**
+ * Append a label value, escaped as required by the text format.
+ */
+static void PutLabel(std::string& out, const std::string& value)
+{
+	for (size_t i = 0; i < value.length(); i++)
+	{
+		if (value[i] == '\\')
+			out.append("\\\\");
+		else if (value[i] == '"')
+			out.append("\\\"");
+		else if (value[i] == '\n')
+			out.append("\\n");
+		else
+			out.push_back(value[i]);
+	}
+}
+
+static void PutHeader(std::string& out, const char* name, const char* type,
+	const char* help)
+{
+	out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+	out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+/**
+ * Append one sample, labelled with the server and optionally up to two
+ * more labels.
+ */
+static void PutSample(std::string& out, const char* name,
+	const std::string& server, const char* label, const std::string& value,
+	const char* label2, const std::string& value2, const char* sample)
+{
+	out.append(name).append("{server=\"");
+	PutLabel(out, server);
+	out.push_back('"');
+
+	if (label)
+	{
+		out.append(",").append(label).append("=\"");
+		PutLabel(out, value);
+		out.push_back('"');
+	}
+
+	if (label2)
+	{
+		out.append(",").append(label2).append("=\"");
+		PutLabel(out, value2);
+		out.push_back('"');
+	}
+
+	out.append("} ").append(sample).append("\n");
+}
+
+static void PutSample(std::string& out, const char* name,
+	const std::string& server, const char* label, const std::string& value,
+	const char* sample)
+{
+	PutSample(out, name, server, label, value, 0, "", sample);
+}
+
+static std::string Format(unsigned long long value)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%llu", value);
+	return buf;
+}
+
+static std::string Format(double value)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%.9g", value);
+	return buf;
+}
+
+/**
+ * Render the statistics of all servers (see LDAPGetStats()) in the
+ * Prometheus text exposition format (version 0.0.4), to be served from
+ * an existing metrics endpoint. Cache hit rates are left to the query,
+ * e.g. rate(ldap_bind_cache_hits_total[5m]) divided by the sum of hits
+ * and misses.
+ *
+ * @return The metrics as text.
+ */
+std::string LDAPRenderPrometheus()
+{
+	const size_t nbounds =
+		sizeof(k_PrometheusBounds) / sizeof(k_PrometheusBounds[0]);
+	std::vector<LDAPStatsSnapshot> snaps = LDAPGetStats();
+	std::string out;
+
+	PutHeader(out, "ldap_operation_duration_seconds", "histogram",
+		"Latency of LDAP operations.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		for (int op = 0; op < kLdapOpCount; op++)
+		{
+			const LDAPHistogramSnapshot& h = snaps[s].latency[op];
+			const std::string server = snaps[s].server;
+			const std::string prefix = std::string("\",op=\"") +
+				LDAPOperationName((LDAPOperation) op) + "\",le=\"";
+			unsigned long long count = 0;
+			size_t i = 0;
+
+			// A bucket is counted under the first bound it starts at or
+			// below, so latencies on a bound are counted under it. A
+			// bucket spanning a bound is counted there as a whole, so a
+			// bound may include latencies up to 1/kSubBuckets above it.
+			for (size_t b = 0; b < nbounds; b++)
+			{
+				for (; i < h.buckets.size() &&
+						LDAPLatencyHistogram::BucketLowerBound(i) <=
+							k_PrometheusBounds[b]; i++)
+					count += h.buckets[i];
+
+				out.append("ldap_operation_duration_seconds_bucket"
+					"{server=\"");
+				PutLabel(out, server);
+				out.append(prefix);
+				out.append(Format(k_PrometheusBounds[b] / 1e6));
+				out.append("\"} ").append(Format(count)).append("\n");
+			}
+
+			// The total is read separately from the buckets, so under
+			// concurrent updates it may lag behind them; the buckets
+			// have to stay cumulative, so count them instead.
+			for (; i < h.buckets.size(); i++)
+				count += h.buckets[i];
+
+			out.append("ldap_operation_duration_seconds_bucket{server=\"");
+			PutLabel(out, server);
+			out.append(prefix).append("+Inf\"} ");
+			out.append(Format(count)).append("\n");
+
+			PutSample(out, "ldap_operation_duration_seconds_sum", server,
+				"op", LDAPOperationName((LDAPOperation) op),
+				Format(h.sum / 1e6).c_str());
+			PutSample(out, "ldap_operation_duration_seconds_count", server,
+				"op", LDAPOperationName((LDAPOperation) op),
+				Format(count).c_str());
+		}
+
+	PutHeader(out, "ldap_wire_bytes_total", "counter",
+		"Bytes on the wire by operation, including TLS overhead.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		for (int op = 0; op < kLdapOpCount; op++)
+		{
+			const std::string name = LDAPOperationName((LDAPOperation) op);
+
+			PutSample(out, "ldap_wire_bytes_total", snaps[s].server, "op",
+				name, "direction", "in",
+				Format(snaps[s].io[op].bytes_in).c_str());
+			PutSample(out, "ldap_wire_bytes_total", snaps[s].server, "op",
+				name, "direction", "out",
+				Format(snaps[s].io[op].bytes_out).c_str());
+		}
+
+	PutHeader(out, "ldap_wire_calls_total", "counter",
+		"Read and write calls on the socket by operation.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		for (int op = 0; op < kLdapOpCount; op++)
+		{
+			const std::string name = LDAPOperationName((LDAPOperation) op);
+
+			PutSample(out, "ldap_wire_calls_total", snaps[s].server, "op",
+				name, "call", "read",
+				Format(snaps[s].io[op].reads).c_str());
+			PutSample(out, "ldap_wire_calls_total", snaps[s].server, "op",
+				name, "call", "write",
+				Format(snaps[s].io[op].writes).c_str());
+		}
+
+	PutHeader(out, "ldap_entries_total", "counter",
+		"Search result entries received.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		PutSample(out, "ldap_entries_total", snaps[s].server, 0, "",
+			Format(snaps[s].entries).c_str());
+
+	PutHeader(out, "ldap_pages_total", "counter",
+		"Pages of search results received.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		PutSample(out, "ldap_pages_total", snaps[s].server, 0, "",
+			Format(snaps[s].pages).c_str());
+
+	PutHeader(out, "ldap_errors_total", "counter",
+		"Failed operations by LDAP result code.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		for (auto iter = snaps[s].errors.begin();
+				iter != snaps[s].errors.end(); iter++)
+			PutSample(out, "ldap_errors_total", snaps[s].server, "code",
+				std::to_string(iter->first), Format(iter->second).c_str());
+
+	PutHeader(out, "ldap_connections", "gauge",
+		"Open connections, including bind verifier pools.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		PutSample(out, "ldap_connections", snaps[s].server, 0, "",
+			std::to_string(snaps[s].connections).c_str());
+
+	PutHeader(out, "ldap_operations_in_flight", "gauge",
+		"Operations waiting for a response.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		PutSample(out, "ldap_operations_in_flight", snaps[s].server, 0, "",
+			std::to_string(snaps[s].in_flight).c_str());
+
+	PutHeader(out, "ldap_bind_cache_hits_total", "counter",
+		"Bind verifications answered from the credential cache.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		PutSample(out, "ldap_bind_cache_hits_total", snaps[s].server, 0, "",
+			Format(snaps[s].cache_hits).c_str());
+
+	PutHeader(out, "ldap_bind_cache_misses_total", "counter",
+		"Bind verifications not found in the credential cache.");
+	for (size_t s = 0; s < snaps.size(); s++)
+		PutSample(out, "ldap_bind_cache_misses_total", snaps[s].server, 0,
+			"", Format(snaps[s].cache_misses).c_str());
+
+	return out;
+}
+}
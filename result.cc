@@ -3,6 +3,7 @@
 #endif
 #include <string>
 #include <vector>
+#include <chrono>
 #include "ldap++.h"
 #include <ldap.h>
 
@@ -20,17 +21,38 @@ LDAPResult::LDAPResult(LDAPConnection* conn, std::vector<LDAPMessage*> msgs)
 	std::vector<LDAPMessage*>::iterator iter;
 
 	for (iter = msgs.begin(); iter != msgs.end(); iter++)
-	{
-		LDAPMessage *e = ldap_first_entry(_conn->_ldap, *iter);
+		AddPage(*iter, std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(conn->_timeout), conn->_token);
+}
+
+/**
+ * Add the entries of a page of results and free the page.
+ *
+ * @param msg      LDAPMessage containing the retrieved data.
+ * @param deadline Point in time after which fetching the remaining
+ *                 ranges of ranged attributes is given up.
+ * @param token    Token to check for cancellation, or NULL.
+ */
+void LDAPResult::AddPage(LDAPMessage* msg, LDAPDeadline deadline,
+	const LDAPCancellationToken* token)
+{
+	LDAPMessage *e = ldap_first_entry(_conn->_ldap, msg);
 
+	try
+	{
 		if (e != NULL) do
 		{
-			_entries.push_back(LDAPEntry(_conn, e));
+			_entries.push_back(LDAPEntry(_conn, e, deadline, token));
 		}
 		while ((e = ldap_next_entry(_conn->_ldap, e)) != NULL);
-
-		ldap_msgfree(*iter);
 	}
+	catch (...)
+	{
+		ldap_msgfree(msg);
+		throw;
+	}
+
+	ldap_msgfree(msg);
 }
 
 /**
@@ -0,0 +1,123 @@
+/*
+ * Building the object model from search results: LDAPEntry construction,
+ * LDAPResult assembly and the accessors applications call on the result.
+ */
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "bench_util.h"
+
+using namespace ldap_bench;
+
+static const int k_Values = 4;
+static const int k_ValueLength = 24;
+
+static void BM_EntryConstruction(benchmark::State& state)
+{
+	MessageFactory factory;
+	LDAPMessage* res = factory.Search(std::vector<Entry>(1,
+		MakeEntry("cn=bench,dc=example,dc=com", state.range(0),
+			k_Values, k_ValueLength)));
+	LDAPMessage* e = ldap_first_entry(factory.GetLDAP(), res);
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+	{
+		ldap_client::LDAPEntry entry(factory.GetConnection(), e);
+		benchmark::DoNotOptimize(entry);
+	}
+
+	ldap_msgfree(res);
+}
+BENCHMARK(BM_EntryConstruction)->Arg(8)->Arg(64)->Arg(256);
+
+static void BM_ResultAssembly(benchmark::State& state)
+{
+	MessageFactory factory;
+	std::vector<Entry> entries;
+
+	for (int i = 0; i < state.range(0); i++)
+		entries.push_back(MakeEntry("cn=user" + std::to_string(i) +
+			",dc=example,dc=com", 8, k_Values, k_ValueLength));
+
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+	{
+		allocs.PauseTiming();
+		LDAPMessage* res = factory.Search(entries);
+		allocs.ResumeTiming();
+
+		// Takes ownership of res.
+		ldap_client::LDAPResult result(factory.GetConnection(),
+			std::vector<LDAPMessage*>(1, res));
+		benchmark::DoNotOptimize(result.GetEntries());
+	}
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ResultAssembly)->Arg(10)->Arg(100)->Arg(1000);
+
+static void BM_GetValue(benchmark::State& state)
+{
+	MessageFactory factory;
+	LDAPMessage* res = factory.Search(std::vector<Entry>(1,
+		MakeEntry("cn=bench,dc=example,dc=com", state.range(0),
+			k_Values, k_ValueLength)));
+	ldap_client::LDAPEntry entry(factory.GetConnection(),
+		ldap_first_entry(factory.GetLDAP(), res));
+	const std::string name = "attribute" + std::to_string(state.range(0) / 2);
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+	{
+		ldap_client::SearchableVector<std::string> values = entry.GetValue(name);
+		benchmark::DoNotOptimize(values);
+	}
+
+	ldap_msgfree(res);
+}
+BENCHMARK(BM_GetValue)->Arg(8)->Arg(64)->Arg(256);
+
+static void BM_GetFirstValue(benchmark::State& state)
+{
+	MessageFactory factory;
+	LDAPMessage* res = factory.Search(std::vector<Entry>(1,
+		MakeEntry("cn=bench,dc=example,dc=com", state.range(0),
+			k_Values, k_ValueLength)));
+	ldap_client::LDAPEntry entry(factory.GetConnection(),
+		ldap_first_entry(factory.GetLDAP(), res));
+	const std::string name = "attribute" + std::to_string(state.range(0) / 2);
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+	{
+		std::string value = entry.GetFirstValue(name);
+		benchmark::DoNotOptimize(value);
+	}
+
+	ldap_msgfree(res);
+}
+BENCHMARK(BM_GetFirstValue)->Arg(8)->Arg(64)->Arg(256);
+
+/*
+ * Membership checks, e.g. of a group's member attribute, looking for a
+ * value that isn't there.
+ */
+static void BM_Contains(benchmark::State& state)
+{
+	ldap_client::SearchableVector<std::string> values;
+	const std::string missing = "uid=missing,ou=people,dc=example,dc=com";
+
+	for (int i = 0; i < state.range(0); i++)
+		values.push_back("uid=user" + std::to_string(i) +
+			",ou=people,dc=example,dc=com");
+
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+		benchmark::DoNotOptimize(values.Contains(missing));
+
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Contains)->Arg(10)->Arg(1000)->Arg(100000);
@@ -0,0 +1,1138 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include "ldap++.h"
+#include "slow_query_log.h"
+#include "tracer.h"
+#include "ldap_compat.h"
+#include <ldap.h>
+#include <lber.h>
+
+namespace ldap_client
+{
+/**
+ * Convert a duration to a timeval, rounding up to whole seconds as some
+ * servers only accept time limits in seconds.
+ */
+static void SetTimeval(struct timeval* tv, LDAPTimePoint::duration d)
+{
+	long long us = std::chrono::duration_cast<std::chrono::microseconds>(
+			d).count();
+
+	tv->tv_sec = (us + 999999) / 1000000;
+	tv->tv_usec = 0;
+}
+
+/**
+ * Get the microseconds passed since the given time and move it to now.
+ */
+static long Lap(LDAPTimePoint* mark)
+{
+	LDAPTimePoint now = std::chrono::steady_clock::now();
+	long usec = std::chrono::duration_cast<std::chrono::microseconds>(
+			now - *mark).count();
+
+	*mark = now;
+	return usec;
+}
+
+/**
+ * Wait until the server starts sending a response, the deadline passes or
+ * the search is cancelled. The caller finds out which when it waits for
+ * the result.
+ */
+static void WaitReadable(LDAP* ld, LDAPDeadline deadline,
+	const LDAPCancellationToken* token)
+{
+	Sockbuf* sb = 0;
+	struct pollfd pfd;
+
+	// Data libldap has already buffered won't wake up poll().
+	ldap_get_option(ld, LDAP_OPT_SOCKBUF, &sb);
+	if (!sb || ber_sockbuf_ctrl(sb, LBER_SB_OPT_DATA_READY, 0) > 0)
+		return;
+	if (ldap_get_option(ld, LDAP_OPT_DESC, &pfd.fd) != LDAP_OPT_SUCCESS)
+		return;
+
+	pfd.events = POLLIN;
+	for (;;)
+	{
+		LDAPTimePoint now = std::chrono::steady_clock::now();
+		long long wait;
+
+		if (now >= deadline || (token && token->IsCancelled()))
+			return;
+
+		wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - now).count();
+		pfd.revents = 0;
+		if (poll(&pfd, 1, (int) std::min(wait + 1, 50LL)) != 0)
+			return;
+	}
+}
+
+/**
+ * Add up the times and sizes of all pages.
+ *
+ * @return Totals of the search.
+ */
+LDAPPageProfile LDAPSearchProfile::Total() const
+{
+	LDAPPageProfile total;
+
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		total.encode_usec += pages[i].encode_usec;
+		total.send_usec += pages[i].send_usec;
+		total.first_byte_usec += pages[i].first_byte_usec;
+		total.receive_usec += pages[i].receive_usec;
+		total.decode_usec += pages[i].decode_usec;
+		total.construct_usec += pages[i].construct_usec;
+		total.entries += pages[i].entries;
+		total.bytes += pages[i].bytes;
+		total.control_bytes += pages[i].control_bytes;
+		total.io.bytes_in += pages[i].io.bytes_in;
+		total.io.bytes_out += pages[i].io.bytes_out;
+		total.io.reads += pages[i].io.reads;
+		total.io.writes += pages[i].io.writes;
+	}
+
+	return total;
+}
+
+static void ReportLine(std::string& out, const char* label,
+	const LDAPPageProfile& p)
+{
+	char buf[200];
+
+	snprintf(buf, sizeof(buf),
+		"%-6s %8ld %10zu %10llu %6llu %6zu %8ld %8ld %10ld %8ld %8ld %9ld\n",
+		label, p.entries, p.bytes, p.io.bytes_in, p.io.reads,
+		p.control_bytes, p.encode_usec, p.send_usec, p.first_byte_usec,
+		p.receive_usec, p.decode_usec, p.construct_usec);
+	out.append(buf);
+}
+
+/**
+ * Format the profile as a table with one line per page and the totals.
+ * Times are in microseconds; "first byte" is the time the server took
+ * to start answering, the other times are spent in the client. "wire in"
+ * and "reads" are the bytes and read calls on the socket, including the
+ * protocol and TLS overhead.
+ *
+ * @return The table as text.
+ */
+std::string LDAPSearchProfile::Report() const
+{
+	std::string out;
+	char label[16];
+
+	out.append("page    entries      bytes    wire in  reads  ctrls   encode "
+		"    send first byte  receive   decode construct\n");
+
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		snprintf(label, sizeof(label), "%zu", i + 1);
+		ReportLine(out, label, pages[i]);
+	}
+
+	ReportLine(out, "total", Total());
+	return out;
+}
+
+/**
+ * Create a new search request. A timeout of 30 seconds is applied unless
+ * changed with SetTimeout.
+ *
+ * @param base   Search base to start looking from.
+ * @param scope  LDAP search scope (e.g. ONE, SUB, etc.)
+ * @param filter Filter string (e.g. attribute=value).
+ * @param attrs  Vector of attributes to fetch in the record.
+ */
+LDAPSearchRequest::LDAPSearchRequest(const std::string base, int scope,
+	const std::string filter, const std::vector<std::string> attrs)
+: _base(base), _scope(scope), _filter(filter), _types_only(false),
+	_page_size(0),
+	_size_limit(-1), _timeout(30000), _deadline(LDAPDeadline::max()),
+	_token(0), _profile(0), _adaptive(false), _min_page_size(0),
+	_max_page_size(0), _target_ms(0), _max_bytes(0),
+	_sort_result(LDAP_SUCCESS), _vlv(false), _vlv_before(0),
+	_vlv_after(0), _vlv_offset(0), _vlv_count(0), _vlv_position(0)
+{
+	_page_ctrl.ldctl_oid = (char*) LDAP_CONTROL_PAGEDRESULTS;
+	_page_ctrl.ldctl_iscritical = 0;
+	_page_ctrl.ldctl_value.bv_val = 0;
+	_page_ctrl.ldctl_value.bv_len = 0;
+
+	_sort_ctrl.ldctl_oid = (char*) LDAP_CONTROL_SORTREQUEST;
+	_sort_ctrl.ldctl_iscritical = 0;
+	_sort_ctrl.ldctl_value.bv_val = 0;
+	_sort_ctrl.ldctl_value.bv_len = 0;
+
+	_vlv_ctrl.ldctl_oid = (char*) LDAP_CONTROL_VLVREQUEST;
+	_vlv_ctrl.ldctl_iscritical = 1;
+	_vlv_ctrl.ldctl_value.bv_val = 0;
+	_vlv_ctrl.ldctl_value.bv_len = 0;
+
+	_mv_ctrl.ldctl_oid = (char*) LDAP_CONTROL_VALUESRETURNFILTER;
+	_mv_ctrl.ldctl_iscritical = 1;
+	_mv_ctrl.ldctl_value.bv_val = 0;
+	_mv_ctrl.ldctl_value.bv_len = 0;
+
+	_deref_ctrl.ldctl_oid = (char*) LDAP_CONTROL_X_DEREF;
+	_deref_ctrl.ldctl_iscritical = 1;
+	_deref_ctrl.ldctl_value.bv_val = 0;
+	_deref_ctrl.ldctl_value.bv_len = 0;
+
+	_proxy_ctrl.ldctl_oid = (char*) LDAP_CONTROL_PROXY_AUTHZ;
+	_proxy_ctrl.ldctl_iscritical = 1;
+	_proxy_ctrl.ldctl_value.bv_val = 0;
+	_proxy_ctrl.ldctl_value.bv_len = 0;
+
+	SetAttributes(attrs);
+}
+
+/**
+ * Change the search base for subsequent executions.
+ *
+ * @param base Search base to start looking from.
+ */
+void LDAPSearchRequest::SetBase(const std::string base)
+{
+	_base = base;
+	_vlv_context.clear();
+}
+
+/**
+ * Change the search scope for subsequent executions.
+ *
+ * @param scope LDAP search scope (e.g. ONE, SUB, etc.)
+ */
+void LDAPSearchRequest::SetScope(int scope)
+{
+	_scope = scope;
+	_vlv_context.clear();
+}
+
+/**
+ * Change the filter for subsequent executions.
+ *
+ * @param filter Filter string (e.g. attribute=value).
+ */
+void LDAPSearchRequest::SetFilter(const std::string filter)
+{
+	_filter = filter;
+	_vlv_context.clear();
+}
+
+/**
+ * Set the attributes to fetch in each record.
+ *
+ * @param attrs Vector of attribute names.
+ */
+void LDAPSearchRequest::SetAttributes(const std::vector<std::string> attrs)
+{
+	_attrs = attrs;
+	_attrlist.clear();
+
+	for (size_t i = 0; i < _attrs.size(); i++)
+		_attrlist.push_back(const_cast<char*>(_attrs[i].c_str()));
+
+	_attrlist.push_back(0);
+}
+
+/**
+ * Only return attribute names, without values.
+ *
+ * @param types_only Whether to omit attribute values.
+ */
+void LDAPSearchRequest::SetTypesOnly(bool types_only)
+{
+	_types_only = types_only;
+}
+
+/**
+ * Set a fixed number of records requested per page, disabling adaptive
+ * paging. If unset, the page size of the connection is used.
+ *
+ * @param size Number of records per page.
+ */
+void LDAPSearchRequest::SetPageSize(int size)
+{
+	_page_size = size;
+	_adaptive = false;
+}
+
+/**
+ * Adjust the page size after every page so that fetching a page takes
+ * about target_ms milliseconds and, if max_bytes is set, a page holds no
+ * more than max_bytes bytes of entries. Small pages waste round trips
+ * while large pages increase memory usage and server latency, so the
+ * page size grows while pages are cheap and shrinks when they are not.
+ *
+ * The tuned size is kept across executions of this request. Paging
+ * starts at the current page size, clamped to the given bounds.
+ *
+ * @param min_size  Smallest page size to use.
+ * @param max_size  Largest page size to use.
+ * @param target_ms Desired time per page in milliseconds.
+ * @param max_bytes Memory budget per page in bytes, or 0 for none.
+ * @throws LDAPErrParamError The bounds are invalid.
+ */
+void LDAPSearchRequest::SetAdaptivePaging(int min_size, int max_size,
+	long target_ms, size_t max_bytes)
+{
+	if (min_size < 1 || max_size < min_size || target_ms < 1)
+		throw LDAPErrParamError("Invalid adaptive paging parameters");
+
+	_adaptive = true;
+	_min_page_size = min_size;
+	_max_page_size = max_size;
+	_target_ms = target_ms;
+	_max_bytes = max_bytes;
+}
+
+/**
+ * Set the maximum number of records returned by the search, independent
+ * of the page size. If unset, the result size limit of the connection is
+ * used.
+ *
+ * @param limit Maximum number of records, or 0 for no limit.
+ */
+void LDAPSearchRequest::SetSizeLimit(int limit)
+{
+	_size_limit = limit;
+}
+
+/**
+ * Set the time to wait for each page of results.
+ *
+ * @param timeout Number of milliseconds to wait for an answer.
+ */
+void LDAPSearchRequest::SetTimeout(long timeout)
+{
+	_timeout = timeout;
+}
+
+/**
+ * Set a point in time by which the whole search must have completed,
+ * across all pages. The time allowed for each page is reduced to what
+ * remains; once the deadline passes, the outstanding page is abandoned
+ * and LDAPErrTimeout is thrown.
+ *
+ * @param deadline Point in time by which the search must be done.
+ */
+void LDAPSearchRequest::SetDeadline(LDAPDeadline deadline)
+{
+	_deadline = deadline;
+}
+
+/**
+ * Use the given token to cancel the search from another thread, instead
+ * of the token of the connection.
+ *
+ * @param token Token checked while waiting for results, or NULL. Must
+ *              outlive all executions of this request.
+ */
+void LDAPSearchRequest::SetCancellationToken(LDAPCancellationToken* token)
+{
+	_token = token;
+}
+
+/**
+ * Request the results to be sorted by the server (RFC 2891). Each page is
+ * returned in order, so sorted output can be processed as it arrives
+ * instead of sorting the complete result on the client. Pass an empty
+ * vector to disable sorting.
+ *
+ * If critical is set and the server does not support sorting, the search
+ * fails with LDAPErrUnavailableCriticalExtension. Otherwise the results
+ * are returned unsorted and GetSortResult() reports why.
+ *
+ * @param keys     Sort keys, most significant first.
+ * @param critical Whether the search must fail if it cannot be sorted.
+ */
+void LDAPSearchRequest::SetSortKeys(const std::vector<LDAPSortSpec> keys,
+	bool critical)
+{
+	_sort_value.Reset();
+	_sort_ctrl.ldctl_iscritical = critical;
+	_vlv_context.clear();
+
+	if (keys.empty())
+		return;
+
+	_sort_value.StartSequence();
+
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		_sort_value.StartSequence();
+		_sort_value.AddOctetString(keys[i].attribute);
+		if (!keys[i].rule.empty())
+			_sort_value.AddOctetString(keys[i].rule, 0x80);
+		if (keys[i].reverse)
+			_sort_value.AddBoolean(true, 0x81);
+		_sort_value.EndSequence();
+	}
+
+	_sort_value.EndSequence();
+	_sort_value.GetValue(&_sort_ctrl.ldctl_value);
+}
+
+/**
+ * Fetch a window of the sorted result by position using the virtual list
+ * view control, instead of paging through the result from the start.
+ * Requires sort keys to be set. The window consists of before entries
+ * preceding the target, the target itself and after entries following it.
+ *
+ * The context ID returned by the server is kept and sent with subsequent
+ * executions of this request, so scrolling through the same result set
+ * lets the server reuse it.
+ *
+ * @param offset        Position of the target entry, starting at 1.
+ * @param before        Number of entries to return before the target.
+ * @param after         Number of entries to return after the target.
+ * @param content_count Client's estimate of the result size, or 0 to use
+ *                      the server's.
+ * @throws LDAPErrParamError The offset is below 1 or a count is negative.
+ */
+void LDAPSearchRequest::SetVLVOffset(int offset, int before, int after,
+	int content_count)
+{
+	if (offset < 1 || before < 0 || after < 0 || content_count < 0)
+		throw LDAPErrParamError("Invalid virtual list view window");
+
+	_vlv = true;
+	_vlv_offset = offset;
+	_vlv_count = content_count;
+	_vlv_target.clear();
+	_vlv_before = before;
+	_vlv_after = after;
+}
+
+/**
+ * Fetch a window of the sorted result around the first entry whose
+ * primary sort key is greater than or equal to value, e.g. to jump to
+ * the names starting with a given prefix. See SetVLVOffset.
+ *
+ * @param value  Value to compare the primary sort key with.
+ * @param before Number of entries to return before the target.
+ * @param after  Number of entries to return after the target.
+ * @throws LDAPErrParamError A count is negative.
+ */
+void LDAPSearchRequest::SetVLVTarget(const std::string value, int before,
+	int after)
+{
+	if (before < 0 || after < 0)
+		throw LDAPErrParamError("Invalid virtual list view window");
+
+	_vlv = true;
+	_vlv_offset = 0;
+	_vlv_count = 0;
+	_vlv_target = value;
+	_vlv_before = before;
+	_vlv_after = after;
+}
+
+/**
+ * Stop using the virtual list view and return to paged searches.
+ */
+void LDAPSearchRequest::ClearVLV()
+{
+	_vlv = false;
+	_vlv_context.clear();
+}
+
+/**
+ * Only return the attribute values matching the given values return
+ * filter (RFC 3876), e.g. "((member=cn=a*))" to fetch just the matching
+ * members of a large group. Attributes without matching values are
+ * returned without values. The filter is encoded once, here. Pass an
+ * empty string to return all values again.
+ *
+ * If critical is set and the server does not support the control, the
+ * search fails with LDAPErrUnavailableCriticalExtension instead of
+ * silently returning all values.
+ *
+ * @param filter   Values return filter: a parenthesized list of simple
+ *                 filter items.
+ * @param critical Whether the search must fail if the server cannot
+ *                 filter the values.
+ * @throws LDAPErrFilterError The filter could not be parsed.
+ */
+void LDAPSearchRequest::SetMatchedValues(const std::string filter,
+	bool critical)
+{
+	BerElement* ber;
+	struct berval bv;
+
+	_mv_value.clear();
+	_mv_ctrl.ldctl_iscritical = critical;
+	_mv_ctrl.ldctl_value.bv_val = 0;
+	_mv_ctrl.ldctl_value.bv_len = 0;
+
+	if (filter.empty())
+		return;
+
+	ber = ber_alloc_t(LBER_USE_DER);
+	if (!ber)
+		throw LDAPErrNoMemory("Unable to allocate BER element");
+
+	if (ldap_put_vrFilter(ber, filter.c_str()) == -1 ||
+			ber_flatten2(ber, &bv, 0) == -1)
+	{
+		ber_free(ber, 1);
+		throw LDAPErrFilterError("Invalid values return filter");
+	}
+
+	_mv_value.assign(bv.bv_val, bv.bv_len);
+	ber_free(ber, 1);
+
+	_mv_ctrl.ldctl_value.bv_val = &_mv_value[0];
+	_mv_ctrl.ldctl_value.bv_len = _mv_value.length();
+}
+
+/**
+ * Ask the server to return selected attributes of the entries referenced
+ * by DN-valued attributes along with each entry, using the dereference
+ * control implemented by slapd's deref overlay. This fetches e.g. a group
+ * and the mail addresses of its members in a single search instead of
+ * one search per member. The referenced entries are available through
+ * LDAPEntry::GetDereferenced. Pass an empty vector to disable.
+ *
+ * @param specs    DN-valued attributes and the attributes to fetch from
+ *                 the entries they reference.
+ * @param critical Whether the search must fail if the server does not
+ *                 support dereferencing.
+ */
+void LDAPSearchRequest::SetDereference(const std::vector<LDAPDerefSpec> specs,
+	bool critical)
+{
+	_deref_value.Reset();
+	_deref_ctrl.ldctl_iscritical = critical;
+
+	if (specs.empty())
+		return;
+
+	_deref_value.StartSequence();
+
+	for (size_t i = 0; i < specs.size(); i++)
+	{
+		_deref_value.StartSequence();
+		_deref_value.AddOctetString(specs[i].attribute);
+		_deref_value.StartSequence();
+		for (size_t j = 0; j < specs[i].attributes.size(); j++)
+			_deref_value.AddOctetString(specs[i].attributes[j]);
+		_deref_value.EndSequence();
+		_deref_value.EndSequence();
+	}
+
+	_deref_value.EndSequence();
+	_deref_value.GetValue(&_deref_ctrl.ldctl_value);
+}
+
+/**
+ * Execute the search on behalf of another user with the proxied
+ * authorization control (RFC 4370), so access controls for that user
+ * apply while the connection stays bound as a service account. The
+ * control is always critical. Pass an empty string to search as the
+ * bound identity again.
+ *
+ * @param authzid Authorization identity, e.g. "dn:uid=jdoe,dc=example"
+ *                or "u:jdoe".
+ */
+void LDAPSearchRequest::SetProxiedAuthorization(const std::string authzid)
+{
+	_authzid = authzid;
+	_proxy_ctrl.ldctl_value.bv_val = const_cast<char*>(_authzid.data());
+	_proxy_ctrl.ldctl_value.bv_len = _authzid.length();
+}
+
+/**
+ * Record where the time of each page goes in the given profile, which is
+ * cleared whenever the search is executed. Waiting for the first byte of
+ * each response costs an extra poll() per page.
+ *
+ * @param profile The profile to fill in, or NULL to stop profiling.
+ */
+void LDAPSearchRequest::SetProfile(LDAPSearchProfile* profile)
+{
+	_profile = profile;
+}
+
+/**
+ * Get the page size of the request. With adaptive paging this is the size
+ * that will be used for the next page.
+ */
+int LDAPSearchRequest::GetPageSize() const
+{
+	return _page_size;
+}
+
+/**
+ * Get the outcome of sorting the most recent execution. This is
+ * LDAP_SUCCESS if the results were sorted or no sorting was requested,
+ * LDAP_UNAVAILABLE_CRITICAL_EXTENSION if the server ignored the non-critical
+ * sort control, or the error code the server reported for the sort.
+ */
+int LDAPSearchRequest::GetSortResult() const
+{
+	return _sort_result;
+}
+
+/**
+ * Get the position of the target entry in the result set, as reported by
+ * the server for the most recent virtual list view search.
+ */
+int LDAPSearchRequest::GetVLVTargetPosition() const
+{
+	return _vlv_position;
+}
+
+/**
+ * Get the server's estimate of the size of the result set, as reported
+ * for the most recent virtual list view search. Useful for sizing a
+ * scroll bar and as content_count for SetVLVOffset.
+ */
+int LDAPSearchRequest::GetVLVContentCount() const
+{
+	return _vlv_count;
+}
+
+/**
+ * Execute the search and collect all results. The entries of each page
+ * are built as soon as it arrives, so only one page of raw results is
+ * held at a time.
+ *
+ * @param conn The connection to search over.
+ * @return LDAPResult object containing all LDAP results returned by
+ *         the query.
+ * @throws LDAPException An error occurred processing the search query.
+ */
+LDAPResult* LDAPSearchRequest::Execute(LDAPConnection* conn)
+{
+	LDAPResult* result = new LDAPResult(conn, std::vector<LDAPMessage*>());
+
+	try
+	{
+		Run(conn, [this, conn, result](LDAPMessage* msg) {
+			// Ranged attributes are fetched under the same limits as a page.
+			result->AddPage(msg, std::min(_deadline,
+					std::chrono::steady_clock::now() +
+					std::chrono::milliseconds(_timeout)),
+				_token ? _token : conn->_token);
+			return true;
+		});
+	}
+	catch (...)
+	{
+		delete result;
+		throw;
+	}
+
+	return result;
+}
+
+/**
+ * Execute the search and pass each entry to the handler as it arrives.
+ * Every page is freed once all of its entries have been handled.
+ *
+ * @param conn    The connection to search over.
+ * @param handler Called for every entry; return false to stop the search.
+ * @throws LDAPException An error occurred processing the search query.
+ */
+void LDAPSearchRequest::Execute(LDAPConnection* conn, LDAPEntryHandler handler)
+{
+	Run(conn, [conn, &handler](LDAPMessage* msg) {
+		bool more = true;
+
+		try
+		{
+			for (LDAPMessage* e = ldap_first_entry(conn->_ldap, msg);
+					e != NULL && more; e = ldap_next_entry(conn->_ldap, e))
+				more = handler(e);
+		}
+		catch (...)
+		{
+			ldap_msgfree(msg);
+			throw;
+		}
+
+		ldap_msgfree(msg);
+		return more;
+	});
+}
+
+/**
+ * Run the search, recording its latency and, if it exceeds the
+ * thresholds of the installed slow query log, its details.
+ *
+ * @param conn The connection to search over.
+ * @param page Called for every page; return false to stop paging.
+ * @throws LDAPException An error occurred processing the search query.
+ */
+void LDAPSearchRequest::Run(LDAPConnection* conn,
+	std::function<bool(LDAPMessage*)> page)
+{
+	LDAPSlowQueryScope slow(conn->_ldap, conn->_stats, kLdapOpSearch, _base,
+		_scope, &_filter, &_attrs);
+	LDAPTimePoint begin = std::chrono::steady_clock::now();
+	LDAPIOCounters io = conn->_wire.Get();
+
+	if (_profile)
+		_profile->pages.clear();
+
+	try
+	{
+		RunPages(conn, page, slow);
+	}
+	catch (...)
+	{
+		conn->_stats->AddIO(kLdapOpSearch, conn->_wire.Get() - io);
+		throw;
+	}
+
+	conn->_stats->Record(kLdapOpSearch, begin);
+	conn->_stats->AddIO(kLdapOpSearch, conn->_wire.Get() - io);
+	slow.End(LDAP_SUCCESS);
+}
+
+/**
+ * Run the paged search and hand every page to the given callback as soon
+ * as it has been received. The callback takes ownership of the message.
+ * If the callback stops the search early, the paging state on the server
+ * is released by sending a request for a page of size 0.
+ *
+ * Each page is given the per-page timeout or whatever remains until the
+ * deadline, whichever is shorter, and is abandoned if the deadline
+ * passes or the search is cancelled while waiting for it.
+ *
+ * @param conn The connection to search over.
+ * @param page Called for every page; return false to stop paging.
+ * @param slow Collects the pages, entries and bytes for the slow query
+ *             log.
+ * @throws LDAPErrTimeout The deadline passed.
+ * @throws LDAPErrUserCancelled The search was cancelled.
+ * @throws LDAPException An error occurred processing the search query.
+ */
+void LDAPSearchRequest::RunPages(LDAPConnection* conn,
+	std::function<bool(LDAPMessage*)> page, LDAPSlowQueryScope& slow)
+{
+	int size = _page_size > 0 ? _page_size : conn->_page_size;
+	int limit = _size_limit >= 0 ? _size_limit : conn->_size_limit;
+	const LDAPCancellationToken* token = _token ? _token : conn->_token;
+	LDAPServerStats* stats = conn->_stats;
+	LDAPPageProfile* prof = 0;
+	int received = 0, request, n;
+	LDAPTimePoint start, mark;
+	LDAPDeadline deadline;
+	LDAPControl** returned;
+	LDAPMessage* msg;
+	timeval tv;
+	int rc, errcode, msgid;
+	size_t bytes;
+	bool more, keep;
+
+	if (_vlv && _sort_value.Length() == 0)
+		throw LDAPErrParamError("Virtual list view requires sort keys");
+	if (!_vlv && size < 1)
+		throw LDAPErrParamError("Invalid page size");
+
+	if (_adaptive)
+	{
+		size = std::min(std::max(size, _min_page_size), _max_page_size);
+		_page_size = size;
+	}
+
+	// Paged results cannot be combined with the virtual list view.
+	_ctrls.clear();
+	if (!_vlv)
+		_ctrls.push_back(&_page_ctrl);
+	if (_sort_value.Length() > 0)
+		_ctrls.push_back(&_sort_ctrl);
+	if (_vlv)
+		_ctrls.push_back(&_vlv_ctrl);
+	if (!_mv_value.empty())
+		_ctrls.push_back(&_mv_ctrl);
+	if (_deref_value.Length() > 0)
+		_ctrls.push_back(&_deref_ctrl);
+	if (!_authzid.empty())
+		_ctrls.push_back(&_proxy_ctrl);
+	_ctrls.push_back(0);
+
+	_cookie.clear();
+	_sort_result = LDAP_SUCCESS;
+
+	do
+	{
+		LDAPTraceScope trace(conn->_ldap, stats, kLdapOpSearchPage, _base,
+			_scope, &_filter);
+
+		request = size;
+		if (limit > 0)
+			request = std::min(request, limit - received);
+
+		if (_profile)
+		{
+			_profile->pages.push_back(LDAPPageProfile());
+			prof = &_profile->pages.back();
+			prof->io = conn->_wire.Get();
+			mark = std::chrono::steady_clock::now();
+		}
+
+		if (_vlv)
+			EncodeVLVControl();
+		else
+			EncodePageControl(request);
+
+		if (prof)
+		{
+			prof->encode_usec = Lap(&mark);
+			for (size_t i = 0; _ctrls[i]; i++)
+				prof->control_bytes += strlen(_ctrls[i]->ldctl_oid) +
+					_ctrls[i]->ldctl_value.bv_len;
+		}
+
+		start = std::chrono::steady_clock::now();
+		deadline = std::min(_deadline,
+			start + std::chrono::milliseconds(_timeout));
+
+		if (token && token->IsCancelled())
+		{
+			rc = LDAP_USER_CANCELLED;
+			ldap_set_option(conn->_ldap, LDAP_OPT_RESULT_CODE, &rc);
+			stats->AddError(rc);
+			throw LDAPErrUserCancelled("Operation cancelled");
+		}
+		if (start >= deadline)
+		{
+			rc = LDAP_TIMEOUT;
+			ldap_set_option(conn->_ldap, LDAP_OPT_RESULT_CODE, &rc);
+			stats->AddError(rc);
+			throw LDAPErrTimeout("Deadline exceeded");
+		}
+
+		// Also sent to the server as the time limit for this page.
+		SetTimeval(&tv, deadline - start);
+
+		rc = ldap_search_ext(conn->_ldap, _base.c_str(), _scope,
+				_filter.c_str(), &_attrlist[0], _types_only, &_ctrls[0], 0,
+				&tv, limit > 0 ? limit : 0, &msgid);
+		if (rc)
+		{
+			stats->AddError(rc);
+			LDAPErrCode2Exception(conn->_ldap, rc);
+		}
+
+		trace.SetMessageID(msgid);
+		if (prof)
+		{
+			prof->send_usec = Lap(&mark);
+			WaitReadable(conn->_ldap, deadline, token);
+			prof->first_byte_usec = Lap(&mark);
+		}
+
+		msg = conn->WaitForResult(msgid, deadline, token);
+		if (prof)
+			prof->receive_usec = Lap(&mark);
+		stats->Record(kLdapOpSearchPage, start);
+		stats->AddPage();
+
+		returned = 0;
+		rc = ldap_parse_result(conn->_ldap, msg, &errcode, 0, 0, 0,
+				&returned, 0);
+		if (rc == LDAP_SUCCESS)
+			rc = errcode;
+
+		if (rc && rc != LDAP_PARTIAL_RESULTS &&
+			rc != LDAP_ADMINLIMIT_EXCEEDED &&
+			rc != LDAP_SIZELIMIT_EXCEEDED)
+		{
+			if (returned)
+				ldap_controls_free(returned);
+			ldap_msgfree(msg);
+			stats->AddError(rc);
+			LDAPErrCode2Exception(conn->_ldap, rc);
+		}
+
+		try
+		{
+			more = !_vlv && ParsePageResponse(returned);
+			if (_sort_value.Length() > 0)
+				ParseSortResponse(returned);
+			if (_vlv)
+				ParseVLVResponse(conn->_ldap, returned);
+			if (_adaptive && !_vlv)
+			{
+				AdaptPageSize(conn->_ldap, msg,
+					std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now() - start).count());
+				size = _page_size;
+			}
+		}
+		catch (...)
+		{
+			ldap_controls_free(returned);
+			ldap_msgfree(msg);
+			throw;
+		}
+
+		ldap_controls_free(returned);
+		n = ldap_count_entries(conn->_ldap, msg);
+		received += n;
+		stats->AddEntries(n);
+		trace.AddEntries(msg);
+		trace.End(rc);
+
+		bytes = 0;
+		if (slow.CountsBytes() || prof)
+			bytes = LDAPEntryDecoder::PageBytes(conn->_ldap, msg);
+		slow.AddPage(n, bytes);
+
+		if (prof)
+		{
+			prof->bytes = bytes;
+			prof->entries = n;
+			prof->io = conn->_wire.Get() - prof->io;
+			prof->decode_usec = Lap(&mark);
+		}
+
+		keep = page(msg);
+		if (prof)
+			prof->construct_usec = Lap(&mark);
+
+		if (!keep || (limit > 0 && received >= limit))
+		{
+			if (more)
+				ReleaseCookie(conn, token);
+
+			break;
+		}
+	}
+	while (more);
+}
+
+/**
+ * Release the paging state on the server after the search was stopped
+ * early, by requesting a page of size 0. This is bounded by the deadline,
+ * timeout and cancellation token of the search like any other page, but
+ * a failure is not an error: the caller already has all the results it
+ * wanted, and the server discards the state eventually anyway.
+ *
+ * @param conn  The connection the search ran over.
+ * @param token Token to check for cancellation, or NULL.
+ */
+void LDAPSearchRequest::ReleaseCookie(LDAPConnection* conn,
+	const LDAPCancellationToken* token)
+{
+	LDAPTimePoint start = std::chrono::steady_clock::now();
+	LDAPDeadline deadline = std::min(_deadline,
+		start + std::chrono::milliseconds(_timeout));
+	timeval tv;
+	int rc, msgid;
+
+	if ((token && token->IsCancelled()) || start >= deadline)
+		return;
+
+	EncodePageControl(0);
+	SetTimeval(&tv, deadline - start);
+
+	rc = ldap_search_ext(conn->_ldap, _base.c_str(), _scope,
+			_filter.c_str(), &_attrlist[0], _types_only, &_ctrls[0], 0,
+			&tv, 0, &msgid);
+	if (rc)
+	{
+		conn->_stats->AddError(rc);
+		return;
+	}
+
+	try
+	{
+		ldap_msgfree(conn->WaitForResult(msgid, deadline, token));
+	}
+	catch (LDAPErrTimeout&)
+	{
+		// Already abandoned by WaitForResult.
+	}
+	catch (LDAPErrUserCancelled&)
+	{
+	}
+	catch (LDAPException&)
+	{
+		ldap_abandon_ext(conn->_ldap, msgid, 0, 0);
+	}
+}
+
+/**
+ * Compute the size of the next page from the time the given page took
+ * and the number of bytes its entries occupy. The page size changes by
+ * at most a factor of 2 up or 4 down per page to damp noise.
+ *
+ * @param ld         LDAP handle the page was received on.
+ * @param msg        The page of results.
+ * @param elapsed_us Time taken to fetch the page in microseconds.
+ */
+void LDAPSearchRequest::AdaptPageSize(LDAP* ld, LDAPMessage* msg,
+	long elapsed_us)
+{
+	int n = ldap_count_entries(ld, msg);
+	double ideal = _page_size * 2.0;
+
+	// A page without entries tells us nothing about their cost.
+	if (n <= 0)
+		return;
+
+	if (elapsed_us > 0)
+		ideal = std::min(ideal, n * _target_ms * 1000.0 / elapsed_us);
+
+	if (_max_bytes > 0)
+	{
+		size_t bytes = LDAPEntryDecoder::PageBytes(ld, msg);
+
+		if (bytes > 0)
+			ideal = std::min(ideal, (double) _max_bytes * n / bytes);
+	}
+
+	ideal = std::max(ideal, _page_size / 4.0);
+	_page_size = std::min(std::max((int) ideal, _min_page_size),
+		_max_page_size);
+}
+
+/**
+ * Encode the paged results control value (RFC 2696) for the next page
+ * from the current cookie.
+ *
+ * @param size Number of records to request.
+ */
+void LDAPSearchRequest::EncodePageControl(int size)
+{
+	_page_value.Reset();
+	_page_value.StartSequence();
+	_page_value.AddInteger(size);
+	_page_value.AddOctetString(_cookie);
+	_page_value.EndSequence();
+	_page_value.GetValue(&_page_ctrl.ldctl_value);
+}
+
+/**
+ * Extract the cookie from the paged results response control.
+ *
+ * @param ctrls Controls returned with the search result.
+ * @return true if the server has more pages to return.
+ * @throws LDAPErrDecodingError The control value is malformed.
+ */
+bool LDAPSearchRequest::ParsePageResponse(LDAPControl** ctrls)
+{
+	LDAPControl* ctrl = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, ctrls,
+			0);
+	struct berval cookie;
+
+	if (!ctrl)
+	{
+		_cookie.clear();
+		return false;
+	}
+
+	LDAPBerReader reader(ctrl->ldctl_value);
+	LDAPBerReader value = reader.ReadSequence();
+
+	// Result set size estimate, which we don't use.
+	value.ReadInteger();
+	value.ReadOctetString(&cookie);
+
+	_cookie.assign(cookie.bv_val, cookie.bv_len);
+	return !_cookie.empty();
+}
+
+/**
+ * Record the result of the server side sort from the sort response
+ * control.
+ *
+ * @param ctrls Controls returned with the search result.
+ * @throws LDAPErrDecodingError The control value is malformed.
+ */
+void LDAPSearchRequest::ParseSortResponse(LDAPControl** ctrls)
+{
+	LDAPControl* ctrl = ldap_control_find(LDAP_CONTROL_SORTRESPONSE, ctrls,
+			0);
+
+	if (!ctrl)
+	{
+		_sort_result = LDAP_UNAVAILABLE_CRITICAL_EXTENSION;
+		return;
+	}
+
+	LDAPBerReader reader(ctrl->ldctl_value);
+	LDAPBerReader value = reader.ReadSequence();
+
+	_sort_result = value.ReadInteger(0x0a);
+}
+
+/**
+ * Encode the virtual list view control value (draft-ietf-ldapext-ldapv3-vlv)
+ * for the configured window and the current context ID.
+ */
+void LDAPSearchRequest::EncodeVLVControl()
+{
+	_vlv_value.Reset();
+	_vlv_value.StartSequence();
+	_vlv_value.AddInteger(_vlv_before);
+	_vlv_value.AddInteger(_vlv_after);
+
+	if (_vlv_offset > 0)
+	{
+		_vlv_value.StartSequence(0xa0);
+		_vlv_value.AddInteger(_vlv_offset);
+		_vlv_value.AddInteger(_vlv_count);
+		_vlv_value.EndSequence();
+	}
+	else
+		_vlv_value.AddOctetString(_vlv_target, 0x81);
+
+	if (!_vlv_context.empty())
+		_vlv_value.AddOctetString(_vlv_context);
+
+	_vlv_value.EndSequence();
+	_vlv_value.GetValue(&_vlv_ctrl.ldctl_value);
+}
+
+/**
+ * Record the position, content count and context ID from the virtual
+ * list view response control.
+ *
+ * @param ld    LDAP handle used to report errors.
+ * @param ctrls Controls returned with the search result.
+ * @throws LDAPException The server could not return the requested window.
+ * @throws LDAPErrControlNotFound The server did not return the control.
+ */
+void LDAPSearchRequest::ParseVLVResponse(LDAP* ld, LDAPControl** ctrls)
+{
+	LDAPControl* ctrl = ldap_control_find(LDAP_CONTROL_VLVRESPONSE, ctrls, 0);
+	int result;
+
+	if (!ctrl)
+		throw LDAPErrControlNotFound("No virtual list view response");
+
+	LDAPBerReader reader(ctrl->ldctl_value);
+	LDAPBerReader value = reader.ReadSequence();
+
+	_vlv_position = value.ReadInteger();
+	_vlv_count = value.ReadInteger();
+	result = value.ReadInteger(0x0a);
+
+	if (!value.AtEnd())
+		_vlv_context = value.ReadString();
+	else
+		_vlv_context.clear();
+
+	LDAPErrCode2Exception(ld, result);
+}
+}
@@ -0,0 +1,430 @@
+/*
+ * search_request_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "ldap++.h"
+#include "mock_server_fixture.h"
+
+using namespace std;
+using ldap_client::LDAPConnection;
+using ldap_client::LDAPEntry;
+using ldap_client::LDAPResult;
+using ldap_client::LDAPSearchRequest;
+using ldap_client::LDAPSortSpec;
+
+namespace testing {
+/*
+ * Adds up the entries and bytes of all traced search pages.
+ */
+class PageTracer : public ldap_client::LDAPTracer
+{
+    public:
+	PageTracer() : entries(0), bytes(0) {}
+
+	void OnStart(ldap_client::LDAPTraceEvent&) {}
+	void OnEnd(ldap_client::LDAPTraceEvent& event)
+	{
+		if (event.op != ldap_client::kLdapOpSearchPage)
+			return;
+		entries += event.entries;
+		bytes += event.bytes;
+	}
+
+	long entries;
+	size_t bytes;
+};
+
+class SearchRequestTest : public MockServerFixture {
+	CPPUNIT_TEST_SUITE(SearchRequestTest);
+	CPPUNIT_TEST(testVLV);
+	CPPUNIT_TEST(testMatchedValues);
+	CPPUNIT_TEST(testCountExists);
+	CPPUNIT_TEST(testProxiedAuthorization);
+	CPPUNIT_TEST(testPageSize);
+	CPPUNIT_TEST(testStopEarly);
+	CPPUNIT_TEST(testStopBeforeStart);
+	CPPUNIT_TEST(testTraceBytes);
+	CPPUNIT_TEST(testAdaptivePaging);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void setUp();
+
+	void testVLV();
+	void testMatchedValues();
+	void testCountExists();
+	void testProxiedAuthorization();
+	void testPageSize();
+	void testStopEarly();
+	void testStopBeforeStart();
+	void testTraceBytes();
+	void testAdaptivePaging();
+
+private:
+	vector<string> names(LDAPResult* res);
+};
+
+void
+SearchRequestTest::setUp()
+{
+	MockServerFixture::setUp();
+	for (int i = 0; i < 25; i++)
+		_server->AddEntry("cn=user" + to_string(i) + ",dc=example,dc=com",
+			{{"cn", {"user" + to_string(i)}}, {"objectClass", {"person"}}});
+}
+
+vector<string>
+SearchRequestTest::names(LDAPResult* res)
+{
+	vector<string> rv;
+
+	for (size_t i = 0; i < res->GetEntries()->size(); i++)
+		rv.push_back((*res->GetEntries())[i].GetFirstValue("cn"));
+	return rv;
+}
+
+void
+SearchRequestTest::testVLV()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("dc=example,dc=com", LDAP_SCOPE_ONELEVEL,
+		"(objectClass=person)", {"cn"});
+	LDAPResult* res;
+	vector<string> got;
+
+	// Sorted by cn: user0, user1, user10 ... user19, user2, user20 ...
+	req.SetSortKeys({LDAPSortSpec("cn")});
+	req.SetVLVOffset(3, 1, 1);
+	res = req.Execute(&conn);
+	got = names(res);
+	delete res;
+
+	CPPUNIT_ASSERT(sent(LDAP_CONTROL_VLVREQUEST));
+	CPPUNIT_ASSERT(sent(LDAP_CONTROL_SORTREQUEST));
+	CPPUNIT_ASSERT(!sent(LDAP_CONTROL_PAGEDRESULTS));
+	CPPUNIT_ASSERT_EQUAL((size_t) 3, got.size());
+	CPPUNIT_ASSERT_EQUAL(string("user1"), got[0]);
+	CPPUNIT_ASSERT_EQUAL(string("user10"), got[1]);
+	CPPUNIT_ASSERT_EQUAL(string("user11"), got[2]);
+	CPPUNIT_ASSERT_EQUAL(3, req.GetVLVTargetPosition());
+	CPPUNIT_ASSERT_EQUAL(25, req.GetVLVContentCount());
+	CPPUNIT_ASSERT_EQUAL(LDAP_SUCCESS, req.GetSortResult());
+
+	req.SetVLVTarget("user2", 0, 1);
+	res = req.Execute(&conn);
+	got = names(res);
+	delete res;
+
+	CPPUNIT_ASSERT_EQUAL((size_t) 2, got.size());
+	CPPUNIT_ASSERT_EQUAL(string("user2"), got[0]);
+	CPPUNIT_ASSERT_EQUAL(string("user20"), got[1]);
+	CPPUNIT_ASSERT_EQUAL(13, req.GetVLVTargetPosition());
+
+	// Positions start at 1 and windows can't be negative.
+	CPPUNIT_ASSERT_THROW(req.SetVLVOffset(0, 0, 1),
+		ldap_client::LDAPErrParamError);
+	CPPUNIT_ASSERT_THROW(req.SetVLVOffset(1, -1, 1),
+		ldap_client::LDAPErrParamError);
+	CPPUNIT_ASSERT_THROW(req.SetVLVTarget("user2", 0, -1),
+		ldap_client::LDAPErrParamError);
+
+	// Without sort keys the request is refused before anything is sent.
+	req.SetSortKeys({});
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn), ldap_client::LDAPErrParamError);
+}
+
+void
+SearchRequestTest::testMatchedValues()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("cn=multi,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"mail"});
+	LDAPResult* res;
+	ldap_client::SearchableVector<string> mail;
+
+	_server->AddEntry("cn=multi,dc=example,dc=com",
+		{{"cn", {"multi"}}, {"mail", {"a@example.com", "b@example.org",
+			"c@example.com"}}});
+
+	req.SetMatchedValues("((mail=*@example.com))");
+	res = req.Execute(&conn);
+	mail = res->GetEntries()->front().GetValue("mail");
+	delete res;
+
+	CPPUNIT_ASSERT(sent(LDAP_CONTROL_VALUESRETURNFILTER));
+	CPPUNIT_ASSERT_EQUAL((size_t) 2, mail.size());
+	CPPUNIT_ASSERT_EQUAL(string("a@example.com"), mail[0]);
+	CPPUNIT_ASSERT_EQUAL(string("c@example.com"), mail[1]);
+
+	CPPUNIT_ASSERT_THROW(req.SetMatchedValues("(mail=broken"),
+		ldap_client::LDAPErrFilterError);
+
+	// A server without the control fails a critical request and returns
+	// every value of a non-critical one.
+	_server->SetControlSupported(LDAP_CONTROL_VALUESRETURNFILTER, false);
+	req.SetMatchedValues("((mail=*@example.com))");
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn),
+		ldap_client::LDAPErrUnavailableCriticalExtension);
+
+	req.SetMatchedValues("((mail=*@example.com))", false);
+	res = req.Execute(&conn);
+	CPPUNIT_ASSERT_EQUAL((size_t) 3,
+		res->GetEntries()->front().GetValue("mail").size());
+	delete res;
+}
+
+void
+SearchRequestTest::testCountExists()
+{
+	LDAPConnection conn(_server->GetURI());
+
+	// Counting carries on across pages the server cuts short.
+	_server->SetMaxPageSize(4);
+	CPPUNIT_ASSERT_EQUAL(11L, conn.Count("dc=example,dc=com",
+		LDAP_SCOPE_SUBTREE, "(cn=user1*)"));
+	CPPUNIT_ASSERT(sent(LDAP_CONTROL_PAGEDRESULTS));
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetRequestCount(LDAP_REQ_SEARCH));
+	CPPUNIT_ASSERT_EQUAL(0L, conn.Count("dc=example,dc=com",
+		LDAP_SCOPE_SUBTREE, "(cn=nobody)"));
+	CPPUNIT_ASSERT_EQUAL(0L, conn.Count("dc=missing,dc=com",
+		LDAP_SCOPE_BASE, "(objectClass=*)"));
+
+	CPPUNIT_ASSERT(conn.Exists("dc=example,dc=com", LDAP_SCOPE_SUBTREE,
+		"(cn=user1*)"));
+	CPPUNIT_ASSERT(!conn.Exists("dc=example,dc=com", LDAP_SCOPE_SUBTREE,
+		"(cn=nobody)"));
+	CPPUNIT_ASSERT(!conn.Exists("dc=missing,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)"));
+
+	// Other errors are not mistaken for an empty result.
+	_server->SetError(LDAP_REQ_SEARCH, LDAP_BUSY);
+	CPPUNIT_ASSERT_THROW(conn.Count("dc=example,dc=com", LDAP_SCOPE_SUBTREE,
+		"(cn=user1*)"), ldap_client::LDAPException);
+	CPPUNIT_ASSERT_THROW(conn.Exists("dc=example,dc=com",
+		LDAP_SCOPE_SUBTREE, "(cn=user1*)"), ldap_client::LDAPException);
+}
+
+void
+SearchRequestTest::testProxiedAuthorization()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("cn=user3,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"cn"});
+	LDAPResult* res;
+
+	// The control is critical, so a server without it refuses the search.
+	req.SetProxiedAuthorization("dn:cn=user3,dc=example,dc=com");
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn),
+		ldap_client::LDAPErrUnavailableCriticalExtension);
+	CPPUNIT_ASSERT(sent(LDAP_CONTROL_PROXY_AUTHZ));
+
+	_server->SetControlSupported(LDAP_CONTROL_PROXY_AUTHZ, true);
+	res = req.Execute(&conn);
+	CPPUNIT_ASSERT_EQUAL(string("user3"),
+		res->GetEntries()->front().GetFirstValue("cn"));
+	delete res;
+
+	_server->SetError(LDAP_REQ_SEARCH, LDAP_PROXIED_AUTHORIZATION_DENIED);
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn),
+		ldap_client::LDAPErrProxiedAuthorizationDenied);
+
+	_server->SetError(LDAP_REQ_SEARCH, LDAP_SUCCESS);
+	req.SetProxiedAuthorization("");
+	delete req.Execute(&conn);
+	CPPUNIT_ASSERT(!sent(LDAP_CONTROL_PROXY_AUTHZ));
+}
+
+void
+SearchRequestTest::testPageSize()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("dc=example,dc=com", LDAP_SCOPE_ONELEVEL,
+		"(objectClass=person)", {"cn"});
+
+	// A request without a page size of its own uses the connection's.
+	conn.SetPageSize(0);
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn), ldap_client::LDAPErrParamError);
+	req.SetPageSize(-1);
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn), ldap_client::LDAPErrParamError);
+	CPPUNIT_ASSERT_EQUAL(0, _server->GetRequestCount(LDAP_REQ_SEARCH));
+
+	req.SetPageSize(10);
+	delete req.Execute(&conn);
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetRequestCount(LDAP_REQ_SEARCH));
+}
+
+void
+SearchRequestTest::testStopEarly()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("dc=example,dc=com", LDAP_SCOPE_ONELEVEL,
+		"(objectClass=person)", {"cn"});
+	ldap_client::LDAPCancellationToken token;
+	chrono::steady_clock::time_point start, until;
+
+	// Stopping after the first page releases the cookie with a second
+	// request.
+	req.SetPageSize(5);
+	req.Execute(&conn, [](LDAPMessage*) { return false; });
+	CPPUNIT_ASSERT_EQUAL(2, _server->GetRequestCount(LDAP_REQ_SEARCH));
+
+	// Once cancelled, the cookie is not released at all.
+	req.SetCancellationToken(&token);
+	req.Execute(&conn, [&token](LDAPMessage*) {
+		token.Cancel();
+		return false;
+	});
+	CPPUNIT_ASSERT_EQUAL(3, _server->GetRequestCount(LDAP_REQ_SEARCH));
+	req.SetCancellationToken(0);
+
+	// Releasing the cookie gives up at the deadline of the search.
+	start = chrono::steady_clock::now();
+	req.SetDeadline(start + chrono::milliseconds(300));
+	req.Execute(&conn, [this](LDAPMessage*) {
+		_server->SetLatency(LDAP_REQ_SEARCH, 1000000);
+		return false;
+	});
+	CPPUNIT_ASSERT(chrono::steady_clock::now() - start <
+		chrono::milliseconds(900));
+
+	until = chrono::steady_clock::now() + chrono::seconds(2);
+	while (_server->GetRequestCount(LDAP_REQ_ABANDON) < 1 &&
+			chrono::steady_clock::now() < until)
+		this_thread::sleep_for(chrono::milliseconds(5));
+	CPPUNIT_ASSERT_EQUAL(1, _server->GetRequestCount(LDAP_REQ_ABANDON));
+}
+
+void
+SearchRequestTest::testStopBeforeStart()
+{
+	ldap_client::LDAPServerStats* stats =
+		ldap_client::LDAPServerStats::Get(_server->GetURI());
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("dc=example,dc=com", LDAP_SCOPE_ONELEVEL,
+		"(objectClass=person)", {"cn"});
+	ldap_client::LDAPCancellationToken token;
+	ldap_client::LDAPStatsSnapshot snap;
+
+	ldap_client::LDAPResetStats();
+
+	// Searches stopped before the first page is sent are counted as
+	// failed all the same.
+	token.Cancel();
+	req.SetCancellationToken(&token);
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn),
+		ldap_client::LDAPErrUserCancelled);
+	req.SetCancellationToken(0);
+	req.SetDeadline(chrono::steady_clock::now());
+	CPPUNIT_ASSERT_THROW(req.Execute(&conn), ldap_client::LDAPErrTimeout);
+	CPPUNIT_ASSERT_EQUAL(0, _server->GetRequestCount(LDAP_REQ_SEARCH));
+
+	stats->Snapshot(&snap);
+	CPPUNIT_ASSERT_EQUAL(1ULL, snap.errors[LDAP_USER_CANCELLED]);
+	CPPUNIT_ASSERT_EQUAL(1ULL, snap.errors[LDAP_TIMEOUT]);
+}
+
+void
+SearchRequestTest::testTraceBytes()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("dc=example,dc=com", LDAP_SCOPE_ONELEVEL,
+		"(objectClass=person)", {"cn", "objectClass"});
+	ldap_client::LDAPSearchProfile profile;
+	PageTracer tracer;
+
+	// Traces and profiles count the same bytes.
+	req.SetPageSize(10);
+	req.SetProfile(&profile);
+	ldap_client::LDAPSetTracer(&tracer);
+	delete req.Execute(&conn);
+	ldap_client::LDAPSetTracer(0);
+
+	CPPUNIT_ASSERT_EQUAL((size_t) 3, profile.pages.size());
+	CPPUNIT_ASSERT_EQUAL(25L, tracer.entries);
+	CPPUNIT_ASSERT_EQUAL(25L, profile.Total().entries);
+	CPPUNIT_ASSERT(tracer.bytes >
+		25 * string("cn=userN,dc=example,dc=com").size());
+	CPPUNIT_ASSERT_EQUAL(profile.Total().bytes, tracer.bytes);
+}
+
+/*
+ * The page sizes requested from the given one on, separated by spaces.
+ */
+static string
+join(const vector<int>& sizes, size_t from)
+{
+	string rv;
+
+	for (size_t i = from; i < sizes.size(); i++)
+		rv += (i > from ? " " : "") + to_string(sizes[i]);
+	return rv;
+}
+
+void
+SearchRequestTest::testAdaptivePaging()
+{
+	LDAPConnection conn(_server->GetURI());
+	LDAPSearchRequest req("dc=example,dc=com", LDAP_SCOPE_ONELEVEL,
+		"(objectClass=person)", {"cn"});
+	LDAPSearchRequest small("dc=example,dc=com", LDAP_SCOPE_ONELEVEL,
+		"(objectClass=person)", {"cn"});
+	vector<int> sizes;
+	LDAPResult* res;
+
+	CPPUNIT_ASSERT_THROW(req.SetAdaptivePaging(0, 16, 50),
+		ldap_client::LDAPErrParamError);
+	CPPUNIT_ASSERT_THROW(req.SetAdaptivePaging(8, 4, 50),
+		ldap_client::LDAPErrParamError);
+	CPPUNIT_ASSERT_THROW(req.SetAdaptivePaging(2, 16, 0),
+		ldap_client::LDAPErrParamError);
+
+	// Cheap pages double in size up to the maximum.
+	req.SetPageSize(1);
+	req.SetAdaptivePaging(2, 16, 1000);
+	res = req.Execute(&conn);
+	CPPUNIT_ASSERT_EQUAL((size_t) 25, res->GetEntries()->size());
+	delete res;
+	sizes = _server->GetPageSizes();
+	CPPUNIT_ASSERT_EQUAL(string("2 4 8 16"), join(sizes, 0));
+
+	// The tuned size is kept. Pages taking 20 times the target shrink
+	// to a quarter at a time down to the minimum.
+	_server->SetLatency(LDAP_REQ_SEARCH, 100000);
+	req.SetAdaptivePaging(2, 16, 5);
+	res = req.Execute(&conn);
+	CPPUNIT_ASSERT_EQUAL((size_t) 25, res->GetEntries()->size());
+	delete res;
+	sizes = _server->GetPageSizes();
+	CPPUNIT_ASSERT_EQUAL(string("16 4 2 2 2"), join(sizes, 4));
+
+	// Pages over the memory budget shrink even when they are fast.
+	_server->SetLatency(LDAP_REQ_SEARCH, 0);
+	small.SetPageSize(16);
+	small.SetAdaptivePaging(2, 16, 1000, 1);
+	res = small.Execute(&conn);
+	CPPUNIT_ASSERT_EQUAL((size_t) 25, res->GetEntries()->size());
+	delete res;
+	sizes = _server->GetPageSizes();
+	CPPUNIT_ASSERT_EQUAL(string("16 4 2 2 2"), join(sizes, 9));
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(SearchRequestTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
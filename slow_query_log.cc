@@ -0,0 +1,233 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include "ldap++.h"
+#include "slow_query_log.h"
+#include <ldap.h>
+
+namespace ldap_client
+{
+static std::atomic<LDAPSlowQueryLog*> k_SlowQueryLog(0);
+
+/**
+ * Start recording slow operations of all connections into the given
+ * log. Without a log, operations are not checked at all.
+ *
+ * @param log The log, or NULL to stop recording. Must remain valid until
+ *            all operations started while it was installed have finished.
+ */
+void LDAPSetSlowQueryLog(LDAPSlowQueryLog* log)
+{
+	k_SlowQueryLog.store(log, std::memory_order_release);
+}
+
+/**
+ * @return The installed slow query log, or NULL.
+ */
+LDAPSlowQueryLog* LDAPGetSlowQueryLog()
+{
+	return k_SlowQueryLog.load(std::memory_order_acquire);
+}
+
+/**
+ * Create an empty log. Until thresholds are set, every operation counts
+ * as slow.
+ *
+ * @param capacity Number of operations to keep; older ones are dropped.
+ */
+LDAPSlowQueryLog::LDAPSlowQueryLog(size_t capacity)
+: _ring(capacity > 0 ? capacity : 1), _next(0), _usec(0), _pages(0),
+	_entries(0), _bytes(0)
+{
+	for (size_t i = 0; i < _ring.size(); i++)
+		_ring[i].store(0);
+}
+
+LDAPSlowQueryLog::~LDAPSlowQueryLog()
+{
+	Clear();
+}
+
+/**
+ * Set the limits above which operations are recorded. An operation is
+ * recorded if it exceeds any limit that is not 0.
+ *
+ * @param usec    Total time of the operation in microseconds.
+ * @param pages   Number of search pages.
+ * @param entries Number of entries returned.
+ * @param bytes   Size of the entries returned.
+ */
+void LDAPSlowQueryLog::SetThresholds(long usec, long pages, long entries,
+	size_t bytes)
+{
+	_usec = usec;
+	_pages = pages;
+	_entries = entries;
+	_bytes = bytes;
+}
+
+/**
+ * Check an operation against the thresholds.
+ *
+ * @return true if the operation should be recorded.
+ */
+bool LDAPSlowQueryLog::IsSlow(long usec, long pages, long entries,
+	size_t bytes) const
+{
+	long max_usec = _usec.load(std::memory_order_relaxed);
+	long max_pages = _pages.load(std::memory_order_relaxed);
+	long max_entries = _entries.load(std::memory_order_relaxed);
+	size_t max_bytes = _bytes.load(std::memory_order_relaxed);
+
+	if (!max_usec && !max_pages && !max_entries && !max_bytes)
+		return true;
+
+	return (max_usec && usec > max_usec) ||
+		(max_pages && pages > max_pages) ||
+		(max_entries && entries > max_entries) ||
+		(max_bytes && bytes > max_bytes);
+}
+
+/**
+ * Record an operation, replacing the oldest one if the log is full.
+ *
+ * @param query The operation. The log takes ownership.
+ */
+void LDAPSlowQueryLog::Add(LDAPSlowQuery* query)
+{
+	size_t slot = _next.fetch_add(1, std::memory_order_relaxed) %
+		_ring.size();
+
+	delete _ring[slot].exchange(query, std::memory_order_acq_rel);
+}
+
+/**
+ * Copy the recorded operations, oldest first. Each record is taken out
+ * of the ring while it is copied, so it can't be freed underneath; a
+ * concurrent reader may miss the records being copied at the same time.
+ *
+ * @return The recorded operations.
+ */
+std::vector<LDAPSlowQuery> LDAPSlowQueryLog::Get()
+{
+	std::vector<LDAPSlowQuery> queries;
+	size_t next = _next.load(std::memory_order_relaxed);
+
+	for (size_t i = 0; i < _ring.size(); i++)
+	{
+		std::atomic<LDAPSlowQuery*>& slot =
+			_ring[(next + i) % _ring.size()];
+		LDAPSlowQuery* query = slot.exchange(0, std::memory_order_acq_rel);
+		LDAPSlowQuery* empty = 0;
+
+		if (!query)
+			continue;
+
+		queries.push_back(*query);
+
+		// Put it back unless a newer record has taken its place.
+		if (!slot.compare_exchange_strong(empty, query,
+					std::memory_order_acq_rel))
+			delete query;
+	}
+
+	return queries;
+}
+
+/**
+ * Drop all recorded operations.
+ */
+void LDAPSlowQueryLog::Clear()
+{
+	for (size_t i = 0; i < _ring.size(); i++)
+		delete _ring[i].exchange(0, std::memory_order_acq_rel);
+}
+
+/**
+ * Start timing an operation if a slow query log is installed.
+ *
+ * @param ld     LDAP handle the operation runs on.
+ * @param stats  Statistics of the server, for its name.
+ * @param op     The operation.
+ * @param base   Search base, or DN of the entry for writes.
+ * @param scope  Search scope, or -1.
+ * @param filter Search filter, or NULL.
+ * @param attrs  Requested or modified attributes, or NULL.
+ */
+LDAPSlowQueryScope::LDAPSlowQueryScope(LDAP* ld, LDAPServerStats* stats,
+	LDAPOperation op, const std::string& base, int scope,
+	const std::string* filter, const std::vector<std::string>* attrs)
+: _log(LDAPGetSlowQueryLog()), _ld(ld), _stats(stats), _op(op),
+	_base(&base), _scope(scope), _filter(filter), _attrs(attrs),
+	_begin(std::chrono::steady_clock::now()), _pages(0), _entries(0),
+	_bytes(0)
+{
+}
+
+LDAPSlowQueryScope::~LDAPSlowQueryScope()
+{
+	int rc = LDAP_OTHER;
+
+	if (!_log)
+		return;
+
+	ldap_get_option(_ld, LDAP_OPT_RESULT_CODE, &rc);
+	End(rc == LDAP_SUCCESS ? LDAP_OTHER : rc);
+}
+
+/**
+ * Count a page of search results.
+ *
+ * @param entries Number of entries in the page.
+ * @param bytes   Size of the entries, if CountsBytes() is true.
+ */
+void LDAPSlowQueryScope::AddPage(long entries, size_t bytes)
+{
+	_pages++;
+	_entries += entries;
+	_bytes += bytes;
+}
+
+/**
+ * Finish the operation and record it if it exceeded a threshold.
+ *
+ * @param result LDAP result or API error code of the operation.
+ */
+void LDAPSlowQueryScope::End(int result)
+{
+	LDAPSlowQueryLog* log = _log;
+	std::chrono::microseconds usec;
+	LDAPSlowQuery* query;
+
+	if (!log)
+		return;
+
+	_log = 0;
+	usec = std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - _begin);
+	if (!log->IsSlow(usec.count(), _pages, _entries, _bytes))
+		return;
+
+	query = new LDAPSlowQuery;
+	query->op = _op;
+	query->server = _stats->GetServer();
+	query->base = *_base;
+	query->scope = _scope;
+	if (_filter)
+		query->filter = *_filter;
+	if (_attrs)
+		query->attrs = *_attrs;
+	query->started = std::chrono::system_clock::now() -
+		std::chrono::duration_cast<std::chrono::system_clock::duration>(usec);
+	query->usec = usec.count();
+	query->pages = _pages;
+	query->entries = _entries;
+	query->bytes = _bytes;
+	query->result = result;
+	log->Add(query);
+}
+}
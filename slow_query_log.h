@@ -0,0 +1,55 @@
+/*
+ * Scope guard recording operations in the slow query log.
+ * Internal to the library; not installed.
+ */
+
+#ifndef SLOW_QUERY_LOG_H_
+#define SLOW_QUERY_LOG_H_
+
+#include <string>
+#include <vector>
+#include "ldap++.h"
+#include <ldap.h>
+
+namespace ldap_client
+{
+/*
+ * Checks one operation against the installed slow query log, if any, and
+ * records it there if it exceeded a threshold; does nothing otherwise.
+ * The operation is checked on destruction if End() wasn't called, with
+ * the last result code of the LDAP handle.
+ */
+class LDAPSlowQueryScope
+{
+    public:
+	LDAPSlowQueryScope(LDAP* ld, LDAPServerStats* stats, LDAPOperation op,
+		const std::string& base, int scope = -1,
+		const std::string* filter = 0,
+		const std::vector<std::string>* attrs = 0);
+	~LDAPSlowQueryScope();
+
+	bool Active() const { return _log != 0; }
+	bool CountsBytes() const { return _log && _log->CountsBytes(); }
+	void AddPage(long entries, size_t bytes);
+	void End(int result);
+
+    private:
+	LDAPSlowQueryScope(const LDAPSlowQueryScope&);
+	LDAPSlowQueryScope& operator=(const LDAPSlowQueryScope&);
+
+	LDAPSlowQueryLog* _log;
+	LDAP* _ld;
+	LDAPServerStats* _stats;
+	LDAPOperation _op;
+	const std::string* _base;
+	int _scope;
+	const std::string* _filter;
+	const std::vector<std::string>* _attrs;
+	LDAPTimePoint _begin;
+	long _pages;
+	long _entries;
+	size_t _bytes;
+};
+}
+
+#endif /* SLOW_QUERY_LOG_H_ */
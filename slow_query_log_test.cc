@@ -0,0 +1,245 @@
+/*
+ * slow_query_log_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "ldap++.h"
+#include "mock_ldap_server.h"
+
+using namespace std;
+using ldap_client::LDAPConnection;
+using ldap_client::LDAPEntry;
+using ldap_client::LDAPResult;
+using ldap_client::LDAPSlowQuery;
+using ldap_client::LDAPSlowQueryLog;
+
+namespace testing {
+class SlowQueryLogTest : public CppUnit::TestCase {
+	CPPUNIT_TEST_SUITE(SlowQueryLogTest);
+	CPPUNIT_TEST(testRing);
+	CPPUNIT_TEST(testConcurrent);
+	CPPUNIT_TEST(testThresholds);
+	CPPUNIT_TEST(testSearch);
+	CPPUNIT_TEST(testSyncCancelled);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void tearDown();
+
+	void testRing();
+	void testConcurrent();
+	void testThresholds();
+	void testSearch();
+	void testSyncCancelled();
+
+private:
+	static LDAPSlowQuery* query(const string& base);
+};
+
+void
+SlowQueryLogTest::tearDown()
+{
+	ldap_client::LDAPSetSlowQueryLog(0);
+}
+
+LDAPSlowQuery*
+SlowQueryLogTest::query(const string& base)
+{
+	LDAPSlowQuery* query = new LDAPSlowQuery;
+
+	query->op = ldap_client::kLdapOpSearch;
+	query->base = base;
+	query->scope = LDAP_SCOPE_SUBTREE;
+	query->usec = 0;
+	query->pages = 0;
+	query->entries = 0;
+	query->bytes = 0;
+	query->result = LDAP_SUCCESS;
+	return query;
+}
+
+void
+SlowQueryLogTest::testRing()
+{
+	LDAPSlowQueryLog log(4);
+	vector<LDAPSlowQuery> queries;
+
+	CPPUNIT_ASSERT(log.Get().empty());
+
+	log.Add(query("q0"));
+	log.Add(query("q1"));
+	queries = log.Get();
+	CPPUNIT_ASSERT_EQUAL((size_t) 2, queries.size());
+	CPPUNIT_ASSERT_EQUAL(string("q0"), queries[0].base);
+	CPPUNIT_ASSERT_EQUAL(string("q1"), queries[1].base);
+
+	// Past the capacity the oldest records are replaced.
+	for (int i = 2; i < 6; i++)
+		log.Add(query("q" + to_string(i)));
+	queries = log.Get();
+	CPPUNIT_ASSERT_EQUAL((size_t) 4, queries.size());
+	for (size_t i = 0; i < queries.size(); i++)
+		CPPUNIT_ASSERT_EQUAL("q" + to_string(i + 2), queries[i].base);
+
+	// Reading does not consume the records.
+	CPPUNIT_ASSERT_EQUAL((size_t) 4, log.Get().size());
+
+	log.Clear();
+	CPPUNIT_ASSERT(log.Get().empty());
+}
+
+void
+SlowQueryLogTest::testConcurrent()
+{
+	const int kThreads = 4, kQueries = 2000;
+	LDAPSlowQueryLog log(16);
+	vector<thread> writers;
+	atomic<bool> done(false);
+	atomic<int> bad(0);
+	thread reader;
+	vector<LDAPSlowQuery> queries;
+	set<string> seen;
+
+	reader = thread([&]() {
+		while (!done)
+			for (const LDAPSlowQuery& query : log.Get())
+				if (query.base.compare(0, 1, "t"))
+					bad++;
+	});
+
+	for (int t = 0; t < kThreads; t++)
+		writers.push_back(thread([&log, t, kQueries]() {
+			for (int i = 0; i < kQueries; i++)
+				log.Add(query("t" + to_string(t) + "." +
+					to_string(i)));
+		}));
+	for (thread& writer : writers)
+		writer.join();
+	done = true;
+	reader.join();
+	CPPUNIT_ASSERT_EQUAL(0, bad.load());
+
+	// Every slot holds one of the records, none of them twice.
+	queries = log.Get();
+	CPPUNIT_ASSERT(queries.size() <= 16);
+	CPPUNIT_ASSERT(queries.size() > 0);
+	for (const LDAPSlowQuery& query : queries)
+		CPPUNIT_ASSERT(seen.insert(query.base).second);
+}
+
+void
+SlowQueryLogTest::testThresholds()
+{
+	LDAPSlowQueryLog log;
+
+	// Without thresholds everything is recorded.
+	CPPUNIT_ASSERT(log.IsSlow(0, 0, 0, 0));
+	CPPUNIT_ASSERT(!log.CountsBytes());
+
+	log.SetThresholds(1000, 0, 0, 4096);
+	CPPUNIT_ASSERT(log.CountsBytes());
+	CPPUNIT_ASSERT(!log.IsSlow(1000, 100, 100, 4096));
+	CPPUNIT_ASSERT(log.IsSlow(1001, 0, 0, 0));
+	CPPUNIT_ASSERT(log.IsSlow(0, 0, 0, 4097));
+}
+
+void
+SlowQueryLogTest::testSearch()
+{
+	MockLDAPServer server;
+	LDAPSlowQueryLog log;
+	vector<LDAPSlowQuery> queries;
+	LDAPResult* res;
+
+	server.Start();
+	server.AddEntry("cn=a,dc=example,dc=com", {{"cn", {"a"}}});
+	server.AddEntry("cn=b,dc=example,dc=com", {{"cn", {"b"}}});
+	server.SetMaxPageSize(1);
+
+	LDAPConnection conn(server.GetURI());
+	ldap_client::LDAPSetSlowQueryLog(&log);
+	res = conn.Search("dc=example,dc=com", LDAP_SCOPE_SUBTREE, "(cn=*)",
+		{"cn"});
+	delete res;
+
+	// Only the whole search is recorded, not its pages.
+	queries = log.Get();
+	CPPUNIT_ASSERT_EQUAL((size_t) 1, queries.size());
+	CPPUNIT_ASSERT_EQUAL(ldap_client::kLdapOpSearch, queries[0].op);
+	CPPUNIT_ASSERT_EQUAL(string("dc=example,dc=com"), queries[0].base);
+	CPPUNIT_ASSERT_EQUAL(string("(cn=*)"), queries[0].filter);
+	CPPUNIT_ASSERT_EQUAL(2L, queries[0].entries);
+	CPPUNIT_ASSERT(queries[0].pages >= 2);
+	CPPUNIT_ASSERT_EQUAL(LDAP_SUCCESS, queries[0].result);
+
+	// Failed searches are recorded with their error.
+	log.Clear();
+	server.SetError(LDAP_REQ_SEARCH, LDAP_BUSY);
+	CPPUNIT_ASSERT_THROW(conn.Search("dc=example,dc=com",
+		LDAP_SCOPE_SUBTREE, "(cn=*)", {"cn"}), ldap_client::LDAPErrBusy);
+	queries = log.Get();
+	CPPUNIT_ASSERT_EQUAL((size_t) 1, queries.size());
+	CPPUNIT_ASSERT_EQUAL(LDAP_BUSY, queries[0].result);
+}
+
+void
+SlowQueryLogTest::testSyncCancelled()
+{
+	MockLDAPServer server;
+	LDAPSlowQueryLog log;
+	ldap_client::LDAPCancellationToken token;
+	vector<LDAPSlowQuery> queries;
+	LDAPResult* res;
+	thread canceller;
+
+	server.Start();
+	server.AddEntry("cn=a,dc=example,dc=com", {{"cn", {"a"}}});
+
+	LDAPConnection conn(server.GetURI());
+	res = conn.Search("cn=a,dc=example,dc=com", LDAP_SCOPE_BASE,
+		"(objectClass=*)", {"cn"});
+	LDAPEntry& entry = res->GetEntries()->front();
+
+	// The modification is still outstanding when it is cancelled, so
+	// the wait throws; it must be logged all the same.
+	ldap_client::LDAPSetSlowQueryLog(&log);
+	server.SetLatency(LDAP_REQ_MODIFY, 500000);
+	conn.SetCancellationToken(&token);
+	entry.AddValue("description", "x");
+	canceller = thread([&token]() {
+		this_thread::sleep_for(chrono::milliseconds(100));
+		token.Cancel();
+	});
+	CPPUNIT_ASSERT_THROW(entry.Sync(), ldap_client::LDAPErrUserCancelled);
+	canceller.join();
+	delete res;
+
+	queries = log.Get();
+	CPPUNIT_ASSERT_EQUAL((size_t) 1, queries.size());
+	CPPUNIT_ASSERT_EQUAL(ldap_client::kLdapOpModify, queries[0].op);
+	CPPUNIT_ASSERT_EQUAL(string("cn=a,dc=example,dc=com"), queries[0].base);
+	CPPUNIT_ASSERT_EQUAL((size_t) 1, queries[0].attrs.size());
+	CPPUNIT_ASSERT_EQUAL(string("description"), queries[0].attrs[0]);
+	CPPUNIT_ASSERT_EQUAL(LDAP_USER_CANCELLED, queries[0].result);
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(SlowQueryLogTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
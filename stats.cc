@@ -0,0 +1,397 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "ldap++.h"
+#include <ldap.h>
+
+namespace ldap_client
+{
+static const char* k_OperationNames[kLdapOpCount] = {
+	"search", "search_page", "bind", "add", "modify"
+};
+
+/*
+ * All LDAPServerStats instances by server URI. Only looked up when a
+ * connection is created.
+ */
+static std::mutex k_StatsLock;
+static std::map<std::string, LDAPServerStats*> k_Stats;
+
+/**
+ * Get a short name for the operation, e.g. for use as a metric label.
+ *
+ * @param op The operation.
+ * @return Name of the operation, e.g. "search".
+ */
+const char* LDAPOperationName(LDAPOperation op)
+{
+	if (op < 0 || op >= kLdapOpCount)
+		return "unknown";
+
+	return k_OperationNames[op];
+}
+
+/**
+ * Estimate the latency below which the given fraction of all recorded
+ * latencies fall.
+ *
+ * @param q Fraction between 0 and 1, e.g. 0.99.
+ * @return Upper bound of the bucket containing the percentile in
+ *         microseconds, or 0 if nothing has been recorded.
+ */
+long LDAPHistogramSnapshot::Percentile(double q) const
+{
+	unsigned long long rank, seen = 0;
+
+	if (count == 0)
+		return 0;
+
+	rank = (unsigned long long) (q * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	for (size_t i = 0; i < buckets.size(); i++)
+	{
+		seen += buckets[i];
+		if (seen >= rank)
+			return std::min(LDAPLatencyHistogram::BucketUpperBound(i), max);
+	}
+
+	return max;
+}
+
+/**
+ * @return The mean of all recorded latencies in microseconds.
+ */
+double LDAPHistogramSnapshot::Mean() const
+{
+	return count ? (double) sum / count : 0.0;
+}
+
+LDAPLatencyHistogram::LDAPLatencyHistogram()
+{
+	Reset();
+}
+
+/**
+ * Add a latency to the histogram. Negative values are recorded as 0,
+ * values beyond the last bucket in the last bucket.
+ *
+ * @param usec Latency in microseconds.
+ */
+void LDAPLatencyHistogram::Record(long usec)
+{
+	unsigned long long v = usec > 0 ? usec : 0;
+	unsigned long long max = _max.load(std::memory_order_relaxed);
+
+	_buckets[BucketIndex(v)].fetch_add(1, std::memory_order_relaxed);
+	_count.fetch_add(1, std::memory_order_relaxed);
+	_sum.fetch_add(v, std::memory_order_relaxed);
+
+	while (v > max && !_max.compare_exchange_weak(max, v,
+				std::memory_order_relaxed))
+		;
+}
+
+/**
+ * Copy the current state of the histogram. Values recorded concurrently
+ * may or may not be included, so the total may differ slightly from the
+ * sum of the buckets.
+ *
+ * @param snap Snapshot to fill in.
+ */
+void LDAPLatencyHistogram::Snapshot(LDAPHistogramSnapshot* snap) const
+{
+	snap->count = _count.load(std::memory_order_relaxed);
+	snap->sum = _sum.load(std::memory_order_relaxed);
+	snap->max = _max.load(std::memory_order_relaxed);
+	snap->buckets.resize(kBuckets);
+
+	for (int i = 0; i < kBuckets; i++)
+		snap->buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+}
+
+/**
+ * Forget all recorded latencies.
+ */
+void LDAPLatencyHistogram::Reset()
+{
+	for (int i = 0; i < kBuckets; i++)
+		_buckets[i].store(0, std::memory_order_relaxed);
+
+	_count.store(0, std::memory_order_relaxed);
+	_sum.store(0, std::memory_order_relaxed);
+	_max.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Find the bucket for a latency. Values below kSubBuckets get a bucket
+ * each; above, every power of two is split into kSubBuckets buckets.
+ *
+ * @param usec Latency in microseconds.
+ * @return Index of the bucket.
+ */
+int LDAPLatencyHistogram::BucketIndex(unsigned long long usec)
+{
+	int exp = 0, index;
+
+	if (usec < (unsigned long long) kSubBuckets)
+		return usec;
+
+	for (unsigned long long v = usec; v > 1; v >>= 1)
+		exp++;
+
+	index = (exp - kSubBucketBits + 1) * kSubBuckets +
+		(int) ((usec >> (exp - kSubBucketBits)) - kSubBuckets);
+
+	return std::min(index, kBuckets - 1);
+}
+
+/**
+ * @param index Index of a bucket.
+ * @return The smallest latency counted in the bucket, in microseconds.
+ */
+unsigned long long LDAPLatencyHistogram::BucketLowerBound(int index)
+{
+	int exp;
+
+	if (index < kSubBuckets)
+		return index;
+
+	exp = index / kSubBuckets - 1 + kSubBucketBits;
+	return (unsigned long long) (index % kSubBuckets + kSubBuckets) <<
+		(exp - kSubBucketBits);
+}
+
+/**
+ * @param index Index of a bucket.
+ * @return The largest latency counted in the bucket, in microseconds.
+ */
+unsigned long long LDAPLatencyHistogram::BucketUpperBound(int index)
+{
+	if (index >= kBuckets - 1)
+		return ~0ULL;
+
+	return BucketLowerBound(index + 1) - 1;
+}
+
+LDAPServerStats::LDAPServerStats(const std::string server)
+: _server(server), _connections(0), _in_flight(0)
+{
+	Reset();
+}
+
+/**
+ * Get the statistics for the given server, creating them on first use.
+ *
+ * @param server URI of the server.
+ * @return The statistics, which remain valid until the process exits.
+ */
+LDAPServerStats* LDAPServerStats::Get(const std::string server)
+{
+	std::lock_guard<std::mutex> guard(k_StatsLock);
+	LDAPServerStats*& stats = k_Stats[server];
+
+	if (!stats)
+		stats = new LDAPServerStats(server);
+
+	return stats;
+}
+
+/**
+ * Record the latency of an operation which started at the given time and
+ * just finished.
+ *
+ * @param op    The operation.
+ * @param start When the operation started.
+ */
+void LDAPServerStats::Record(LDAPOperation op, LDAPTimePoint start)
+{
+	Record(op, std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count());
+}
+
+/**
+ * Record the latency of an operation.
+ *
+ * @param op   The operation.
+ * @param usec Latency in microseconds.
+ */
+void LDAPServerStats::Record(LDAPOperation op, long usec)
+{
+	_latency[op].Record(usec);
+}
+
+/**
+ * Count entries received from the server.
+ *
+ * @param n Number of entries.
+ */
+void LDAPServerStats::AddEntries(long n)
+{
+	_entries.fetch_add(n, std::memory_order_relaxed);
+}
+
+/**
+ * Count a page of search results received from the server.
+ */
+void LDAPServerStats::AddPage()
+{
+	_pages.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Count a failed operation.
+ *
+ * @param rc The LDAP result code or API error code.
+ */
+void LDAPServerStats::AddError(int rc)
+{
+	// Codes outside the table, e.g. those of syncrepl, are rare.
+	if (rc < -128 || rc > 127)
+		rc = LDAP_OTHER;
+
+	_errors[(unsigned char) rc].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Track the number of open connections.
+ *
+ * @param n Number of connections opened, or closed if negative.
+ */
+void LDAPServerStats::AddConnections(long n)
+{
+	_connections.fetch_add(n, std::memory_order_relaxed);
+}
+
+/**
+ * Track the number of operations waiting for a response.
+ *
+ * @param n Number of operations sent, or answered if negative.
+ */
+void LDAPServerStats::AddInFlight(long n)
+{
+	_in_flight.fetch_add(n, std::memory_order_relaxed);
+}
+
+/**
+ * Count a lookup in the verified credential cache.
+ *
+ * @param hit Whether the lookup was answered from the cache.
+ */
+void LDAPServerStats::AddCacheLookup(bool hit)
+{
+	if (hit)
+		_cache_hits.fetch_add(1, std::memory_order_relaxed);
+	else
+		_cache_misses.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Count traffic on the wire caused by an operation.
+ *
+ * @param op The operation.
+ * @param io Bytes and calls to add.
+ */
+void LDAPServerStats::AddIO(LDAPOperation op, const LDAPIOCounters& io)
+{
+	_bytes_in[op].fetch_add(io.bytes_in, std::memory_order_relaxed);
+	_bytes_out[op].fetch_add(io.bytes_out, std::memory_order_relaxed);
+	_reads[op].fetch_add(io.reads, std::memory_order_relaxed);
+	_writes[op].fetch_add(io.writes, std::memory_order_relaxed);
+}
+
+/**
+ * Copy the current statistics.
+ *
+ * @param snap Snapshot to fill in.
+ */
+void LDAPServerStats::Snapshot(LDAPStatsSnapshot* snap) const
+{
+	snap->server = _server;
+	for (int i = 0; i < kLdapOpCount; i++)
+	{
+		_latency[i].Snapshot(&snap->latency[i]);
+		snap->io[i].bytes_in = _bytes_in[i].load(std::memory_order_relaxed);
+		snap->io[i].bytes_out = _bytes_out[i].load(std::memory_order_relaxed);
+		snap->io[i].reads = _reads[i].load(std::memory_order_relaxed);
+		snap->io[i].writes = _writes[i].load(std::memory_order_relaxed);
+	}
+
+	snap->entries = _entries.load(std::memory_order_relaxed);
+	snap->pages = _pages.load(std::memory_order_relaxed);
+	snap->connections = _connections.load(std::memory_order_relaxed);
+	snap->in_flight = _in_flight.load(std::memory_order_relaxed);
+	snap->cache_hits = _cache_hits.load(std::memory_order_relaxed);
+	snap->cache_misses = _cache_misses.load(std::memory_order_relaxed);
+	snap->errors.clear();
+
+	for (int i = 0; i < 256; i++)
+	{
+		unsigned long long n = _errors[i].load(std::memory_order_relaxed);
+
+		if (n > 0)
+			snap->errors[(signed char) i] = n;
+	}
+}
+
+/**
+ * Reset all totals to zero. The numbers of open connections and
+ * operations in flight are kept.
+ */
+void LDAPServerStats::Reset()
+{
+	for (int i = 0; i < kLdapOpCount; i++)
+	{
+		_latency[i].Reset();
+		_bytes_in[i].store(0, std::memory_order_relaxed);
+		_bytes_out[i].store(0, std::memory_order_relaxed);
+		_reads[i].store(0, std::memory_order_relaxed);
+		_writes[i].store(0, std::memory_order_relaxed);
+	}
+
+	_entries.store(0, std::memory_order_relaxed);
+	_pages.store(0, std::memory_order_relaxed);
+	_cache_hits.store(0, std::memory_order_relaxed);
+	_cache_misses.store(0, std::memory_order_relaxed);
+
+	for (int i = 0; i < 256; i++)
+		_errors[i].store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Take a snapshot of the statistics of every server a connection has
+ * been made to.
+ *
+ * @return One snapshot per server, ordered by URI.
+ */
+std::vector<LDAPStatsSnapshot> LDAPGetStats()
+{
+	std::lock_guard<std::mutex> guard(k_StatsLock);
+	std::vector<LDAPStatsSnapshot> snaps(k_Stats.size());
+	size_t i = 0;
+
+	for (auto iter = k_Stats.begin(); iter != k_Stats.end(); iter++)
+		iter->second->Snapshot(&snaps[i++]);
+
+	return snaps;
+}
+
+/**
+ * Reset the statistics of all servers to zero.
+ */
+void LDAPResetStats()
+{
+	std::lock_guard<std::mutex> guard(k_StatsLock);
+
+	for (auto iter = k_Stats.begin(); iter != k_Stats.end(); iter++)
+		iter->second->Reset();
+}
+}
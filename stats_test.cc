@@ -0,0 +1,177 @@
+/*
+ * stats_test.cc
+ */
+#include <cppunit/extensions/HelperMacros.h>
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+
+#include <string>
+#include "ldap++.h"
+
+using namespace std;
+using ldap_client::LDAPLatencyHistogram;
+using ldap_client::LDAPHistogramSnapshot;
+
+namespace testing {
+class StatsTest : public CppUnit::TestCase {
+	CPPUNIT_TEST_SUITE(StatsTest);
+	CPPUNIT_TEST(testBuckets);
+	CPPUNIT_TEST(testPercentile);
+	CPPUNIT_TEST(testServerStats);
+	CPPUNIT_TEST(testPrometheus);
+	CPPUNIT_TEST_SUITE_END();
+
+public:
+	void testBuckets();
+	void testPercentile();
+	void testServerStats();
+	void testPrometheus();
+};
+
+void
+StatsTest::testBuckets()
+{
+	// Small values get exact buckets.
+	for (unsigned long long v = 0; v < LDAPLatencyHistogram::kSubBuckets; v++)
+		CPPUNIT_ASSERT_EQUAL((int) v, LDAPLatencyHistogram::BucketIndex(v));
+
+	// Every value lies within the bounds of its bucket, and the buckets
+	// are contiguous.
+	for (unsigned long long v = 1; v < (1ULL << 38); v = v * 3 + 1)
+	{
+		int i = LDAPLatencyHistogram::BucketIndex(v);
+
+		CPPUNIT_ASSERT(LDAPLatencyHistogram::BucketLowerBound(i) <= v);
+		CPPUNIT_ASSERT(LDAPLatencyHistogram::BucketUpperBound(i) >= v);
+		CPPUNIT_ASSERT_EQUAL(i + 1, LDAPLatencyHistogram::BucketIndex(
+			LDAPLatencyHistogram::BucketUpperBound(i) + 1));
+	}
+
+	CPPUNIT_ASSERT_EQUAL(LDAPLatencyHistogram::kBuckets - 1,
+		LDAPLatencyHistogram::BucketIndex(~0ULL));
+}
+
+void
+StatsTest::testPercentile()
+{
+	LDAPLatencyHistogram h;
+	LDAPHistogramSnapshot s;
+
+	h.Snapshot(&s);
+	CPPUNIT_ASSERT_EQUAL(0L, s.Percentile(0.5));
+
+	for (long v = 1; v <= 1000; v++)
+		h.Record(v);
+	h.Record(-5);
+	h.Snapshot(&s);
+
+	CPPUNIT_ASSERT_EQUAL(1001ULL, s.count);
+	CPPUNIT_ASSERT_EQUAL(1000ULL, s.max);
+	CPPUNIT_ASSERT_EQUAL(500500ULL, s.sum);
+	// Within the precision of one sub-bucket.
+	CPPUNIT_ASSERT(s.Percentile(0.5) >= 500 && s.Percentile(0.5) <= 532);
+	CPPUNIT_ASSERT(s.Percentile(0.99) >= 990 && s.Percentile(0.99) <= 1000);
+	CPPUNIT_ASSERT_EQUAL(1000L, s.Percentile(1.0));
+
+	h.Reset();
+	h.Snapshot(&s);
+	CPPUNIT_ASSERT_EQUAL(0ULL, s.count);
+}
+
+void
+StatsTest::testServerStats()
+{
+	ldap_client::LDAPServerStats* stats =
+		ldap_client::LDAPServerStats::Get("ldap://stats-test");
+	vector<ldap_client::LDAPStatsSnapshot> snaps;
+
+	CPPUNIT_ASSERT(stats == ldap_client::LDAPServerStats::Get(
+		"ldap://stats-test"));
+
+	stats->Record(ldap_client::kLdapOpBind, 250L);
+	stats->AddEntries(3);
+	stats->AddPage();
+	stats->AddError(LDAP_INVALID_CREDENTIALS);
+	stats->AddError(LDAP_TIMEOUT);
+	stats->AddError(LDAP_TIMEOUT);
+
+	snaps = ldap_client::LDAPGetStats();
+	CPPUNIT_ASSERT_EQUAL((size_t) 1, snaps.size());
+	CPPUNIT_ASSERT_EQUAL(string("ldap://stats-test"), snaps[0].server);
+	CPPUNIT_ASSERT_EQUAL(1ULL,
+		snaps[0].latency[ldap_client::kLdapOpBind].count);
+	CPPUNIT_ASSERT_EQUAL(3ULL, snaps[0].entries);
+	CPPUNIT_ASSERT_EQUAL(1ULL, snaps[0].pages);
+	CPPUNIT_ASSERT_EQUAL(1ULL, snaps[0].errors[LDAP_INVALID_CREDENTIALS]);
+	CPPUNIT_ASSERT_EQUAL(2ULL, snaps[0].errors[LDAP_TIMEOUT]);
+
+	ldap_client::LDAPResetStats();
+	snaps = ldap_client::LDAPGetStats();
+	CPPUNIT_ASSERT(snaps[0].errors.empty());
+}
+
+void
+StatsTest::testPrometheus()
+{
+	ldap_client::LDAPServerStats* stats =
+		ldap_client::LDAPServerStats::Get("ldap://stats-test");
+	string text;
+
+	ldap_client::LDAPResetStats();
+	stats->Record(ldap_client::kLdapOpSearch, 50L);
+	stats->Record(ldap_client::kLdapOpSearch, 2000000L);
+	stats->Record(ldap_client::kLdapOpSearch, 100000000L);
+	stats->AddCacheLookup(true);
+	stats->AddError(LDAP_TIMEOUT);
+
+	text = ldap_client::LDAPRenderPrometheus();
+	CPPUNIT_ASSERT(text.find("# TYPE ldap_operation_duration_seconds "
+		"histogram\n") != string::npos);
+	CPPUNIT_ASSERT(text.find("ldap_operation_duration_seconds_bucket{"
+		"server=\"ldap://stats-test\",op=\"search\",le=\"0.0001\"} 1\n") !=
+		string::npos);
+	CPPUNIT_ASSERT(text.find("ldap_operation_duration_seconds_bucket{"
+		"server=\"ldap://stats-test\",op=\"search\",le=\"2.5\"} 2\n") !=
+		string::npos);
+	CPPUNIT_ASSERT(text.find("ldap_operation_duration_seconds_bucket{"
+		"server=\"ldap://stats-test\",op=\"search\",le=\"60\"} 2\n") !=
+		string::npos);
+	CPPUNIT_ASSERT(text.find("ldap_operation_duration_seconds_bucket{"
+		"server=\"ldap://stats-test\",op=\"search\",le=\"+Inf\"} 3\n") !=
+		string::npos);
+	CPPUNIT_ASSERT(text.find("ldap_operation_duration_seconds_sum{"
+		"server=\"ldap://stats-test\",op=\"search\"} 102.00005\n") !=
+		string::npos);
+	CPPUNIT_ASSERT(text.find("ldap_operation_duration_seconds_count{"
+		"server=\"ldap://stats-test\",op=\"search\"} 3\n") !=
+		string::npos);
+	CPPUNIT_ASSERT(text.find("ldap_errors_total{server=\"ldap://stats-test\","
+		"code=\"-5\"} 1\n") != string::npos);
+	CPPUNIT_ASSERT(text.find("ldap_bind_cache_hits_total{"
+		"server=\"ldap://stats-test\"} 1\n") != string::npos);
+
+	// Latencies on a bound are counted under it.
+	stats->Record(ldap_client::kLdapOpBind, 99L);
+	stats->Record(ldap_client::kLdapOpBind, 100L);
+	stats->Record(ldap_client::kLdapOpBind, 104L);
+	text = ldap_client::LDAPRenderPrometheus();
+	CPPUNIT_ASSERT(text.find("ldap_operation_duration_seconds_bucket{"
+		"server=\"ldap://stats-test\",op=\"bind\",le=\"0.0001\"} 2\n") !=
+		string::npos);
+	CPPUNIT_ASSERT(text.find("ldap_operation_duration_seconds_bucket{"
+		"server=\"ldap://stats-test\",op=\"bind\",le=\"0.00025\"} 3\n") !=
+		string::npos);
+}
+
+CPPUNIT_TEST_SUITE_REGISTRATION(StatsTest);
+
+};
+
+int main( int argc, char **argv)
+{
+  CppUnit::TextUi::TestRunner runner;
+  CppUnit::TestFactoryRegistry &registry = CppUnit::TestFactoryRegistry::getRegistry();
+  runner.addTest( registry.makeTest() );
+  bool wasSuccessful = runner.run( "", false );
+  return !wasSuccessful;
+}
@@ -0,0 +1,91 @@
+/*
+ * Writing entries: building the modifications in LDAPEntry::Sync, and
+ * LDIF output with LDAPEntry::Output.
+ */
+#include <string>
+#include <vector>
+#include <sstream>
+#include <benchmark/benchmark.h>
+#include "bench_util.h"
+
+using namespace ldap_bench;
+
+static const int k_Values = 4;
+static const int k_ValueLength = 24;
+
+/*
+ * Modify an entry from a search result with state.range(0) changed
+ * attributes. Pending changes are kept after Sync(), so every iteration
+ * sends the same modifications. Includes the round trip to the
+ * responder thread.
+ */
+static void BM_SyncModify(benchmark::State& state)
+{
+	MessageFactory factory;
+	LDAPMessage* res = factory.Search(std::vector<Entry>(1,
+		MakeEntry("cn=bench,dc=example,dc=com", state.range(0),
+			k_Values, k_ValueLength)));
+	ldap_client::LDAPEntry entry(factory.GetConnection(),
+		ldap_first_entry(factory.GetLDAP(), res));
+
+	ldap_msgfree(res);
+	for (int i = 0; i < state.range(0); i++)
+	{
+		const std::string name = "attribute" + std::to_string(i);
+
+		entry.RemoveValue(name, entry.GetFirstValue(name));
+		entry.AddValue(name, std::string(k_ValueLength, 'z'));
+	}
+
+	factory.StartResponder();
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+		entry.Sync();
+}
+BENCHMARK(BM_SyncModify)->Arg(1)->Arg(8)->Arg(64);
+
+static void BM_SyncAdd(benchmark::State& state)
+{
+	MessageFactory factory;
+	ldap_client::LDAPEntry entry(factory.GetConnection(),
+		"cn=bench,dc=example,dc=com");
+
+	for (int i = 0; i < state.range(0); i++)
+		for (int j = 0; j < k_Values; j++)
+			entry.AddValue("attribute" + std::to_string(i),
+				std::string(k_ValueLength, 'a' + j));
+
+	factory.StartResponder();
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+		entry.Sync();
+}
+BENCHMARK(BM_SyncAdd)->Arg(1)->Arg(8)->Arg(64);
+
+/*
+ * Does nothing if the library was built without ldif.h.
+ */
+static void BM_Output(benchmark::State& state)
+{
+	MessageFactory factory;
+	LDAPMessage* res = factory.Search(std::vector<Entry>(1,
+		MakeEntry("cn=bench,dc=example,dc=com", state.range(0),
+			k_Values, k_ValueLength)));
+	ldap_client::LDAPEntry entry(factory.GetConnection(),
+		ldap_first_entry(factory.GetLDAP(), res));
+	std::ostringstream out;
+
+	ldap_msgfree(res);
+	AllocationCounter allocs(state);
+
+	for (auto _ : state)
+	{
+		out.str(std::string());
+		entry.Output(out);
+	}
+
+	state.SetBytesProcessed(state.iterations() * out.str().length());
+}
+BENCHMARK(BM_Output)->Arg(8)->Arg(64)->Arg(256);
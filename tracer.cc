@@ -0,0 +1,131 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <atomic>
+#include "ldap++.h"
+#include "tracer.h"
+#include <ldap.h>
+#include <lber.h>
+
+namespace ldap_client
+{
+static std::atomic<LDAPTracer*> k_Tracer(0);
+
+/**
+ * Compute the 64 bit FNV-1a hash of a filter, so traces can group
+ * searches by filter without carrying the filter itself.
+ */
+static unsigned long long FilterHash(const std::string& filter)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < filter.length(); i++)
+	{
+		hash ^= (unsigned char) filter[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * Install a tracer which is called for every operation of every
+ * connection. Without a tracer, tracing costs a single atomic load per
+ * operation.
+ *
+ * @param tracer The tracer, or NULL to stop tracing. Must remain valid
+ *               until all operations started while it was installed
+ *               have finished.
+ */
+void LDAPSetTracer(LDAPTracer* tracer)
+{
+	k_Tracer.store(tracer, std::memory_order_release);
+}
+
+/**
+ * @return The installed tracer, or NULL.
+ */
+LDAPTracer* LDAPGetTracer()
+{
+	return k_Tracer.load(std::memory_order_acquire);
+}
+
+/**
+ * Start reporting an operation.
+ *
+ * @param ld     LDAP handle the operation is performed on.
+ * @param stats  Statistics of the server, used for its URI.
+ * @param op     The operation.
+ * @param dn     Bind DN, search base or DN of the entry.
+ * @param scope  Search scope, or -1.
+ * @param filter Search filter, or NULL.
+ */
+LDAPTraceScope::LDAPTraceScope(LDAP* ld, LDAPServerStats* stats,
+	LDAPOperation op, const std::string& dn, int scope,
+	const std::string* filter)
+: _tracer(LDAPGetTracer()), _ld(ld)
+{
+	if (!_tracer)
+		return;
+
+	_event.op = op;
+	_event.server = stats->GetServer().c_str();
+	_event.dn = dn.c_str();
+	_event.scope = scope;
+	_event.filter_hash = filter ? FilterHash(*filter) : 0;
+	_event.msgid = -1;
+	_event.entries = 0;
+	_event.bytes = 0;
+	_event.result = LDAP_SUCCESS;
+	_event.context = 0;
+
+	_tracer->OnStart(_event);
+}
+
+/**
+ * Finish reporting the operation if End() hasn't been called, e.g.
+ * because an exception is being thrown.
+ */
+LDAPTraceScope::~LDAPTraceScope()
+{
+	int rc = LDAP_OTHER;
+
+	if (!_tracer)
+		return;
+
+	ldap_get_option(_ld, LDAP_OPT_RESULT_CODE, &rc);
+	End(rc == LDAP_SUCCESS ? LDAP_OTHER : rc);
+}
+
+/**
+ * Count the entries of a page of search results and their size.
+ *
+ * @param msg The page of results.
+ */
+void LDAPTraceScope::AddEntries(LDAPMessage* msg)
+{
+	if (!_tracer)
+		return;
+
+	_event.entries += ldap_count_entries(_ld, msg);
+	_event.bytes += LDAPEntryDecoder::PageBytes(_ld, msg);
+}
+
+/**
+ * Finish reporting the operation.
+ *
+ * @param result LDAP result or API error code of the operation.
+ */
+void LDAPTraceScope::End(int result)
+{
+	LDAPTracer* tracer = _tracer;
+
+	if (!tracer)
+		return;
+
+	_tracer = 0;
+	_event.result = result;
+	tracer->OnEnd(_event);
+}
+}
@@ -0,0 +1,43 @@
+/*
+ * Scope guard reporting operations to the installed tracer.
+ * Internal to the library; not installed.
+ */
+
+#ifndef TRACER_H_
+#define TRACER_H_
+
+#include <string>
+#include "ldap++.h"
+#include <ldap.h>
+
+namespace ldap_client
+{
+/*
+ * Reports one operation to the installed tracer, if any; does nothing
+ * otherwise. OnEnd() is called on destruction if End() wasn't, with the
+ * last result code of the LDAP handle.
+ */
+class LDAPTraceScope
+{
+    public:
+	LDAPTraceScope(LDAP* ld, LDAPServerStats* stats, LDAPOperation op,
+		const std::string& dn, int scope = -1,
+		const std::string* filter = 0);
+	~LDAPTraceScope();
+
+	bool Active() const { return _tracer != 0; }
+	void SetMessageID(int msgid) { _event.msgid = msgid; }
+	void AddEntries(LDAPMessage* msg);
+	void End(int result);
+
+    private:
+	LDAPTraceScope(const LDAPTraceScope&);
+	LDAPTraceScope& operator=(const LDAPTraceScope&);
+
+	LDAPTracer* _tracer;
+	LDAP* _ld;
+	LDAPTraceEvent _event;
+};
+}
+
+#endif /* TRACER_H_ */
@@ -0,0 +1,170 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <string>
+#include <atomic>
+#include "ldap++.h"
+#include <ldap.h>
+#include <lber.h>
+
+namespace ldap_client
+{
+static int CounterSetup(Sockbuf_IO_Desc* sbiod, void* arg)
+{
+	sbiod->sbiod_pvt = arg;
+	return 0;
+}
+
+static int CounterCtrl(Sockbuf_IO_Desc* sbiod, int opt, void* arg)
+{
+	// ber_sockbuf_ctrl() asks every layer in turn.
+	return 0;
+}
+
+static ber_slen_t CounterRead(Sockbuf_IO_Desc* sbiod, void* buf,
+	ber_len_t len)
+{
+	ber_slen_t n = LBER_SBIOD_READ_NEXT(sbiod, buf, len);
+
+	((LDAPWireCounter*) sbiod->sbiod_pvt)->Add(false, n);
+	return n;
+}
+
+static ber_slen_t CounterWrite(Sockbuf_IO_Desc* sbiod, void* buf,
+	ber_len_t len)
+{
+	ber_slen_t n = LBER_SBIOD_WRITE_NEXT(sbiod, buf, len);
+
+	((LDAPWireCounter*) sbiod->sbiod_pvt)->Add(true, n);
+	return n;
+}
+
+static Sockbuf_IO k_CounterIO = {
+	CounterSetup, 0, CounterCtrl, CounterRead, CounterWrite, 0
+};
+
+/**
+ * @return The traffic between the other counters and these.
+ */
+LDAPIOCounters LDAPIOCounters::operator-(const LDAPIOCounters& other) const
+{
+	LDAPIOCounters diff;
+
+	diff.bytes_in = bytes_in - other.bytes_in;
+	diff.bytes_out = bytes_out - other.bytes_out;
+	diff.reads = reads - other.reads;
+	diff.writes = writes - other.writes;
+	return diff;
+}
+
+/**
+ * Create a counter which isn't installed on any handle yet.
+ *
+ * @param stats Statistics to add all traffic to, or NULL.
+ * @param op    Operation to account the traffic to in stats.
+ */
+LDAPWireCounter::LDAPWireCounter(LDAPServerStats* stats, LDAPOperation op)
+: _stats(stats), _op(op), _bytes_in(0), _bytes_out(0), _reads(0),
+	_writes(0)
+{
+	_callback.lc_add = Connected;
+	_callback.lc_del = Disconnected;
+	_callback.lc_arg = this;
+}
+
+/**
+ * Count the traffic of every connection the handle makes from now on,
+ * including the one it is already connected with. The counter must
+ * outlive the handle.
+ *
+ * @param ld The LDAP handle.
+ * @throws LDAPException The connection callback could not be set.
+ */
+void LDAPWireCounter::Install(LDAP* ld)
+{
+	Sockbuf* sb = 0;
+	int fd = -1;
+	int rc;
+
+	rc = ldap_set_option(ld, LDAP_OPT_CONNECT_CB, &_callback);
+	if (rc)
+		LDAPErrCode2Exception(ld, rc);
+
+	if (ldap_get_option(ld, LDAP_OPT_DESC, &fd) == LDAP_OPT_SUCCESS &&
+			fd >= 0 &&
+			ldap_get_option(ld, LDAP_OPT_SOCKBUF, &sb) == LDAP_OPT_SUCCESS &&
+			sb)
+		Connected(ld, sb, 0, 0, &_callback);
+}
+
+/**
+ * Count one read or write call on a socket.
+ *
+ * @param write Whether data was written rather than read.
+ * @param bytes Number of bytes transferred, or a negative value if the
+ *              call failed.
+ */
+void LDAPWireCounter::Add(bool write, long bytes)
+{
+	LDAPIOCounters io;
+	unsigned long long n = bytes > 0 ? bytes : 0;
+
+	if (write)
+	{
+		_writes.fetch_add(1, std::memory_order_relaxed);
+		_bytes_out.fetch_add(n, std::memory_order_relaxed);
+		io.writes = 1;
+		io.bytes_out = n;
+	}
+	else
+	{
+		_reads.fetch_add(1, std::memory_order_relaxed);
+		_bytes_in.fetch_add(n, std::memory_order_relaxed);
+		io.reads = 1;
+		io.bytes_in = n;
+	}
+
+	if (_stats)
+		_stats->AddIO(_op, io);
+}
+
+/**
+ * @return The traffic counted so far.
+ */
+LDAPIOCounters LDAPWireCounter::Get() const
+{
+	LDAPIOCounters io;
+
+	io.bytes_in = _bytes_in.load(std::memory_order_relaxed);
+	io.bytes_out = _bytes_out.load(std::memory_order_relaxed);
+	io.reads = _reads.load(std::memory_order_relaxed);
+	io.writes = _writes.load(std::memory_order_relaxed);
+	return io;
+}
+
+/**
+ * Called by libldap once a connection has been established, before the
+ * TCP layer is added and TLS is started. The layer goes just above the
+ * provider level, so it ends up between the two and sees the encrypted
+ * traffic.
+ */
+int LDAPWireCounter::Connected(LDAP* ld, Sockbuf* sb, LDAPURLDesc* srv,
+	struct sockaddr* addr, struct ldap_conncb* ctx)
+{
+	if (!ber_sockbuf_ctrl(sb, LBER_SB_OPT_HAS_IO, &k_CounterIO))
+		ber_sockbuf_add_io(sb, &k_CounterIO, LBER_SBIOD_LEVEL_PROVIDER + 1,
+			ctx->lc_arg);
+
+	// Failing to count must not fail the connection.
+	return 0;
+}
+
+/**
+ * Called by libldap before a connection is closed. The layer is removed
+ * along with the Sockbuf.
+ */
+void LDAPWireCounter::Disconnected(LDAP* ld, Sockbuf* sb,
+	struct ldap_conncb* ctx)
+{
+}
+}